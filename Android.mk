@@ -19,6 +19,15 @@ ifneq (,$(filter $(TARGET_PRODUCT), salvator ulcb kingfisher))
 LOCAL_PATH := $(call my-dir)
 TA_GATEKEEPER_SRC     := $(LOCAL_PATH)/ta
 TA_GATEKEEPER_UUID    := 4d573443-6a56-4272-ac6f2425af9ef9bb
+TA_GATEKEEPER_HOST    := $(LOCAL_PATH)/host
+
+GATEKEEPER_HAL_SRC_FILES := \
+    optee_gatekeeper_device.cpp \
+    optee_gatekeeper_metrics.cpp \
+    optee_fault_transport.cpp \
+    optee_ipc.cpp \
+    optee_ipc_pool.cpp \
+    optee_trace_transport.cpp
 
 ################################################################################
 # Build gatekeeper HAL                                                         #
@@ -35,8 +44,7 @@ LOCAL_CFLAGS                += -DANDROID_BUILD
 
 LOCAL_SRC_FILES := \
     service.cpp \
-    optee_gatekeeper_device.cpp \
-    optee_ipc.cpp
+    $(GATEKEEPER_HAL_SRC_FILES)
 
 LOCAL_C_INCLUDES := \
     vendor/renesas/utils/optee-client/public \
@@ -82,4 +90,110 @@ include $(BUILD_PREBUILT)
 
 $(LOCAL_BUILT_MODULE): $(TA_GATEKEEPER_BINARY)
 
+################################################################################
+# Build gatekeeper TA for host                                                 #
+################################################################################
+
+# TA sources linked with host implementation of TEE Internal API and
+# in-process libteec, so HAL can be run against the TA on build machine
+include $(CLEAR_VARS)
+LOCAL_MODULE                := libgatekeeper_ta_host
+LOCAL_MODULE_HOST_OS        := linux
+LOCAL_CONLYFLAGS            += -std=gnu99
+
+# Room for the 10k users of failure record benchmarks and load tests
+LOCAL_CFLAGS                += -DCFG_GATEKEEPER_FAILURE_RECORDS=16384
+LOCAL_EXPORT_CFLAGS         += -DCFG_GATEKEEPER_FAILURE_RECORDS=16384
+
+# Measure the HAL and TA without the password KDF, which only adds its
+# calibrated cost to every enroll and verify
+LOCAL_CFLAGS                += -DCFG_GATEKEEPER_KDF_TARGET_MS=0
+
+LOCAL_SRC_FILES := \
+    ta/gatekeeper_ta.c \
+    ta/failure_record.c \
+    ta/hmac_sha256.c \
+    host/tee_internal_api.cpp \
+    host/tee_client_api.cpp
+
+LOCAL_C_INCLUDES := \
+    vendor/renesas/utils/optee-client/public \
+    $(TA_GATEKEEPER_HOST)/include \
+    $(TA_GATEKEEPER_SRC)/include \
+    $(TA_GATEKEEPER_SRC)
+
+LOCAL_EXPORT_C_INCLUDE_DIRS := \
+    $(TA_GATEKEEPER_HOST)/include \
+    $(TA_GATEKEEPER_SRC)/include \
+    $(TA_GATEKEEPER_SRC)
+
+LOCAL_STATIC_LIBRARIES := libcrypto_static
+
+include $(BUILD_HOST_STATIC_LIBRARY)
+
+################################################################################
+# Build gatekeeper HAL benchmarks for host                                     #
+################################################################################
+include $(CLEAR_VARS)
+LOCAL_MODULE                := android.hardware.gatekeeper@1.0-benchmark.renesas
+LOCAL_MODULE_HOST_OS        := linux
+LOCAL_MODULE_TAGS           := optional
+LOCAL_CFLAGS                += -DANDROID_BUILD
+
+LOCAL_SRC_FILES := \
+    benchmark/gatekeeper_benchmark.cpp \
+    $(GATEKEEPER_HAL_SRC_FILES)
+
+LOCAL_C_INCLUDES := \
+    $(LOCAL_PATH) \
+    vendor/renesas/utils/optee-client/public \
+    hardware/libhardware/include
+
+LOCAL_STATIC_LIBRARIES := \
+    libgatekeeper_ta_host \
+    libgoogle-benchmark \
+    libcrypto_static
+
+LOCAL_SHARED_LIBRARIES := \
+    liblog \
+    libcutils \
+    libhidlbase \
+    libhidltransport \
+    libutils \
+    android.hardware.gatekeeper@1.0
+
+include $(BUILD_HOST_EXECUTABLE)
+
+################################################################################
+# Build gatekeeper HAL load generator for host                                 #
+################################################################################
+include $(CLEAR_VARS)
+LOCAL_MODULE                := android.hardware.gatekeeper@1.0-load.renesas
+LOCAL_MODULE_HOST_OS        := linux
+LOCAL_MODULE_TAGS           := optional
+LOCAL_CFLAGS                += -DANDROID_BUILD
+
+LOCAL_SRC_FILES := \
+    host/gatekeeper_load.cpp \
+    $(GATEKEEPER_HAL_SRC_FILES)
+
+LOCAL_C_INCLUDES := \
+    $(LOCAL_PATH) \
+    vendor/renesas/utils/optee-client/public \
+    hardware/libhardware/include
+
+LOCAL_STATIC_LIBRARIES := \
+    libgatekeeper_ta_host \
+    libcrypto_static
+
+LOCAL_SHARED_LIBRARIES := \
+    liblog \
+    libcutils \
+    libhidlbase \
+    libhidltransport \
+    libutils \
+    android.hardware.gatekeeper@1.0
+
+include $(BUILD_HOST_EXECUTABLE)
+
 endif # Include only for Renesas ones.
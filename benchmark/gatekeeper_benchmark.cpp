@@ -0,0 +1,812 @@
+/*
+ *
+ * Copyright (C) 2017 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host benchmarks of enroll/verify path. TA sources run in-process on top
+ * of host TEE emulation, see host/ directory.
+ *
+ * Results are printed as JSON unless --benchmark_format is given.
+ */
+
+#include <string.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+extern "C" {
+#include <tee_client_api.h>
+#include <tee_internal_api.h>
+#include "failure_record.h"
+#include "hmac_sha256.h"
+}
+#include <gatekeeper_ipc.h>
+
+#include "optee_gatekeeper_device.h"
+
+using android::hardware::gatekeeper::V1_0::GatekeeperResponse;
+using android::hardware::gatekeeper::V1_0::GatekeeperStatusCode;
+using android::hardware::gatekeeper::V1_0::renesas::OpteeGateKeeperDevice;
+using android::hardware::hidl_vec;
+
+namespace {
+
+const uint32_t BENCHMARK_UID = 10;
+const uint64_t BENCHMARK_CHALLENGE = 0x0123456789abcdefULL;
+
+/*
+ * Plain libteec session to the TA, used to measure TA commands without
+ * HAL overhead
+ */
+class TaSession {
+public:
+    TaSession() : ok_(false)
+    {
+        const TEEC_UUID uuid = TA_GATEKEEPER_UUID;
+        uint32_t origin;
+
+        if (TEEC_InitializeContext(NULL, &ctx_) != TEEC_SUCCESS) {
+            return;
+        }
+        ok_ = TEEC_OpenSession(&ctx_, &sess_, &uuid, TEEC_LOGIN_PUBLIC,
+                NULL, NULL, &origin) == TEEC_SUCCESS;
+    }
+
+    bool ok() const { return ok_; }
+
+    TEEC_Result invoke(uint32_t cmd, const std::vector<uint8_t>& request,
+            std::vector<uint8_t>& response)
+    {
+        TEEC_Operation op;
+        uint32_t origin;
+
+        memset(&op, 0, sizeof(op));
+        op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
+                TEEC_MEMREF_TEMP_OUTPUT, TEEC_NONE, TEEC_NONE);
+        op.params[0].tmpref.buffer = const_cast<uint8_t *>(request.data());
+        op.params[0].tmpref.size = request.size();
+        op.params[1].tmpref.buffer = response.data();
+        op.params[1].tmpref.size = response.size();
+
+        TEEC_Result res = TEEC_InvokeCommand(&sess_, cmd, &op, &origin);
+        response.resize(op.params[1].tmpref.size);
+        return res;
+    }
+
+private:
+    TEEC_Context ctx_;
+    TEEC_Session sess_;
+    bool ok_;
+};
+
+TaSession& Ta()
+{
+    static TaSession *session = new TaSession;
+    return *session;
+}
+
+OpteeGateKeeperDevice& Device()
+{
+    static OpteeGateKeeperDevice *device = new OpteeGateKeeperDevice(1);
+    return *device;
+}
+
+gk_blob_t Blob(const std::vector<uint8_t>& data)
+{
+    gk_blob_t value;
+    value.data = data.data();
+    value.length = data.size();
+    return value;
+}
+
+std::vector<uint8_t> EnrollRequest(const std::vector<uint8_t>& password,
+        const std::vector<uint8_t>& current_password,
+        const std::vector<uint8_t>& current_handle)
+{
+    gk_enroll_request_t req;
+    req.uid = BENCHMARK_UID;
+    req.desired_password = Blob(password);
+    req.current_password = Blob(current_password);
+    req.current_password_handle = Blob(current_handle);
+
+    std::vector<uint8_t> request(gk_enroll_request_size(&req));
+    gk_enroll_request_encode(request.data(), request.size(), &req);
+    return request;
+}
+
+gk_verify_request_t VerifyMessage(const std::vector<uint8_t>& handle,
+        const std::vector<uint8_t>& password)
+{
+    gk_verify_request_t req;
+    req.uid = BENCHMARK_UID;
+    req.challenge = BENCHMARK_CHALLENGE;
+    req.enrolled_password_handle = Blob(handle);
+    req.provided_password = Blob(password);
+    return req;
+}
+
+std::vector<uint8_t> VerifyRequest(const std::vector<uint8_t>& handle,
+        const std::vector<uint8_t>& password)
+{
+    gk_verify_request_t req = VerifyMessage(handle, password);
+
+    std::vector<uint8_t> request(gk_verify_request_size(&req));
+    gk_verify_request_encode(request.data(), request.size(), &req);
+    return request;
+}
+
+/*
+ * Enrolls @password directly in TA and returns new password handle
+ */
+std::vector<uint8_t> TaEnroll(const std::vector<uint8_t>& password)
+{
+    std::vector<uint8_t> response(GK_ENROLL_RESPONSE_SIZE);
+    std::vector<uint8_t> handle;
+
+    if (Ta().invoke(GK_ENROLL, EnrollRequest(password, {}, {}), response) !=
+            TEEC_SUCCESS) {
+        return handle;
+    }
+
+    gk_enroll_response_t rsp;
+    if (!gk_enroll_response_decode(&rsp, response.data(), response.size()) ||
+            rsp.error != ERROR_NONE) {
+        return handle;
+    }
+    handle.assign(rsp.password_handle.data,
+            rsp.password_handle.data + rsp.password_handle.length);
+    return handle;
+}
+
+void SetView(hidl_vec<uint8_t>& vec, const std::vector<uint8_t>& data)
+{
+    vec.setToExternal(const_cast<uint8_t *>(data.data()), data.size());
+}
+
+}  // namespace
+
+/*
+ * Hand-written serialization helpers of gatekeeper_ipc.h against encoders
+ * and decoders generated from the wire schema
+ */
+
+static void BM_SerializeVerifyRequest(benchmark::State& state)
+{
+    std::vector<uint8_t> password(state.range(0), 'p');
+    std::vector<uint8_t> handle(GK_PASSWORD_HANDLE_SIZE, 'h');
+    std::vector<uint8_t> request(sizeof(uint32_t) * 3 + sizeof(uint64_t) +
+            handle.size() + password.size());
+
+    for (auto _ : state) {
+        uint8_t *i_req = request.data();
+        serialize_int(&i_req, BENCHMARK_UID);
+        serialize_int64(&i_req, BENCHMARK_CHALLENGE);
+        serialize_blob(&i_req, handle.data(), handle.size());
+        serialize_blob(&i_req, password.data(), password.size());
+        benchmark::DoNotOptimize(i_req);
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * request.size());
+}
+BENCHMARK(BM_SerializeVerifyRequest)->Arg(4)->Arg(16)->Arg(64)->Arg(1024);
+
+static void BM_DeserializeVerifyRequest(benchmark::State& state)
+{
+    std::vector<uint8_t> password(state.range(0), 'p');
+    std::vector<uint8_t> handle(GK_PASSWORD_HANDLE_SIZE, 'h');
+    std::vector<uint8_t> request = VerifyRequest(handle, password);
+
+    for (auto _ : state) {
+        const uint8_t *i_req = request.data();
+        uint32_t uid;
+        uint64_t challenge;
+        const uint8_t *handle_data;
+        uint32_t handle_length;
+        const uint8_t *password_data;
+        uint32_t password_length;
+
+        deserialize_int(&i_req, &uid);
+        deserialize_int64(&i_req, &challenge);
+        deserialize_blob(&i_req, &handle_data, &handle_length);
+        deserialize_blob(&i_req, &password_data, &password_length);
+        benchmark::DoNotOptimize(get_size(request.data(), i_req) <=
+                request.size());
+        benchmark::DoNotOptimize(uid);
+        benchmark::DoNotOptimize(challenge);
+        benchmark::DoNotOptimize(handle_data);
+        benchmark::DoNotOptimize(handle_length);
+        benchmark::DoNotOptimize(password_data);
+        benchmark::DoNotOptimize(password_length);
+    }
+    state.SetBytesProcessed(state.iterations() * request.size());
+}
+BENCHMARK(BM_DeserializeVerifyRequest)->Arg(4)->Arg(16)->Arg(64)->Arg(1024);
+
+static void BM_EncodeVerifyRequest(benchmark::State& state)
+{
+    std::vector<uint8_t> password(state.range(0), 'p');
+    std::vector<uint8_t> handle(GK_PASSWORD_HANDLE_SIZE, 'h');
+    gk_verify_request_t req = VerifyMessage(handle, password);
+    std::vector<uint8_t> request(gk_verify_request_size(&req));
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(req);
+        uint8_t *end = gk_verify_request_encode(request.data(),
+                gk_verify_request_size(&req), &req);
+        benchmark::DoNotOptimize(end);
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * request.size());
+}
+BENCHMARK(BM_EncodeVerifyRequest)->Arg(4)->Arg(16)->Arg(64)->Arg(1024);
+
+static void BM_DecodeVerifyRequest(benchmark::State& state)
+{
+    std::vector<uint8_t> password(state.range(0), 'p');
+    std::vector<uint8_t> handle(GK_PASSWORD_HANDLE_SIZE, 'h');
+    std::vector<uint8_t> request = VerifyRequest(handle, password);
+
+    for (auto _ : state) {
+        gk_verify_request_t req;
+        benchmark::DoNotOptimize(gk_verify_request_decode(&req,
+                    request.data(), request.size()));
+        benchmark::DoNotOptimize(req);
+    }
+    state.SetBytesProcessed(state.iterations() * request.size());
+}
+BENCHMARK(BM_DecodeVerifyRequest)->Arg(4)->Arg(16)->Arg(64)->Arg(1024);
+
+static void BM_DecodeVerifyResponse(benchmark::State& state)
+{
+    std::vector<uint8_t> token(GK_AUTH_TOKEN_SIZE, 't');
+    std::vector<uint8_t> response(GK_VERIFY_RESPONSE_SIZE);
+    gk_verify_response_t rsp;
+
+    rsp.error = ERROR_NONE;
+    rsp.retry_timeout = 0;
+    rsp.auth_token = Blob(token);
+    rsp.request_reenroll = 0;
+    uint8_t *end = gk_verify_response_encode(response.data(),
+            response.size(), &rsp);
+    response.resize(end - response.data());
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(gk_verify_response_decode(&rsp,
+                    response.data(), response.size()));
+        benchmark::DoNotOptimize(rsp);
+    }
+}
+BENCHMARK(BM_DecodeVerifyResponse);
+
+/*
+ * TA commands, without HAL
+ */
+
+static void BM_TaEnroll(benchmark::State& state)
+{
+    std::vector<uint8_t> password(state.range(0), 'p');
+    std::vector<uint8_t> request = EnrollRequest(password, {}, {});
+    std::vector<uint8_t> response;
+
+    if (!Ta().ok()) {
+        state.SkipWithError("Cannot open TA session");
+        return;
+    }
+
+    for (auto _ : state) {
+        response.resize(GK_ENROLL_RESPONSE_SIZE);
+        if (Ta().invoke(GK_ENROLL, request, response) != TEEC_SUCCESS) {
+            state.SkipWithError("Enroll failed");
+            break;
+        }
+    }
+}
+BENCHMARK(BM_TaEnroll)->Arg(4)->Arg(64);
+
+static void BM_TaVerify(benchmark::State& state)
+{
+    std::vector<uint8_t> password(state.range(0), 'p');
+    std::vector<uint8_t> handle = TaEnroll(password);
+    std::vector<uint8_t> request = VerifyRequest(handle, password);
+    std::vector<uint8_t> response;
+
+    if (handle.empty()) {
+        state.SkipWithError("Cannot enroll password");
+        return;
+    }
+
+    for (auto _ : state) {
+        response.resize(GK_VERIFY_RESPONSE_SIZE);
+        if (Ta().invoke(GK_VERIFY, request, response) != TEEC_SUCCESS) {
+            state.SkipWithError("Verify failed");
+            break;
+        }
+    }
+}
+BENCHMARK(BM_TaVerify)->Arg(4)->Arg(64);
+
+/*
+ * Wrong password, after first few attempts every call is throttled
+ */
+static void BM_TaVerifyThrottled(benchmark::State& state)
+{
+    std::vector<uint8_t> password(4, 'p');
+    std::vector<uint8_t> wrong_password(4, 'w');
+    std::vector<uint8_t> handle = TaEnroll(password);
+    std::vector<uint8_t> request = VerifyRequest(handle, wrong_password);
+    std::vector<uint8_t> response;
+
+    if (handle.empty()) {
+        state.SkipWithError("Cannot enroll password");
+        return;
+    }
+
+    for (auto _ : state) {
+        response.resize(GK_VERIFY_RESPONSE_SIZE);
+        if (Ta().invoke(GK_VERIFY, request, response) != TEEC_SUCCESS) {
+            state.SkipWithError("Verify failed");
+            break;
+        }
+    }
+}
+BENCHMARK(BM_TaVerifyThrottled);
+
+/*
+ * Range verifies sent with one GK_VERIFY_BATCH, items per second are
+ * comparable with BM_TaVerify
+ */
+static void BM_TaVerifyBatch(benchmark::State& state)
+{
+    const uint32_t count = state.range(0);
+    std::vector<uint8_t> password(4, 'p');
+    std::vector<uint8_t> handle = TaEnroll(password);
+    std::vector<uint8_t> response;
+
+    if (handle.empty()) {
+        state.SkipWithError("Cannot enroll password");
+        return;
+    }
+
+    gk_verify_batch_request_t header;
+    gk_verify_request_t req = VerifyMessage(handle, password);
+    header.count = count;
+    std::vector<uint8_t> request(gk_verify_batch_request_size(&header) +
+            count * gk_verify_request_size(&req));
+    uint8_t *iter = gk_verify_batch_request_encode(request.data(),
+            request.size(), &header);
+    for (uint32_t i = 0; i < count; i++) {
+        iter = gk_verify_request_encode(iter,
+                request.size() - (iter - request.data()), &req);
+    }
+
+    for (auto _ : state) {
+        response.resize(GK_VERIFY_BATCH_RESPONSE_SIZE);
+        if (Ta().invoke(GK_VERIFY_BATCH, request, response) != TEEC_SUCCESS) {
+            state.SkipWithError("Verify batch failed");
+            break;
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_TaVerifyBatch)->Arg(1)->Arg(4)->Arg(GK_VERIFY_BATCH_MAX);
+
+/*
+ * Failure record table, range is number of users in the table, each of
+ * its own Android uid. Host builds size the table for 10k users, see
+ * CFG_GATEKEEPER_FAILURE_RECORDS.
+ */
+
+static bool FillFailureRecords(benchmark::State& state, uint32_t users)
+{
+    failure_record_t record;
+
+    if (users > MAX_FAILURE_RECORDS) {
+        state.SkipWithError("Table is too small, raise "
+                "CFG_GATEKEEPER_FAILURE_RECORDS");
+        return false;
+    }
+
+    InitFailureRecords();
+    for (uint32_t i = 0; i < users; i++) {
+        record.secure_user_id = i + 1;
+        record.uid = i + 1;
+        record.failure_counter = 1;
+        record.last_checked_timestamp = i;
+        WriteFailureRecord(&record);
+    }
+    return true;
+}
+
+static void BM_FailureRecordGet(benchmark::State& state)
+{
+    const uint32_t users = state.range(0);
+    failure_record_t record;
+
+    if (!FillFailureRecords(state, users)) {
+        return;
+    }
+    for (auto _ : state) {
+        GetFailureRecord(users, &record);
+        benchmark::DoNotOptimize(record);
+    }
+}
+BENCHMARK(BM_FailureRecordGet)->Arg(1)->Arg(32)->Arg(10000);
+
+static void BM_FailureRecordIncrement(benchmark::State& state)
+{
+    const uint32_t users = state.range(0);
+    failure_record_t record;
+    uint64_t timestamp = 0;
+
+    if (!FillFailureRecords(state, users)) {
+        return;
+    }
+    GetFailureRecord(users, &record);
+    for (auto _ : state) {
+        IncrementFailureRecord(&record, ++timestamp);
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(BM_FailureRecordIncrement)->Arg(1)->Arg(32)->Arg(10000);
+
+/*
+ * New user gets a record and succeeds, so the table keeps its size
+ */
+static void BM_FailureRecordWriteNewUser(benchmark::State& state)
+{
+    const uint32_t users = state.range(0);
+    failure_record_t record;
+    secure_id_t user_id = users;
+
+    if (!FillFailureRecords(state, users)) {
+        return;
+    }
+    record.failure_counter = 1;
+    for (auto _ : state) {
+        record.secure_user_id = ++user_id;
+        record.uid = user_id;
+        record.last_checked_timestamp = user_id;
+        WriteFailureRecord(&record);
+        ClearFailureRecord(user_id);
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(BM_FailureRecordWriteNewUser)->Arg(1)->Arg(32)->Arg(10000);
+
+/*
+ * Same as BM_FailureRecordWriteNewUser, but the record goes away with its
+ * Android user through the list of records of its uid
+ */
+static void BM_FailureRecordDeleteUser(benchmark::State& state)
+{
+    const uint32_t users = state.range(0);
+    failure_record_t record;
+    secure_id_t user_id = users;
+
+    if (!FillFailureRecords(state, users)) {
+        return;
+    }
+    record.failure_counter = 1;
+    for (auto _ : state) {
+        record.secure_user_id = ++user_id;
+        record.uid = user_id;
+        record.last_checked_timestamp = user_id;
+        WriteFailureRecord(&record);
+        DeleteUserFailureRecords(record.uid);
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(BM_FailureRecordDeleteUser)->Arg(1)->Arg(32)->Arg(10000);
+
+/*
+ * New user of a full table drops the record with the fewest failures
+ */
+static void BM_FailureRecordEvict(benchmark::State& state)
+{
+    failure_record_t record;
+    secure_id_t user_id = MAX_FAILURE_RECORDS;
+
+    FillFailureRecords(state, MAX_FAILURE_RECORDS);
+    record.failure_counter = 1;
+    for (auto _ : state) {
+        record.secure_user_id = ++user_id;
+        record.uid = user_id;
+        record.last_checked_timestamp = user_id;
+        WriteFailureRecord(&record);
+        benchmark::ClobberMemory();
+    }
+    state.counters["users"] = MAX_FAILURE_RECORDS;
+}
+BENCHMARK(BM_FailureRecordEvict);
+
+/*
+ * Journal write of range records changed by one command, compaction
+ * included. Set GATEKEEPER_TEE_STORAGE to measure with storage on disk.
+ */
+static void BM_FailureRecordCommit(benchmark::State& state)
+{
+    const uint32_t changed = state.range(0);
+    failure_record_t record;
+    uint64_t timestamp = 0;
+
+    if (LoadFailureRecords() != TEE_SUCCESS) {
+        state.SkipWithError("Cannot load failure record journal");
+        return;
+    }
+
+    FillFailureRecords(state, changed);
+    for (auto _ : state) {
+        for (uint32_t i = 1; i <= changed; i++) {
+            GetFailureRecord(i, &record);
+            IncrementFailureRecord(&record, ++timestamp);
+        }
+        if (CommitFailureRecords() != TEE_SUCCESS) {
+            state.SkipWithError("Commit failed");
+            break;
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * changed);
+}
+BENCHMARK(BM_FailureRecordCommit)->Arg(1)->Arg(GK_VERIFY_BATCH_MAX);
+
+static void BM_ThrottleRequest(benchmark::State& state)
+{
+    failure_record_t record;
+    uint32_t timeout = 0;
+
+    record.secure_user_id = 1;
+    record.failure_counter = state.range(0);
+    record.last_checked_timestamp = 1000;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(ThrottleRequest(&record, 2000, &timeout));
+    }
+}
+BENCHMARK(BM_ThrottleRequest)->Arg(0)->Arg(5)->Arg(50);
+
+/*
+ * HMAC-SHA256 of the TA: resident TEE_ALG_HMAC_SHA256 operation against
+ * key midstates of hmac_sha256.c. 32 bytes is a KDF iteration, 69 bytes
+ * an auth token. On host the GP operation is OpenSSL without syscalls,
+ * so the gap on target is wider.
+ */
+static const uint8_t HMAC_KEY[SHA256_DIGEST_SIZE] = {0x5a};
+
+static void BM_HmacGp(benchmark::State& state)
+{
+    std::vector<uint8_t> message(state.range(0), 'm');
+    uint8_t mac[SHA256_DIGEST_SIZE];
+    uint32_t mac_length;
+    TEE_ObjectHandle key = TEE_HANDLE_NULL;
+    TEE_OperationHandle op = TEE_HANDLE_NULL;
+    TEE_Attribute attr;
+
+    TEE_AllocateTransientObject(TEE_TYPE_HMAC_SHA256, 8 * sizeof(HMAC_KEY),
+            &key);
+    TEE_InitRefAttribute(&attr, TEE_ATTR_SECRET_VALUE, (void *)HMAC_KEY,
+            sizeof(HMAC_KEY));
+    TEE_PopulateTransientObject(key, &attr, 1);
+    TEE_AllocateOperation(&op, TEE_ALG_HMAC_SHA256, TEE_MODE_MAC,
+            8 * sizeof(HMAC_KEY));
+    TEE_SetOperationKey(op, key);
+    TEE_FreeTransientObject(key);
+
+    for (auto _ : state) {
+        mac_length = sizeof(mac);
+        TEE_ResetOperation(op);
+        TEE_MACInit(op, NULL, 0);
+        TEE_MACComputeFinal(op, message.data(), message.size(), mac,
+                &mac_length);
+        benchmark::DoNotOptimize(mac);
+    }
+    TEE_FreeOperation(op);
+    state.SetBytesProcessed(state.iterations() * message.size());
+}
+BENCHMARK(BM_HmacGp)->Arg(32)->Arg(69)->Arg(1024);
+
+static void BM_HmacInTa(benchmark::State& state)
+{
+    std::vector<uint8_t> message(state.range(0), 'm');
+    uint8_t mac[SHA256_DIGEST_SIZE];
+    hmac_sha256_key_t key;
+
+    HmacSha256SetKey(&key, HMAC_KEY, sizeof(HMAC_KEY));
+    for (auto _ : state) {
+        HmacSha256(&key, message.data(), message.size(), mac);
+        benchmark::DoNotOptimize(mac);
+    }
+    state.SetBytesProcessed(state.iterations() * message.size());
+    state.SetLabel(HmacSha256Engine());
+}
+BENCHMARK(BM_HmacInTa)->Arg(32)->Arg(69)->Arg(1024);
+
+/*
+ * Full HAL round trips
+ */
+
+static void BM_DeviceEnroll(benchmark::State& state)
+{
+    std::vector<uint8_t> password(state.range(0), 'p');
+    hidl_vec<uint8_t> empty;
+    hidl_vec<uint8_t> desired;
+    bool ok = true;
+
+    SetView(desired, password);
+    for (auto _ : state) {
+        Device().enroll(BENCHMARK_UID, empty, empty, desired,
+                [&ok](const GatekeeperResponse& rsp) {
+                    ok = rsp.code == GatekeeperStatusCode::STATUS_OK;
+                });
+        if (!ok) {
+            state.SkipWithError("Enroll failed");
+            break;
+        }
+    }
+}
+BENCHMARK(BM_DeviceEnroll)->Arg(4)->Arg(64);
+
+static void BM_DeviceVerify(benchmark::State& state)
+{
+    std::vector<uint8_t> password(state.range(0), 'p');
+    std::vector<uint8_t> handle;
+    hidl_vec<uint8_t> empty;
+    hidl_vec<uint8_t> provided;
+    hidl_vec<uint8_t> enrolled;
+    bool ok = true;
+
+    SetView(provided, password);
+    Device().enroll(BENCHMARK_UID, empty, empty, provided,
+            [&handle](const GatekeeperResponse& rsp) {
+                if (rsp.code == GatekeeperStatusCode::STATUS_OK) {
+                    handle.assign(rsp.data.data(),
+                            rsp.data.data() + rsp.data.size());
+                }
+            });
+    if (handle.empty()) {
+        state.SkipWithError("Cannot enroll password");
+        return;
+    }
+
+    SetView(enrolled, handle);
+    for (auto _ : state) {
+        Device().verify(BENCHMARK_UID, BENCHMARK_CHALLENGE, enrolled,
+                provided, [&ok](const GatekeeperResponse& rsp) {
+                    ok = rsp.code == GatekeeperStatusCode::STATUS_OK;
+                });
+        if (!ok) {
+            state.SkipWithError("Verify failed");
+            break;
+        }
+    }
+}
+BENCHMARK(BM_DeviceVerify)->Arg(4)->Arg(64);
+
+/*
+ * Verify of a locked out user, answered from the HAL lockout cache
+ */
+static void BM_DeviceVerifyLockedOut(benchmark::State& state)
+{
+    const uint32_t uid = BENCHMARK_UID + GK_VERIFY_BATCH_MAX + 1;
+    std::vector<uint8_t> password(4, 'p');
+    std::vector<uint8_t> wrong(4, 'w');
+    std::vector<uint8_t> handle;
+    hidl_vec<uint8_t> empty;
+    hidl_vec<uint8_t> provided;
+    hidl_vec<uint8_t> enrolled;
+    GatekeeperStatusCode code = GatekeeperStatusCode::STATUS_OK;
+
+    SetView(provided, password);
+    Device().enroll(uid, empty, empty, provided,
+            [&handle](const GatekeeperResponse& rsp) {
+                if (rsp.code == GatekeeperStatusCode::STATUS_OK) {
+                    handle.assign(rsp.data.data(),
+                            rsp.data.data() + rsp.data.size());
+                }
+            });
+    if (handle.empty()) {
+        state.SkipWithError("Cannot enroll password");
+        return;
+    }
+
+    SetView(enrolled, handle);
+    SetView(provided, wrong);
+    auto cb = [&code](const GatekeeperResponse& rsp) { code = rsp.code; };
+    for (int i = 0; i < 10 &&
+            code != GatekeeperStatusCode::ERROR_RETRY_TIMEOUT; i++) {
+        Device().verify(uid, BENCHMARK_CHALLENGE, enrolled, provided, cb);
+    }
+
+    for (auto _ : state) {
+        Device().verify(uid, BENCHMARK_CHALLENGE, enrolled, provided, cb);
+        if (code != GatekeeperStatusCode::ERROR_RETRY_TIMEOUT) {
+            state.SkipWithError("User is not locked out");
+            break;
+        }
+    }
+}
+BENCHMARK(BM_DeviceVerifyLockedOut);
+
+/*
+ * Verifies of different users from several threads through one session,
+ * so queued calls are coalesced into GK_VERIFY_BATCH
+ */
+static void BM_DeviceVerifyConcurrent(benchmark::State& state)
+{
+    static std::atomic<uint32_t> next_uid(BENCHMARK_UID);
+    const uint32_t uid = next_uid++;
+    std::vector<uint8_t> password(4, 'p');
+    std::vector<uint8_t> handle;
+    hidl_vec<uint8_t> empty;
+    hidl_vec<uint8_t> provided;
+    hidl_vec<uint8_t> enrolled;
+    bool ok = true;
+
+    SetView(provided, password);
+    Device().enroll(uid, empty, empty, provided,
+            [&handle](const GatekeeperResponse& rsp) {
+                if (rsp.code == GatekeeperStatusCode::STATUS_OK) {
+                    handle.assign(rsp.data.data(),
+                            rsp.data.data() + rsp.data.size());
+                }
+            });
+    if (handle.empty()) {
+        state.SkipWithError("Cannot enroll password");
+        return;
+    }
+
+    SetView(enrolled, handle);
+    for (auto _ : state) {
+        Device().verify(uid, BENCHMARK_CHALLENGE, enrolled, provided,
+                [&ok](const GatekeeperResponse& rsp) {
+                    ok = rsp.code == GatekeeperStatusCode::STATUS_OK;
+                });
+        if (!ok) {
+            state.SkipWithError("Verify failed");
+            break;
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_DeviceVerifyConcurrent)->ThreadRange(1, GK_VERIFY_BATCH_MAX)
+    ->UseRealTime();
+
+int main(int argc, char **argv)
+{
+    static char json_format[] = "--benchmark_format=json";
+    std::vector<char *> args(argv, argv + argc);
+    bool has_format = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strncmp(argv[i], "--benchmark_format", 18)) {
+            has_format = true;
+        }
+    }
+    if (!has_format) {
+        args.insert(args.begin() + 1, json_format);
+    }
+
+    int count = args.size();
+    args.push_back(nullptr);
+    benchmark::Initialize(&count, args.data());
+    if (benchmark::ReportUnrecognizedArguments(count, args.data())) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+
+    return 0;
+}
@@ -0,0 +1,360 @@
+/*
+ *
+ * Copyright (C) 2017 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Load generator for gatekeeper HAL running on top of host TA emulator.
+ * Enrolls a set of users and then verifies their passwords from several
+ * threads, reporting latency percentiles and HAL metrics. Run it under
+ * perf, valgrind or any other Linux tool to profile HAL together with TA.
+ *
+ * TA calls can be recorded to a trace, served from a recorded trace
+ * instead of the emulator, and delayed or failed at random to see how HAL
+ * behaves with slow or flaky TEE.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cutils/native_handle.h>
+
+#include "optee_fault_transport.h"
+#include "optee_gatekeeper_device.h"
+#include "optee_ipc.h"
+#include "optee_trace_transport.h"
+
+using android::hardware::gatekeeper::V1_0::GatekeeperResponse;
+using android::hardware::gatekeeper::V1_0::GatekeeperStatusCode;
+using android::hardware::gatekeeper::V1_0::renesas::FaultConfig;
+using android::hardware::gatekeeper::V1_0::renesas::CallDeadlines;
+using android::hardware::gatekeeper::V1_0::renesas::FaultTransport;
+using android::hardware::gatekeeper::V1_0::renesas::OpteeGateKeeperDevice;
+using android::hardware::gatekeeper::V1_0::renesas::OpteeIPC;
+using android::hardware::gatekeeper::V1_0::renesas::RecordingTransport;
+using android::hardware::gatekeeper::V1_0::renesas::ReplayTransport;
+using android::hardware::gatekeeper::V1_0::renesas::TeeTransport;
+using android::hardware::gatekeeper::V1_0::renesas::TraceReader;
+using android::hardware::gatekeeper::V1_0::renesas::TraceWriter;
+using android::hardware::gatekeeper::V1_0::renesas::TransportFactory;
+using android::hardware::hidl_handle;
+using android::hardware::hidl_string;
+using android::hardware::hidl_vec;
+
+namespace {
+
+struct Options {
+    uint32_t threads = 4;
+    uint32_t sessions = 1;
+    uint32_t users = 16;
+    uint32_t requests = 1000;
+    uint32_t wrongPercent = 0;
+    const char *recordPath = nullptr;
+    const char *replayPath = nullptr;
+    FaultConfig fault;
+    CallDeadlines deadlines;
+};
+
+struct ThreadResult {
+    std::vector<uint64_t> latencyUs;
+    std::map<int32_t, uint64_t> codes;
+};
+
+void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-t threads] [-s sessions] [-u users] [-n requests]"
+            " [-w wrong_percent] [-R trace] [-P trace] [-d delay_us]"
+            " [-j jitter_us] [-e error_permille] [-T timeout_ms]\n"
+            "  -t  number of verifying threads (default 4)\n"
+            "  -s  number of TA sessions of HAL (default 1)\n"
+            "  -u  number of enrolled users (default 16)\n"
+            "  -n  verify requests per thread (default 1000)\n"
+            "  -w  percent of verifies with wrong password (default 0)\n"
+            "  -R  record TA calls to trace file\n"
+            "  -P  serve TA calls from trace file instead of TA\n"
+            "  -d  delay every TA call by given time\n"
+            "  -j  delay every TA call by up to given random time\n"
+            "  -e  fail given share of TA calls with TEEC error\n"
+            "  -T  cancel verify calls after given time (default 2000)\n"
+            "Environment:\n"
+            "  GATEKEEPER_TEE_STORAGE         keep TA storage in directory\n"
+            "  GATEKEEPER_TEE_INVOKE_DELAY_US delay of every TA command\n",
+            name);
+}
+
+bool parseOptions(int argc, char **argv, Options *options)
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:s:u:n:w:R:P:d:j:e:T:h")) != -1) {
+        uint32_t value = strtoul(optarg ? optarg : "0", nullptr, 10);
+        switch (opt) {
+        case 't':
+            options->threads = value;
+            break;
+        case 's':
+            options->sessions = value;
+            break;
+        case 'u':
+            options->users = value;
+            break;
+        case 'n':
+            options->requests = value;
+            break;
+        case 'w':
+            options->wrongPercent = value;
+            break;
+        case 'R':
+            options->recordPath = optarg;
+            break;
+        case 'P':
+            options->replayPath = optarg;
+            break;
+        case 'd':
+            options->fault.delayUs = value;
+            break;
+        case 'j':
+            options->fault.jitterUs = value;
+            break;
+        case 'e':
+            options->fault.errorPermille = value;
+            break;
+        case 'T':
+            options->deadlines.verifyMs = value;
+            break;
+        default:
+            return false;
+        }
+    }
+
+    return options->threads && options->sessions && options->users &&
+        options->wrongPercent <= 100 && options->fault.errorPermille <= 1000;
+}
+
+/*
+ * Emulator or trace, optionally disturbed by faults and recorded
+ */
+bool transportFactory(const Options& options, TransportFactory *factory)
+{
+    std::shared_ptr<TraceReader> reader;
+    std::shared_ptr<TraceWriter> writer;
+    const FaultConfig fault = options.fault;
+    const bool faulty = fault.delayUs || fault.jitterUs ||
+        fault.errorPermille;
+
+    if (options.replayPath) {
+        reader = TraceReader::open(options.replayPath);
+        if (!reader) {
+            fprintf(stderr, "Cannot load trace %s\n", options.replayPath);
+            return false;
+        }
+    }
+    if (options.recordPath) {
+        writer = TraceWriter::open(options.recordPath);
+        if (!writer) {
+            fprintf(stderr, "Cannot create trace %s\n", options.recordPath);
+            return false;
+        }
+    }
+
+    *factory = [reader, writer, fault, faulty] {
+        std::unique_ptr<TeeTransport> transport;
+        if (reader) {
+            transport.reset(new ReplayTransport(reader));
+        } else {
+            transport.reset(new OpteeIPC);
+        }
+        if (faulty) {
+            transport.reset(new FaultTransport(std::move(transport), fault));
+        }
+        if (writer) {
+            transport.reset(new RecordingTransport(std::move(transport),
+                        writer));
+        }
+        return transport;
+    };
+
+    return true;
+}
+
+std::vector<uint8_t> password(uint32_t uid, bool wrong)
+{
+    std::string value = (wrong ? "wrong-" : "password-") + std::to_string(uid);
+    return std::vector<uint8_t>(value.begin(), value.end());
+}
+
+void setView(hidl_vec<uint8_t>& vec, const std::vector<uint8_t>& data)
+{
+    vec.setToExternal(const_cast<uint8_t *>(data.data()), data.size());
+}
+
+bool enrollUsers(OpteeGateKeeperDevice& device, uint32_t users,
+        std::vector<std::vector<uint8_t>> *handles)
+{
+    hidl_vec<uint8_t> empty;
+
+    handles->resize(users);
+    for (uint32_t uid = 0; uid < users; uid++) {
+        std::vector<uint8_t> desired = password(uid, false);
+        hidl_vec<uint8_t> desiredView;
+        std::vector<uint8_t>& handle = (*handles)[uid];
+
+        setView(desiredView, desired);
+        device.enroll(uid, empty, empty, desiredView,
+                [&handle](const GatekeeperResponse& rsp) {
+                    if (rsp.code == GatekeeperStatusCode::STATUS_OK) {
+                        handle.assign(rsp.data.data(),
+                                rsp.data.data() + rsp.data.size());
+                    }
+                });
+        if (handle.empty()) {
+            fprintf(stderr, "Failed to enroll user %u\n", uid);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void verifyLoop(OpteeGateKeeperDevice& device, const Options& options,
+        const std::vector<std::vector<uint8_t>>& handles, uint32_t index,
+        ThreadResult *result)
+{
+    uint32_t seed = index + 1;
+
+    result->latencyUs.reserve(options.requests);
+    for (uint32_t i = 0; i < options.requests; i++) {
+        uint32_t uid = (index + i * options.threads) % options.users;
+        bool wrong = (uint32_t)(rand_r(&seed) % 100) < options.wrongPercent;
+        std::vector<uint8_t> provided = password(uid, wrong);
+        hidl_vec<uint8_t> handleView;
+        hidl_vec<uint8_t> providedView;
+        GatekeeperStatusCode code = GatekeeperStatusCode::ERROR_GENERAL_FAILURE;
+
+        setView(handleView, handles[uid]);
+        setView(providedView, provided);
+
+        auto start = std::chrono::steady_clock::now();
+        device.verify(uid, i, handleView, providedView,
+                [&code](const GatekeeperResponse& rsp) { code = rsp.code; });
+        auto end = std::chrono::steady_clock::now();
+
+        result->latencyUs.push_back(
+                std::chrono::duration_cast<std::chrono::microseconds>(
+                    end - start).count());
+        result->codes[static_cast<int32_t>(code)]++;
+    }
+}
+
+uint64_t percentile(const std::vector<uint64_t>& sorted, uint32_t percent)
+{
+    if (sorted.empty()) {
+        return 0;
+    }
+    return sorted[(sorted.size() - 1) * percent / 100];
+}
+
+void dumpMetrics(OpteeGateKeeperDevice& device)
+{
+    native_handle_t *handle = native_handle_create(1, 0);
+    hidl_vec<hidl_string> options;
+
+    if (handle == nullptr) {
+        return;
+    }
+    handle->data[0] = STDOUT_FILENO;
+    fflush(stdout);
+    device.debug(hidl_handle(handle), options);
+    native_handle_delete(handle);
+}
+
+}  // namespace
+
+int main(int argc, char **argv)
+{
+    Options options;
+
+    if (!parseOptions(argc, argv, &options)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    TransportFactory factory;
+    if (!transportFactory(options, &factory)) {
+        return 1;
+    }
+
+    android::sp<OpteeGateKeeperDevice> device =
+        new OpteeGateKeeperDevice(options.sessions, factory,
+                options.deadlines);
+    std::vector<std::vector<uint8_t>> handles;
+    if (options.replayPath) {
+        // Trace answers with recorded outcome whatever the handle is
+        handles.assign(options.users,
+                std::vector<uint8_t>(GK_PASSWORD_HANDLE_SIZE));
+    } else if (!enrollUsers(*device, options.users, &handles)) {
+        return 1;
+    }
+
+    std::vector<ThreadResult> results(options.threads);
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < options.threads; i++) {
+        threads.emplace_back(verifyLoop, std::ref(*device), std::cref(options),
+                std::cref(handles), i, &results[i]);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    double seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+
+    std::vector<uint64_t> latency;
+    std::map<int32_t, uint64_t> codes;
+    for (const auto& result : results) {
+        latency.insert(latency.end(), result.latencyUs.begin(),
+                result.latencyUs.end());
+        for (const auto& code : result.codes) {
+            codes[code.first] += code.second;
+        }
+    }
+    std::sort(latency.begin(), latency.end());
+
+    printf("Verifies: %zu in %.3f s, %.1f per second\n", latency.size(),
+            seconds, seconds > 0 ? latency.size() / seconds : 0.0);
+    printf("Latency, us: p50 %llu p90 %llu p99 %llu max %llu\n",
+            (unsigned long long)percentile(latency, 50),
+            (unsigned long long)percentile(latency, 90),
+            (unsigned long long)percentile(latency, 99),
+            (unsigned long long)(latency.empty() ? 0 : latency.back()));
+    for (const auto& code : codes) {
+        printf("Status %d: %llu\n", code.first,
+                (unsigned long long)code.second);
+    }
+    dumpMetrics(*device);
+
+    return 0;
+}
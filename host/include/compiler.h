@@ -0,0 +1,30 @@
+/*
+ *
+ * Copyright (C) 2017 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host counterpart of OP-TEE compiler.h, only what TA sources use
+ */
+
+#ifndef HOST_COMPILER_H
+#define HOST_COMPILER_H
+
+#define __packed	__attribute__((packed))
+#define __unused	__attribute__((unused))
+#define __maybe_unused	__attribute__((unused))
+#define __aligned(x)	__attribute__((aligned(x)))
+
+#endif /* HOST_COMPILER_H */
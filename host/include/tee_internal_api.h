@@ -0,0 +1,267 @@
+/*
+ *
+ * Copyright (C) 2017 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Subset of GlobalPlatform TEE Internal Core API that gatekeeper TA uses.
+ * Values follow GP specification and OP-TEE, so TA sources build on host
+ * without changes.
+ */
+
+#ifndef HOST_TEE_INTERNAL_API_H
+#define HOST_TEE_INTERNAL_API_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <compiler.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef uint32_t TEE_Result;
+
+typedef struct {
+	uint32_t timeLow;
+	uint16_t timeMid;
+	uint16_t timeHiAndVersion;
+	uint8_t clockSeqAndNode[8];
+} TEE_UUID;
+
+typedef union {
+	struct {
+		void *buffer;
+		uint32_t size;
+	} memref;
+	struct {
+		uint32_t a;
+		uint32_t b;
+	} value;
+} TEE_Param;
+
+typedef struct {
+	uint32_t seconds;
+	uint32_t millis;
+} TEE_Time;
+
+typedef struct {
+	uint32_t attributeID;
+	union {
+		struct {
+			void *buffer;
+			uint32_t length;
+		} ref;
+		struct {
+			uint32_t a;
+			uint32_t b;
+		} value;
+	} content;
+} TEE_Attribute;
+
+typedef struct {
+	uint32_t objectType;
+	uint32_t objectSize;
+	uint32_t maxObjectSize;
+	uint32_t objectUsage;
+	uint32_t dataSize;
+	uint32_t dataPosition;
+	uint32_t handleFlags;
+} TEE_ObjectInfo;
+
+typedef enum {
+	TEE_DATA_SEEK_SET = 0,
+	TEE_DATA_SEEK_CUR = 1,
+	TEE_DATA_SEEK_END = 2
+} TEE_Whence;
+
+typedef struct __TEE_ObjectHandle *TEE_ObjectHandle;
+typedef struct __TEE_OperationHandle *TEE_OperationHandle;
+typedef struct __TEE_TASessionHandle *TEE_TASessionHandle;
+
+#define TEE_HANDLE_NULL			0
+#define TEE_NUM_PARAMS			4
+#define TEE_TIMEOUT_INFINITE		0xFFFFFFFF
+
+#define TEE_SUCCESS			0x00000000
+#define TEE_ERROR_CORRUPT_OBJECT	0xF0100001
+#define TEE_ERROR_GENERIC		0xFFFF0000
+#define TEE_ERROR_ACCESS_DENIED		0xFFFF0001
+#define TEE_ERROR_CANCEL		0xFFFF0002
+#define TEE_ERROR_ACCESS_CONFLICT	0xFFFF0003
+#define TEE_ERROR_EXCESS_DATA		0xFFFF0004
+#define TEE_ERROR_BAD_FORMAT		0xFFFF0005
+#define TEE_ERROR_BAD_PARAMETERS	0xFFFF0006
+#define TEE_ERROR_BAD_STATE		0xFFFF0007
+#define TEE_ERROR_ITEM_NOT_FOUND	0xFFFF0008
+#define TEE_ERROR_NOT_IMPLEMENTED	0xFFFF0009
+#define TEE_ERROR_NOT_SUPPORTED		0xFFFF000A
+#define TEE_ERROR_NO_DATA		0xFFFF000B
+#define TEE_ERROR_OUT_OF_MEMORY		0xFFFF000C
+#define TEE_ERROR_BUSY			0xFFFF000D
+#define TEE_ERROR_COMMUNICATION		0xFFFF000E
+#define TEE_ERROR_SECURITY		0xFFFF000F
+#define TEE_ERROR_SHORT_BUFFER		0xFFFF0010
+#define TEE_ERROR_TIMEOUT		0xFFFF3001
+#define TEE_ERROR_OVERFLOW		0xFFFF300F
+#define TEE_ERROR_TARGET_DEAD		0xFFFF3024
+#define TEE_ERROR_STORAGE_NO_SPACE	0xFFFF3041
+#define TEE_ERROR_MAC_INVALID		0xFFFF3071
+
+#define TEE_ORIGIN_API			0x00000001
+#define TEE_ORIGIN_COMMS		0x00000002
+#define TEE_ORIGIN_TEE			0x00000003
+#define TEE_ORIGIN_TRUSTED_APP		0x00000004
+
+#define TEE_PARAM_TYPE_NONE		0
+#define TEE_PARAM_TYPE_VALUE_INPUT	1
+#define TEE_PARAM_TYPE_VALUE_OUTPUT	2
+#define TEE_PARAM_TYPE_VALUE_INOUT	3
+#define TEE_PARAM_TYPE_MEMREF_INPUT	5
+#define TEE_PARAM_TYPE_MEMREF_OUTPUT	6
+#define TEE_PARAM_TYPE_MEMREF_INOUT	7
+
+#define TEE_PARAM_TYPES(t0, t1, t2, t3) \
+	((t0) | ((t1) << 4) | ((t2) << 8) | ((t3) << 12))
+#define TEE_PARAM_TYPE_GET(t, i) ((((uint32_t)t) >> ((i) * 4)) & 0xF)
+
+#define TEE_STORAGE_PRIVATE		0x00000001
+#define TEE_OBJECT_ID_MAX_LEN		64
+
+#define TEE_DATA_FLAG_ACCESS_READ	0x00000001
+#define TEE_DATA_FLAG_ACCESS_WRITE	0x00000002
+#define TEE_DATA_FLAG_ACCESS_WRITE_META	0x00000004
+#define TEE_DATA_FLAG_SHARE_READ	0x00000010
+#define TEE_DATA_FLAG_SHARE_WRITE	0x00000020
+#define TEE_DATA_FLAG_OVERWRITE		0x00000400
+
+#define TEE_TYPE_HMAC_SHA256		0xA0000004
+#define TEE_ALG_HMAC_SHA256		0x30000004
+#define TEE_MODE_MAC			4
+#define TEE_ATTR_SECRET_VALUE		0xC0000000
+
+/* Persistent objects */
+TEE_Result TEE_OpenPersistentObject(uint32_t storageID, const void *objectID,
+		uint32_t objectIDLen, uint32_t flags, TEE_ObjectHandle *object);
+TEE_Result TEE_CreatePersistentObject(uint32_t storageID,
+		const void *objectID, uint32_t objectIDLen, uint32_t flags,
+		TEE_ObjectHandle attributes, const void *initialData,
+		uint32_t initialDataLen, TEE_ObjectHandle *object);
+TEE_Result TEE_CloseAndDeletePersistentObject1(TEE_ObjectHandle object);
+TEE_Result TEE_RenamePersistentObject(TEE_ObjectHandle object,
+		const void *newObjectID, uint32_t newObjectIDLen);
+TEE_Result TEE_ReadObjectData(TEE_ObjectHandle object, void *buffer,
+		uint32_t size, uint32_t *count);
+TEE_Result TEE_WriteObjectData(TEE_ObjectHandle object, const void *buffer,
+		uint32_t size);
+TEE_Result TEE_TruncateObjectData(TEE_ObjectHandle object, uint32_t size);
+TEE_Result TEE_SeekObjectData(TEE_ObjectHandle object, int32_t offset,
+		TEE_Whence whence);
+TEE_Result TEE_GetObjectInfo1(TEE_ObjectHandle object,
+		TEE_ObjectInfo *objectInfo);
+void TEE_CloseObject(TEE_ObjectHandle object);
+
+/* Transient objects */
+TEE_Result TEE_AllocateTransientObject(uint32_t objectType,
+		uint32_t maxObjectSize, TEE_ObjectHandle *object);
+void TEE_FreeTransientObject(TEE_ObjectHandle object);
+void TEE_ResetTransientObject(TEE_ObjectHandle object);
+TEE_Result TEE_PopulateTransientObject(TEE_ObjectHandle object,
+		const TEE_Attribute *attrs, uint32_t attrCount);
+void TEE_InitRefAttribute(TEE_Attribute *attr, uint32_t attributeID,
+		const void *buffer, uint32_t length);
+
+/* Cryptographic operations */
+TEE_Result TEE_AllocateOperation(TEE_OperationHandle *operation,
+		uint32_t algorithm, uint32_t mode, uint32_t maxKeySize);
+void TEE_FreeOperation(TEE_OperationHandle operation);
+void TEE_ResetOperation(TEE_OperationHandle operation);
+TEE_Result TEE_SetOperationKey(TEE_OperationHandle operation,
+		TEE_ObjectHandle key);
+void TEE_MACInit(TEE_OperationHandle operation, const void *IV,
+		uint32_t IVLen);
+void TEE_MACUpdate(TEE_OperationHandle operation, const void *chunk,
+		uint32_t chunkSize);
+TEE_Result TEE_MACComputeFinal(TEE_OperationHandle operation,
+		const void *message, uint32_t messageLen,
+		void *mac, uint32_t *macLen);
+void TEE_GenerateRandom(void *randomBuffer, uint32_t randomBufferLen);
+
+/* Time and cancellation */
+void TEE_GetSystemTime(TEE_Time *time);
+TEE_Result TEE_Wait(uint32_t timeout);
+bool TEE_GetCancellationFlag(void);
+bool TEE_UnmaskCancellation(void);
+bool TEE_MaskCancellation(void);
+
+/* TA to TA sessions */
+TEE_Result TEE_OpenTASession(const TEE_UUID *destination,
+		uint32_t cancellationRequestTimeout, uint32_t paramTypes,
+		TEE_Param params[TEE_NUM_PARAMS], TEE_TASessionHandle *session,
+		uint32_t *returnOrigin);
+void TEE_CloseTASession(TEE_TASessionHandle session);
+TEE_Result TEE_InvokeTACommand(TEE_TASessionHandle session,
+		uint32_t cancellationRequestTimeout, uint32_t commandID,
+		uint32_t paramTypes, TEE_Param params[TEE_NUM_PARAMS],
+		uint32_t *returnOrigin);
+
+/* Memory */
+#define TEE_MALLOC_FILL_ZERO		0x00000000
+
+void *TEE_Malloc(uint32_t size, uint32_t hint);
+void TEE_Free(void *buffer);
+
+/* TA entry points, implemented by TA sources */
+TEE_Result TA_CreateEntryPoint(void);
+void TA_DestroyEntryPoint(void);
+TEE_Result TA_OpenSessionEntryPoint(uint32_t paramTypes,
+		TEE_Param params[TEE_NUM_PARAMS], void **sessionContext);
+void TA_CloseSessionEntryPoint(void *sessionContext);
+TEE_Result TA_InvokeCommandEntryPoint(void *sessionContext,
+		uint32_t commandID, uint32_t paramTypes,
+		TEE_Param params[TEE_NUM_PARAMS]);
+
+/*
+ * Sets cancellation flag of the running command. In-process libteec
+ * clears it before every command, which also masks cancellation.
+ */
+void tee_host_set_cancellation(bool requested);
+
+/* Trace, CFG_TEE_TA_LOG_LEVEL has the same meaning as in OP-TEE */
+void tee_host_trace(const char *level, const char *func, int line,
+		const char *fmt, ...) __attribute__((format(printf, 4, 5)));
+
+#ifndef CFG_TEE_TA_LOG_LEVEL
+#define CFG_TEE_TA_LOG_LEVEL 1
+#endif
+
+#define TEE_HOST_TRACE(lvl, tag, ...) do { \
+		if (CFG_TEE_TA_LOG_LEVEL >= (lvl)) \
+			tee_host_trace(tag, __func__, __LINE__, __VA_ARGS__); \
+	} while (0)
+
+#define EMSG(...)	TEE_HOST_TRACE(1, "E", __VA_ARGS__)
+#define IMSG(...)	TEE_HOST_TRACE(2, "I", __VA_ARGS__)
+#define DMSG(...)	TEE_HOST_TRACE(3, "D", __VA_ARGS__)
+#define FMSG(...)	TEE_HOST_TRACE(4, "F", __VA_ARGS__)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HOST_TEE_INTERNAL_API_H */
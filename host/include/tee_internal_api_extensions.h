@@ -0,0 +1,28 @@
+/*
+ *
+ * Copyright (C) 2017 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * TA sources do not use OP-TEE extensions on host, header is kept only so
+ * that they compile unchanged
+ */
+
+#ifndef HOST_TEE_INTERNAL_API_EXTENSIONS_H
+#define HOST_TEE_INTERNAL_API_EXTENSIONS_H
+
+#include <tee_internal_api.h>
+
+#endif /* HOST_TEE_INTERNAL_API_EXTENSIONS_H */
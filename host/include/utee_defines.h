@@ -0,0 +1,32 @@
+/*
+ *
+ * Copyright (C) 2017 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host counterpart of OP-TEE utee_defines.h, only what TA sources use
+ */
+
+#ifndef HOST_UTEE_DEFINES_H
+#define HOST_UTEE_DEFINES_H
+
+#include <endian.h>
+
+#define TEE_U64_TO_BIG_ENDIAN(x)	htobe64(x)
+#define TEE_U32_TO_BIG_ENDIAN(x)	htobe32(x)
+#define TEE_U64_FROM_BIG_ENDIAN(x)	be64toh(x)
+#define TEE_U32_FROM_BIG_ENDIAN(x)	be32toh(x)
+
+#endif /* HOST_UTEE_DEFINES_H */
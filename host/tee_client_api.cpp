@@ -0,0 +1,354 @@
+/*
+ *
+ * Copyright (C) 2017 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * In-process libteec: every session is served by gatekeeper TA sources
+ * linked into the same binary. TA behaves as a single instance TA, its
+ * entry points are never run concurrently.
+ *
+ * GATEKEEPER_TEE_INVOKE_DELAY_US adds given delay to every command to
+ * model cost of world switch on target.
+ */
+
+#include <map>
+#include <mutex>
+#include <set>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+extern "C" {
+#include <tee_client_api.h>
+}
+#include <tee_internal_api.h>
+#include <gatekeeper_ipc.h>
+
+namespace {
+
+std::mutex taMutex;
+bool taCreated = false;
+uint32_t nextSessionId = 1;
+std::map<uint32_t, void *> sessions;
+
+std::mutex shmMutex;
+std::set<void *> allocatedShm;
+
+/*
+ * Operation the TA is running, only it can be cancelled. Cancellation of
+ * a command still waiting for the TA is lost.
+ */
+std::mutex cancelMutex;
+TEEC_Operation *runningOperation;
+
+useconds_t InvokeDelayUs()
+{
+	static const useconds_t delay = [] {
+		const char *value = getenv("GATEKEEPER_TEE_INVOKE_DELAY_US");
+		return value ? (useconds_t)strtoul(value, NULL, 10) : 0;
+	}();
+	return delay;
+}
+
+uint32_t ToTaParamType(uint32_t type, const TEEC_Parameter& param)
+{
+	switch (type) {
+	case TEEC_NONE:
+		return TEE_PARAM_TYPE_NONE;
+	case TEEC_VALUE_INPUT:
+		return TEE_PARAM_TYPE_VALUE_INPUT;
+	case TEEC_VALUE_OUTPUT:
+		return TEE_PARAM_TYPE_VALUE_OUTPUT;
+	case TEEC_VALUE_INOUT:
+		return TEE_PARAM_TYPE_VALUE_INOUT;
+	case TEEC_MEMREF_TEMP_INPUT:
+	case TEEC_MEMREF_PARTIAL_INPUT:
+		return TEE_PARAM_TYPE_MEMREF_INPUT;
+	case TEEC_MEMREF_TEMP_OUTPUT:
+	case TEEC_MEMREF_PARTIAL_OUTPUT:
+		return TEE_PARAM_TYPE_MEMREF_OUTPUT;
+	case TEEC_MEMREF_TEMP_INOUT:
+	case TEEC_MEMREF_PARTIAL_INOUT:
+		return TEE_PARAM_TYPE_MEMREF_INOUT;
+	case TEEC_MEMREF_WHOLE:
+		switch (param.memref.parent->flags &
+				(TEEC_MEM_INPUT | TEEC_MEM_OUTPUT)) {
+		case TEEC_MEM_INPUT:
+			return TEE_PARAM_TYPE_MEMREF_INPUT;
+		case TEEC_MEM_OUTPUT:
+			return TEE_PARAM_TYPE_MEMREF_OUTPUT;
+		default:
+			return TEE_PARAM_TYPE_MEMREF_INOUT;
+		}
+	default:
+		return TEE_PARAM_TYPE_NONE;
+	}
+}
+
+TEEC_Result ToTaParams(const TEEC_Operation *operation, uint32_t *paramTypes,
+		TEE_Param params[TEE_NUM_PARAMS])
+{
+	uint32_t types[TEE_NUM_PARAMS] = {0};
+
+	memset(params, 0, sizeof(TEE_Param) * TEE_NUM_PARAMS);
+	if (!operation) {
+		*paramTypes = 0;
+		return TEEC_SUCCESS;
+	}
+
+	for (uint32_t i = 0; i < TEE_NUM_PARAMS; i++) {
+		const TEEC_Parameter& param = operation->params[i];
+		uint32_t type = TEEC_PARAM_TYPE_GET(operation->paramTypes, i);
+
+		types[i] = ToTaParamType(type, param);
+		switch (type) {
+		case TEEC_VALUE_INPUT:
+		case TEEC_VALUE_OUTPUT:
+		case TEEC_VALUE_INOUT:
+			params[i].value.a = param.value.a;
+			params[i].value.b = param.value.b;
+			break;
+		case TEEC_MEMREF_TEMP_INPUT:
+		case TEEC_MEMREF_TEMP_OUTPUT:
+		case TEEC_MEMREF_TEMP_INOUT:
+			params[i].memref.buffer = param.tmpref.buffer;
+			params[i].memref.size = param.tmpref.size;
+			break;
+		case TEEC_MEMREF_WHOLE:
+			params[i].memref.buffer = param.memref.parent->buffer;
+			params[i].memref.size = param.memref.parent->size;
+			break;
+		case TEEC_MEMREF_PARTIAL_INPUT:
+		case TEEC_MEMREF_PARTIAL_OUTPUT:
+		case TEEC_MEMREF_PARTIAL_INOUT:
+			if (param.memref.offset + param.memref.size >
+					param.memref.parent->size)
+				return TEEC_ERROR_BAD_PARAMETERS;
+			params[i].memref.buffer = static_cast<uint8_t *>(
+					param.memref.parent->buffer) +
+				param.memref.offset;
+			params[i].memref.size = param.memref.size;
+			break;
+		default:
+			break;
+		}
+	}
+
+	*paramTypes = TEE_PARAM_TYPES(types[0], types[1], types[2], types[3]);
+	return TEEC_SUCCESS;
+}
+
+void FromTaParams(TEEC_Operation *operation,
+		const TEE_Param params[TEE_NUM_PARAMS])
+{
+	if (!operation)
+		return;
+
+	for (uint32_t i = 0; i < TEE_NUM_PARAMS; i++) {
+		TEEC_Parameter& param = operation->params[i];
+
+		switch (TEEC_PARAM_TYPE_GET(operation->paramTypes, i)) {
+		case TEEC_VALUE_OUTPUT:
+		case TEEC_VALUE_INOUT:
+			param.value.a = params[i].value.a;
+			param.value.b = params[i].value.b;
+			break;
+		case TEEC_MEMREF_TEMP_OUTPUT:
+		case TEEC_MEMREF_TEMP_INOUT:
+			param.tmpref.size = params[i].memref.size;
+			break;
+		case TEEC_MEMREF_WHOLE:
+		case TEEC_MEMREF_PARTIAL_OUTPUT:
+		case TEEC_MEMREF_PARTIAL_INOUT:
+			param.memref.size = params[i].memref.size;
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+}  // namespace
+
+extern "C" {
+
+TEEC_Result TEEC_InitializeContext(const char *name, TEEC_Context *context)
+{
+	(void)name;
+
+	if (!context)
+		return TEEC_ERROR_BAD_PARAMETERS;
+	memset(context, 0, sizeof(*context));
+	return TEEC_SUCCESS;
+}
+
+void TEEC_FinalizeContext(TEEC_Context *context)
+{
+	(void)context;
+}
+
+TEEC_Result TEEC_OpenSession(TEEC_Context *context, TEEC_Session *session,
+		const TEEC_UUID *destination, uint32_t connectionMethod,
+		const void *connectionData, TEEC_Operation *operation,
+		uint32_t *returnOrigin)
+{
+	uint32_t paramTypes;
+	TEE_Param params[TEE_NUM_PARAMS];
+	void *sessionContext = NULL;
+	const TEEC_UUID gatekeeper = TA_GATEKEEPER_UUID;
+	TEEC_Result res;
+
+	(void)connectionMethod;
+	(void)connectionData;
+
+	if (returnOrigin)
+		*returnOrigin = TEEC_ORIGIN_API;
+	if (!context || !session || !destination)
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	if (returnOrigin)
+		*returnOrigin = TEEC_ORIGIN_TEE;
+	if (memcmp(destination, &gatekeeper, sizeof(gatekeeper)))
+		return TEEC_ERROR_ITEM_NOT_FOUND;
+
+	res = ToTaParams(operation, &paramTypes, params);
+	if (res != TEEC_SUCCESS)
+		return res;
+
+	std::lock_guard<std::mutex> lock(taMutex);
+	if (returnOrigin)
+		*returnOrigin = TEEC_ORIGIN_TRUSTED_APP;
+
+	if (!taCreated) {
+		res = TA_CreateEntryPoint();
+		if (res != TEE_SUCCESS)
+			return res;
+		taCreated = true;
+	}
+
+	res = TA_OpenSessionEntryPoint(paramTypes, params, &sessionContext);
+	if (res != TEE_SUCCESS)
+		return res;
+	FromTaParams(operation, params);
+
+	session->ctx = context;
+	session->session_id = nextSessionId++;
+	sessions[session->session_id] = sessionContext;
+	return TEEC_SUCCESS;
+}
+
+void TEEC_CloseSession(TEEC_Session *session)
+{
+	if (!session)
+		return;
+
+	std::lock_guard<std::mutex> lock(taMutex);
+	auto it = sessions.find(session->session_id);
+	if (it == sessions.end())
+		return;
+
+	TA_CloseSessionEntryPoint(it->second);
+	sessions.erase(it);
+}
+
+TEEC_Result TEEC_InvokeCommand(TEEC_Session *session, uint32_t commandID,
+		TEEC_Operation *operation, uint32_t *returnOrigin)
+{
+	uint32_t paramTypes;
+	TEE_Param params[TEE_NUM_PARAMS];
+	TEEC_Result res;
+
+	if (returnOrigin)
+		*returnOrigin = TEEC_ORIGIN_API;
+	if (!session)
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	res = ToTaParams(operation, &paramTypes, params);
+	if (res != TEEC_SUCCESS)
+		return res;
+
+	if (InvokeDelayUs())
+		usleep(InvokeDelayUs());
+
+	std::lock_guard<std::mutex> lock(taMutex);
+	auto it = sessions.find(session->session_id);
+	if (it == sessions.end())
+		return TEEC_ERROR_BAD_STATE;
+
+	if (returnOrigin)
+		*returnOrigin = TEEC_ORIGIN_TRUSTED_APP;
+	{
+		std::lock_guard<std::mutex> cancelLock(cancelMutex);
+		runningOperation = operation;
+		tee_host_set_cancellation(false);
+	}
+	res = TA_InvokeCommandEntryPoint(it->second, commandID, paramTypes,
+			params);
+	{
+		std::lock_guard<std::mutex> cancelLock(cancelMutex);
+		runningOperation = NULL;
+	}
+	FromTaParams(operation, params);
+	return res;
+}
+
+TEEC_Result TEEC_RegisterSharedMemory(TEEC_Context *context,
+		TEEC_SharedMemory *sharedMem)
+{
+	(void)context;
+
+	if (!sharedMem || !sharedMem->buffer)
+		return TEEC_ERROR_BAD_PARAMETERS;
+	return TEEC_SUCCESS;
+}
+
+TEEC_Result TEEC_AllocateSharedMemory(TEEC_Context *context,
+		TEEC_SharedMemory *sharedMem)
+{
+	(void)context;
+
+	if (!sharedMem)
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	sharedMem->buffer = calloc(1, sharedMem->size ? sharedMem->size : 1);
+	if (!sharedMem->buffer)
+		return TEEC_ERROR_OUT_OF_MEMORY;
+
+	std::lock_guard<std::mutex> lock(shmMutex);
+	allocatedShm.insert(sharedMem->buffer);
+	return TEEC_SUCCESS;
+}
+
+void TEEC_ReleaseSharedMemory(TEEC_SharedMemory *sharedMem)
+{
+	if (!sharedMem || !sharedMem->buffer)
+		return;
+
+	std::lock_guard<std::mutex> lock(shmMutex);
+	if (allocatedShm.erase(sharedMem->buffer))
+		free(sharedMem->buffer);
+	sharedMem->buffer = NULL;
+}
+
+void TEEC_RequestCancellation(TEEC_Operation *operation)
+{
+	std::lock_guard<std::mutex> lock(cancelMutex);
+	if (operation && operation == runningOperation)
+		tee_host_set_cancellation(true);
+}
+
+}  // extern "C"
@@ -0,0 +1,739 @@
+/*
+ *
+ * Copyright (C) 2017 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host implementation of TEE Internal Core API used by gatekeeper TA.
+ * Secure storage lives in process memory and keymaster is replaced with
+ * a stub that hands out a per-process auth token key.
+ *
+ * If GATEKEEPER_TEE_STORAGE names a directory, every persistent object is
+ * also written through to a file there, so TA state survives restarts.
+ */
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#include <tee_internal_api.h>
+#include "ta_gatekeeper.h"
+
+struct __TEE_ObjectHandle {
+	bool persistent;
+	std::string id;
+	uint32_t flags;
+	uint32_t position;
+
+	uint32_t type;
+	uint32_t maxSize;
+	bool initialized;
+	std::vector<uint8_t> secret;
+};
+
+struct __TEE_OperationHandle {
+	uint32_t algorithm;
+	uint32_t mode;
+	uint32_t maxKeySize;
+	std::vector<uint8_t> key;
+	HMAC_CTX *keyed;	/* HMAC state right after the key schedule */
+	HMAC_CTX *ctx;
+	bool active;
+};
+
+struct __TEE_TASessionHandle {
+	TEE_UUID uuid;
+};
+
+namespace {
+
+typedef std::map<std::string, std::vector<uint8_t>> ObjectMap;
+
+std::mutex storageMutex;
+
+/* Set from the libteec watchdog thread while the TA runs */
+std::atomic<bool> cancelRequested(false);
+bool cancelMasked = true;
+
+[[noreturn]] void HostPanic(const char *what)
+{
+	fprintf(stderr, "TEE_Panic: %s\n", what);
+	abort();
+}
+
+std::string ObjectKey(uint32_t storageID, const void *objectID,
+		uint32_t objectIDLen)
+{
+	std::string key(reinterpret_cast<const char *>(&storageID),
+			sizeof(storageID));
+	key.append(reinterpret_cast<const char *>(objectID), objectIDLen);
+	return key;
+}
+
+const char *StorageDir()
+{
+	static const char *dir = getenv("GATEKEEPER_TEE_STORAGE");
+	return dir && *dir ? dir : NULL;
+}
+
+/*
+ * File name is object key in hex, key may hold any byte
+ */
+std::string ObjectPath(const std::string& key)
+{
+	static const char digits[] = "0123456789abcdef";
+	std::string path(StorageDir());
+
+	path += '/';
+	for (unsigned char c : key) {
+		path += digits[c >> 4];
+		path += digits[c & 0xf];
+	}
+	return path;
+}
+
+bool ObjectKeyFromName(const char *name, std::string *key)
+{
+	size_t length = strlen(name);
+
+	if (!length || length % 2)
+		return false;
+
+	key->clear();
+	for (size_t i = 0; i < length; i += 2) {
+		char byte[3] = { name[i], name[i + 1], 0 };
+		char *end;
+		unsigned long value = strtoul(byte, &end, 16);
+		if (*end)
+			return false;
+		*key += static_cast<char>(value);
+	}
+	return true;
+}
+
+bool ReadFile(const std::string& path, std::vector<uint8_t> *data)
+{
+	FILE *file = fopen(path.c_str(), "rb");
+	uint8_t chunk[4096];
+	size_t count;
+
+	if (!file)
+		return false;
+
+	data->clear();
+	while ((count = fread(chunk, 1, sizeof(chunk), file)) > 0)
+		data->insert(data->end(), chunk, chunk + count);
+	fclose(file);
+	return true;
+}
+
+/*
+ * Must be called with storageMutex held
+ */
+ObjectMap& Storage()
+{
+	static ObjectMap objects;
+	static bool loaded = false;
+
+	if (loaded)
+		return objects;
+	loaded = true;
+
+	DIR *dir = StorageDir() ? opendir(StorageDir()) : NULL;
+	if (!dir)
+		return objects;
+
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		std::string key;
+		if (ObjectKeyFromName(entry->d_name, &key))
+			ReadFile(ObjectPath(key), &objects[key]);
+	}
+	closedir(dir);
+	return objects;
+}
+
+/*
+ * Write object through to its file, or remove the file if object is
+ * gone. Must be called with storageMutex held.
+ */
+void SyncObject(const std::string& key)
+{
+	if (!StorageDir())
+		return;
+
+	std::string path = ObjectPath(key);
+	auto it = Storage().find(key);
+	if (it == Storage().end()) {
+		unlink(path.c_str());
+		return;
+	}
+
+	std::string temp = path + ".tmp";
+	FILE *file = fopen(temp.c_str(), "wb");
+	if (!file)
+		HostPanic("cannot create storage file");
+	if (fwrite(it->second.data(), 1, it->second.size(), file) !=
+			it->second.size())
+		HostPanic("cannot write storage file");
+	fclose(file);
+	if (rename(temp.c_str(), path.c_str()))
+		HostPanic("cannot rename storage file");
+}
+
+bool SameUUID(const TEE_UUID& a, const TEE_UUID& b)
+{
+	return memcmp(&a, &b, sizeof(a)) == 0;
+}
+
+const uint8_t *KeymasterAuthTokenKey()
+{
+	static uint8_t key[HMAC_SHA256_KEY_SIZE_BYTE];
+	static std::once_flag once;
+
+	std::call_once(once, [] { RAND_bytes(key, sizeof(key)); });
+	return key;
+}
+
+}  // namespace
+
+extern "C" {
+
+TEE_Result TEE_OpenPersistentObject(uint32_t storageID, const void *objectID,
+		uint32_t objectIDLen, uint32_t flags, TEE_ObjectHandle *object)
+{
+	if (objectIDLen > TEE_OBJECT_ID_MAX_LEN)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	std::string key = ObjectKey(storageID, objectID, objectIDLen);
+	{
+		std::lock_guard<std::mutex> lock(storageMutex);
+		if (!Storage().count(key))
+			return TEE_ERROR_ITEM_NOT_FOUND;
+	}
+
+	*object = new __TEE_ObjectHandle();
+	(*object)->persistent = true;
+	(*object)->id = key;
+	(*object)->flags = flags;
+	(*object)->position = 0;
+	return TEE_SUCCESS;
+}
+
+TEE_Result TEE_CreatePersistentObject(uint32_t storageID,
+		const void *objectID, uint32_t objectIDLen, uint32_t flags,
+		TEE_ObjectHandle attributes, const void *initialData,
+		uint32_t initialDataLen, TEE_ObjectHandle *object)
+{
+	(void)attributes;
+
+	if (objectIDLen > TEE_OBJECT_ID_MAX_LEN)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	std::string key = ObjectKey(storageID, objectID, objectIDLen);
+	{
+		std::lock_guard<std::mutex> lock(storageMutex);
+		if (Storage().count(key) && !(flags & TEE_DATA_FLAG_OVERWRITE))
+			return TEE_ERROR_ACCESS_CONFLICT;
+
+		const uint8_t *data = static_cast<const uint8_t *>(initialData);
+		Storage()[key].assign(data, data + initialDataLen);
+		SyncObject(key);
+	}
+
+	if (!object)
+		return TEE_SUCCESS;
+
+	*object = new __TEE_ObjectHandle();
+	(*object)->persistent = true;
+	(*object)->id = key;
+	(*object)->flags = flags;
+	(*object)->position = 0;
+	return TEE_SUCCESS;
+}
+
+TEE_Result TEE_CloseAndDeletePersistentObject1(TEE_ObjectHandle object)
+{
+	if (object == TEE_HANDLE_NULL)
+		return TEE_SUCCESS;
+	if (!object->persistent)
+		HostPanic("delete of transient object");
+
+	{
+		std::lock_guard<std::mutex> lock(storageMutex);
+		Storage().erase(object->id);
+		SyncObject(object->id);
+	}
+	delete object;
+	return TEE_SUCCESS;
+}
+
+TEE_Result TEE_RenamePersistentObject(TEE_ObjectHandle object,
+		const void *newObjectID, uint32_t newObjectIDLen)
+{
+	if (!object || !object->persistent)
+		HostPanic("rename of transient object");
+	if (newObjectIDLen > TEE_OBJECT_ID_MAX_LEN)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	uint32_t storageID;
+	memcpy(&storageID, object->id.data(), sizeof(storageID));
+	std::string key = ObjectKey(storageID, newObjectID, newObjectIDLen);
+
+	std::lock_guard<std::mutex> lock(storageMutex);
+	if (key == object->id)
+		return TEE_SUCCESS;
+	if (Storage().count(key))
+		return TEE_ERROR_ACCESS_CONFLICT;
+
+	Storage()[key].swap(Storage()[object->id]);
+	Storage().erase(object->id);
+	SyncObject(key);
+	SyncObject(object->id);
+	object->id = key;
+	return TEE_SUCCESS;
+}
+
+TEE_Result TEE_ReadObjectData(TEE_ObjectHandle object, void *buffer,
+		uint32_t size, uint32_t *count)
+{
+	if (!object || !object->persistent ||
+			!(object->flags & TEE_DATA_FLAG_ACCESS_READ))
+		HostPanic("read of non readable object");
+
+	std::lock_guard<std::mutex> lock(storageMutex);
+	const std::vector<uint8_t>& data = Storage()[object->id];
+
+	uint32_t available = 0;
+	if (object->position < data.size())
+		available = data.size() - object->position;
+	*count = size < available ? size : available;
+	memcpy(buffer, data.data() + object->position, *count);
+	object->position += *count;
+	return TEE_SUCCESS;
+}
+
+TEE_Result TEE_WriteObjectData(TEE_ObjectHandle object, const void *buffer,
+		uint32_t size)
+{
+	if (!object || !object->persistent ||
+			!(object->flags & TEE_DATA_FLAG_ACCESS_WRITE))
+		HostPanic("write to non writable object");
+
+	std::lock_guard<std::mutex> lock(storageMutex);
+	std::vector<uint8_t>& data = Storage()[object->id];
+
+	if (data.size() < object->position + size)
+		data.resize(object->position + size);
+	memcpy(data.data() + object->position, buffer, size);
+	object->position += size;
+	SyncObject(object->id);
+	return TEE_SUCCESS;
+}
+
+TEE_Result TEE_TruncateObjectData(TEE_ObjectHandle object, uint32_t size)
+{
+	if (!object || !object->persistent ||
+			!(object->flags & TEE_DATA_FLAG_ACCESS_WRITE))
+		HostPanic("truncate of non writable object");
+
+	std::lock_guard<std::mutex> lock(storageMutex);
+	Storage()[object->id].resize(size);
+	SyncObject(object->id);
+	return TEE_SUCCESS;
+}
+
+TEE_Result TEE_SeekObjectData(TEE_ObjectHandle object, int32_t offset,
+		TEE_Whence whence)
+{
+	if (!object || !object->persistent)
+		HostPanic("seek in transient object");
+
+	int64_t position;
+	std::lock_guard<std::mutex> lock(storageMutex);
+	switch (whence) {
+	case TEE_DATA_SEEK_SET:
+		position = offset;
+		break;
+	case TEE_DATA_SEEK_CUR:
+		position = (int64_t)object->position + offset;
+		break;
+	case TEE_DATA_SEEK_END:
+		position = (int64_t)Storage()[object->id].size() + offset;
+		break;
+	default:
+		return TEE_ERROR_BAD_PARAMETERS;
+	}
+
+	if (position < 0)
+		position = 0;
+	if (position > UINT32_MAX)
+		return TEE_ERROR_OVERFLOW;
+	object->position = position;
+	return TEE_SUCCESS;
+}
+
+TEE_Result TEE_GetObjectInfo1(TEE_ObjectHandle object,
+		TEE_ObjectInfo *objectInfo)
+{
+	if (!object)
+		HostPanic("info of null object");
+
+	memset(objectInfo, 0, sizeof(*objectInfo));
+	objectInfo->handleFlags = object->flags;
+	if (object->persistent) {
+		std::lock_guard<std::mutex> lock(storageMutex);
+		objectInfo->dataSize = Storage()[object->id].size();
+		objectInfo->dataPosition = object->position;
+	} else {
+		objectInfo->objectType = object->type;
+		objectInfo->maxObjectSize = object->maxSize;
+		objectInfo->objectSize = object->secret.size() * 8;
+	}
+	return TEE_SUCCESS;
+}
+
+void TEE_CloseObject(TEE_ObjectHandle object)
+{
+	if (object == TEE_HANDLE_NULL)
+		return;
+	if (!object->persistent) {
+		TEE_FreeTransientObject(object);
+		return;
+	}
+	delete object;
+}
+
+TEE_Result TEE_AllocateTransientObject(uint32_t objectType,
+		uint32_t maxObjectSize, TEE_ObjectHandle *object)
+{
+	if (objectType != TEE_TYPE_HMAC_SHA256)
+		return TEE_ERROR_NOT_SUPPORTED;
+	if (maxObjectSize < 192 || maxObjectSize > 1024 || maxObjectSize % 8)
+		return TEE_ERROR_NOT_SUPPORTED;
+
+	*object = new __TEE_ObjectHandle();
+	(*object)->persistent = false;
+	(*object)->flags = 0;
+	(*object)->position = 0;
+	(*object)->type = objectType;
+	(*object)->maxSize = maxObjectSize;
+	(*object)->initialized = false;
+	return TEE_SUCCESS;
+}
+
+void TEE_FreeTransientObject(TEE_ObjectHandle object)
+{
+	if (object == TEE_HANDLE_NULL)
+		return;
+	if (object->persistent)
+		HostPanic("free of persistent object");
+
+	OPENSSL_cleanse(object->secret.data(), object->secret.size());
+	delete object;
+}
+
+void TEE_ResetTransientObject(TEE_ObjectHandle object)
+{
+	if (object == TEE_HANDLE_NULL)
+		return;
+
+	OPENSSL_cleanse(object->secret.data(), object->secret.size());
+	object->secret.clear();
+	object->initialized = false;
+}
+
+TEE_Result TEE_PopulateTransientObject(TEE_ObjectHandle object,
+		const TEE_Attribute *attrs, uint32_t attrCount)
+{
+	if (!object || object->persistent || object->initialized)
+		HostPanic("populate of bad object");
+
+	for (uint32_t i = 0; i < attrCount; i++) {
+		if (attrs[i].attributeID != TEE_ATTR_SECRET_VALUE)
+			continue;
+		if (attrs[i].content.ref.length * 8 > object->maxSize)
+			return TEE_ERROR_BAD_PARAMETERS;
+
+		const uint8_t *value = static_cast<const uint8_t *>(
+				attrs[i].content.ref.buffer);
+		object->secret.assign(value,
+				value + attrs[i].content.ref.length);
+		object->initialized = true;
+		return TEE_SUCCESS;
+	}
+
+	return TEE_ERROR_BAD_PARAMETERS;
+}
+
+void TEE_InitRefAttribute(TEE_Attribute *attr, uint32_t attributeID,
+		const void *buffer, uint32_t length)
+{
+	attr->attributeID = attributeID;
+	attr->content.ref.buffer = const_cast<void *>(buffer);
+	attr->content.ref.length = length;
+}
+
+TEE_Result TEE_AllocateOperation(TEE_OperationHandle *operation,
+		uint32_t algorithm, uint32_t mode, uint32_t maxKeySize)
+{
+	if (algorithm != TEE_ALG_HMAC_SHA256 || mode != TEE_MODE_MAC)
+		return TEE_ERROR_NOT_SUPPORTED;
+
+	HMAC_CTX *ctx = HMAC_CTX_new();
+	HMAC_CTX *keyed = HMAC_CTX_new();
+	if (!ctx || !keyed) {
+		HMAC_CTX_free(ctx);
+		HMAC_CTX_free(keyed);
+		return TEE_ERROR_OUT_OF_MEMORY;
+	}
+
+	*operation = new __TEE_OperationHandle();
+	(*operation)->algorithm = algorithm;
+	(*operation)->mode = mode;
+	(*operation)->maxKeySize = maxKeySize;
+	(*operation)->keyed = keyed;
+	(*operation)->ctx = ctx;
+	(*operation)->active = false;
+	return TEE_SUCCESS;
+}
+
+void TEE_FreeOperation(TEE_OperationHandle operation)
+{
+	if (operation == TEE_HANDLE_NULL)
+		return;
+
+	HMAC_CTX_free(operation->keyed);
+	HMAC_CTX_free(operation->ctx);
+	OPENSSL_cleanse(operation->key.data(), operation->key.size());
+	delete operation;
+}
+
+void TEE_ResetOperation(TEE_OperationHandle operation)
+{
+	if (operation == TEE_HANDLE_NULL)
+		HostPanic("reset of null operation");
+
+	operation->active = false;
+}
+
+TEE_Result TEE_SetOperationKey(TEE_OperationHandle operation,
+		TEE_ObjectHandle key)
+{
+	if (operation == TEE_HANDLE_NULL)
+		HostPanic("set key of null operation");
+
+	OPENSSL_cleanse(operation->key.data(), operation->key.size());
+	operation->key.clear();
+	operation->active = false;
+	if (key == TEE_HANDLE_NULL)
+		return TEE_SUCCESS;
+
+	if (!key->initialized || key->secret.size() * 8 > operation->maxKeySize)
+		HostPanic("bad operation key");
+
+	operation->key = key->secret;
+
+	/*
+	 * Like a TEE crypto driver, expand the key once per key and start
+	 * every MAC from the saved state
+	 */
+	if (!HMAC_Init_ex(operation->keyed, operation->key.data(),
+				operation->key.size(), EVP_sha256(), NULL))
+		HostPanic("HMAC_Init_ex failed");
+	return TEE_SUCCESS;
+}
+
+void TEE_MACInit(TEE_OperationHandle operation, const void *IV,
+		uint32_t IVLen)
+{
+	(void)IV;
+	(void)IVLen;
+
+	if (operation == TEE_HANDLE_NULL || operation->key.empty())
+		HostPanic("MAC init without key");
+
+	if (!HMAC_CTX_copy(operation->ctx, operation->keyed))
+		HostPanic("HMAC_CTX_copy failed");
+	operation->active = true;
+}
+
+void TEE_MACUpdate(TEE_OperationHandle operation, const void *chunk,
+		uint32_t chunkSize)
+{
+	if (operation == TEE_HANDLE_NULL || !operation->active)
+		HostPanic("MAC update of inactive operation");
+
+	HMAC_Update(operation->ctx, static_cast<const uint8_t *>(chunk),
+			chunkSize);
+}
+
+TEE_Result TEE_MACComputeFinal(TEE_OperationHandle operation,
+		const void *message, uint32_t messageLen,
+		void *mac, uint32_t *macLen)
+{
+	uint8_t digest[EVP_MAX_MD_SIZE];
+	unsigned int digestLen = 0;
+
+	if (operation == TEE_HANDLE_NULL || !operation->active)
+		HostPanic("MAC final of inactive operation");
+
+	if (*macLen < 32)
+		return TEE_ERROR_SHORT_BUFFER;
+
+	HMAC_Update(operation->ctx, static_cast<const uint8_t *>(message),
+			messageLen);
+	HMAC_Final(operation->ctx, digest, &digestLen);
+	operation->active = false;
+
+	memcpy(mac, digest, digestLen);
+	*macLen = digestLen;
+	return TEE_SUCCESS;
+}
+
+void TEE_GenerateRandom(void *randomBuffer, uint32_t randomBufferLen)
+{
+	if (!RAND_bytes(static_cast<uint8_t *>(randomBuffer), randomBufferLen))
+		HostPanic("RAND_bytes failed");
+}
+
+void TEE_GetSystemTime(TEE_Time *time)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	time->seconds = ts.tv_sec;
+	time->millis = ts.tv_nsec / 1000000;
+}
+
+TEE_Result TEE_Wait(uint32_t timeout)
+{
+	usleep((useconds_t)timeout * 1000);
+	return TEE_SUCCESS;
+}
+
+void tee_host_set_cancellation(bool requested)
+{
+	cancelRequested = requested;
+	if (!requested)
+		cancelMasked = true;
+}
+
+bool TEE_GetCancellationFlag(void)
+{
+	return !cancelMasked && cancelRequested;
+}
+
+bool TEE_UnmaskCancellation(void)
+{
+	bool was_masked = cancelMasked;
+
+	cancelMasked = false;
+	return was_masked;
+}
+
+bool TEE_MaskCancellation(void)
+{
+	bool was_masked = cancelMasked;
+
+	cancelMasked = true;
+	return was_masked;
+}
+
+TEE_Result TEE_OpenTASession(const TEE_UUID *destination,
+		uint32_t cancellationRequestTimeout, uint32_t paramTypes,
+		TEE_Param params[TEE_NUM_PARAMS], TEE_TASessionHandle *session,
+		uint32_t *returnOrigin)
+{
+	const TEE_UUID keymaster = TA_KEYMASTER_UUID;
+
+	(void)cancellationRequestTimeout;
+	(void)paramTypes;
+	(void)params;
+
+	*returnOrigin = TEE_ORIGIN_TEE;
+	if (!SameUUID(*destination, keymaster))
+		return TEE_ERROR_ITEM_NOT_FOUND;
+
+	*session = new __TEE_TASessionHandle();
+	(*session)->uuid = *destination;
+	*returnOrigin = TEE_ORIGIN_TRUSTED_APP;
+	return TEE_SUCCESS;
+}
+
+void TEE_CloseTASession(TEE_TASessionHandle session)
+{
+	delete session;
+}
+
+TEE_Result TEE_InvokeTACommand(TEE_TASessionHandle session,
+		uint32_t cancellationRequestTimeout, uint32_t commandID,
+		uint32_t paramTypes, TEE_Param params[TEE_NUM_PARAMS],
+		uint32_t *returnOrigin)
+{
+	(void)session;
+	(void)cancellationRequestTimeout;
+
+	*returnOrigin = TEE_ORIGIN_TRUSTED_APP;
+	if (commandID != KM_GET_AUTHTOKEN_KEY ||
+			TEE_PARAM_TYPE_GET(paramTypes, 1) !=
+			TEE_PARAM_TYPE_MEMREF_OUTPUT)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	if (params[1].memref.size < HMAC_SHA256_KEY_SIZE_BYTE)
+		return TEE_ERROR_SHORT_BUFFER;
+
+	memcpy(params[1].memref.buffer, KeymasterAuthTokenKey(),
+			HMAC_SHA256_KEY_SIZE_BYTE);
+	params[1].memref.size = HMAC_SHA256_KEY_SIZE_BYTE;
+	return TEE_SUCCESS;
+}
+
+void *TEE_Malloc(uint32_t size, uint32_t hint)
+{
+	(void)hint;
+	return calloc(1, size ? size : 1);
+}
+
+void TEE_Free(void *buffer)
+{
+	free(buffer);
+}
+
+void tee_host_trace(const char *level, const char *func, int line,
+		const char *fmt, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "%s/TA: %s:%d ", level, func, line);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
+}  // extern "C"
@@ -0,0 +1,104 @@
+/*
+ *
+ * Copyright (C) 2017 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <chrono>
+#include <thread>
+
+#include "optee_fault_transport.h"
+
+namespace android {
+namespace hardware {
+namespace gatekeeper {
+namespace V1_0 {
+namespace renesas {
+
+FaultTransport::FaultTransport(std::unique_ptr<TeeTransport> inner,
+        const FaultConfig& config)
+    : inner_(std::move(inner)), config_(config),
+      random_(std::random_device()()), injected_(false), cancelled_(false)
+{
+}
+
+bool FaultTransport::connect(const TEEC_UUID& uuid)
+{
+    return inner_->connect(uuid);
+}
+
+void FaultTransport::disconnect()
+{
+    inner_->disconnect();
+}
+
+uint8_t *FaultTransport::requestBuffer(uint32_t size)
+{
+    return inner_->requestBuffer(size);
+}
+
+const uint8_t *FaultTransport::call(uint32_t cmd, uint32_t in_size,
+        uint32_t& out_size, uint32_t timeout_ms)
+{
+    uint64_t delay_us = config_.delayUs;
+    if (config_.jitterUs) {
+        delay_us += random_() % (config_.jitterUs + 1);
+    }
+
+    // Delay past the deadline is cut short as a cancelled call
+    const uint64_t timeout_us = static_cast<uint64_t>(timeout_ms) * 1000;
+    cancelled_ = timeout_ms && delay_us >= timeout_us;
+    if (cancelled_) {
+        delay_us = timeout_us;
+    }
+    if (delay_us) {
+        std::this_thread::sleep_for(std::chrono::microseconds(delay_us));
+    }
+    if (cancelled_) {
+        return nullptr;
+    }
+
+    injected_ = config_.errorPermille &&
+        random_() % 1000 < config_.errorPermille;
+    if (injected_) {
+        return nullptr;
+    }
+
+    return inner_->call(cmd, in_size, out_size,
+            timeout_ms ? timeout_ms - delay_us / 1000 : 0);
+}
+
+void FaultTransport::scrub()
+{
+    inner_->scrub();
+}
+
+TEEC_Result FaultTransport::lastResult() const
+{
+    if (cancelled_) {
+        return TEEC_ERROR_CANCEL;
+    }
+    return injected_ ? config_.error : inner_->lastResult();
+}
+
+uint32_t FaultTransport::lastOrigin() const
+{
+    return injected_ || cancelled_ ? TEEC_ORIGIN_COMMS : inner_->lastOrigin();
+}
+
+}  // namespace renesas
+}  // namespace V1_0
+}  // namespace gatekeeper
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,71 @@
+/*
+ *
+ * Copyright (C) 2017 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef OPTEE_FAULT_TRANSPORT_H
+#define OPTEE_FAULT_TRANSPORT_H
+
+#include <random>
+
+#include "optee_transport.h"
+
+namespace android {
+namespace hardware {
+namespace gatekeeper {
+namespace V1_0 {
+namespace renesas {
+
+struct FaultConfig {
+    uint32_t delayUs = 0;           // added to every call
+    uint32_t jitterUs = 0;          // uniformly random extra delay
+    uint32_t errorPermille = 0;     // share of calls failed with @error
+    TEEC_Result error = TEEC_ERROR_COMMUNICATION;
+};
+
+/*
+ * Makes the wrapped transport slow and flaky. Failed calls never reach
+ * the TA and are reported with TEEC_ORIGIN_COMMS. A call delayed past its
+ * timeout fails with TEEC_ERROR_CANCEL at the deadline.
+ */
+class FaultTransport : public TeeTransport {
+public:
+    FaultTransport(std::unique_ptr<TeeTransport> inner,
+            const FaultConfig& config);
+
+    bool connect(const TEEC_UUID& uuid) override;
+    void disconnect() override;
+    uint8_t *requestBuffer(uint32_t size) override;
+    const uint8_t *call(uint32_t cmd, uint32_t in_size,
+            uint32_t& out_size, uint32_t timeout_ms) override;
+    void scrub() override;
+    TEEC_Result lastResult() const override;
+    uint32_t lastOrigin() const override;
+
+private:
+    std::unique_ptr<TeeTransport> inner_;
+    const FaultConfig config_;
+    std::minstd_rand random_;
+    bool injected_;
+    bool cancelled_;
+};
+
+}  // namespace renesas
+}  // namespace V1_0
+}  // namespace gatekeeper
+}  // namespace hardware
+}  // namespace android
+
+#endif /* OPTEE_FAULT_TRANSPORT_H */
@@ -15,11 +15,16 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+#include <cstring>
+#include <stdio.h>
 #include <string>
 #include <utils/Log.h>
+#include <hardware/hw_auth_token.h>
 
 #include <gatekeeper_ipc.h>
 #include "optee_gatekeeper_device.h"
+#include "optee_ipc.h"
 
 #undef LOG_TAG
 #define LOG_TAG "OpteeGateKeeper"
@@ -30,13 +35,95 @@ namespace gatekeeper {
 namespace V1_0 {
 namespace renesas {
 
-OpteeGateKeeperDevice::OpteeGateKeeperDevice()
+static_assert(sizeof(hw_auth_token_t) == GK_AUTH_TOKEN_SIZE,
+        "GK_AUTH_TOKEN_SIZE does not match hw_auth_token_t");
+
+/*
+ * View of HIDL vector as a schema blob
+ */
+static gk_blob_t blob(const hidl_vec<uint8_t>& vec)
 {
-    connect();
+    gk_blob_t value;
+    value.data = vec.data();
+    value.length = vec.size();
+    return value;
+}
+
+/*
+ * Reads secure user id of password @handle, which the TA throttles by
+ */
+static bool handleUserId(const hidl_vec<uint8_t>& handle, uint64_t& id)
+{
+    if (handle.size() != GK_PASSWORD_HANDLE_SIZE) {
+        return false;
+    }
+
+    memcpy(&id, handle.data() + GK_PASSWORD_HANDLE_USER_ID_OFFSET,
+            sizeof(id));
+    return true;
+}
+
+/*
+ * Status of a delete call that failed without response
+ */
+static GatekeeperStatusCode deleteFailure(const TeeTransport& ipc)
+{
+    if (ipc.lastResult() == TEEC_ERROR_CANCEL) {
+        ALOGE("Delete timed out");
+        return GatekeeperStatusCode::ERROR_RETRY_TIMEOUT;
+    }
+
+    ALOGE("Delete failed without respond");
+    return GatekeeperStatusCode::ERROR_GENERAL_FAILURE;
+}
+
+/*
+ * Status of a delete call the TA answered with @error
+ */
+static GatekeeperStatusCode deleteStatus(uint32_t error)
+{
+    if (error != ERROR_NONE) {
+        ALOGE("Delete failed with error %u", error);
+        return GatekeeperStatusCode::ERROR_GENERAL_FAILURE;
+    }
+
+    ALOGV("Delete returns success");
+    return GatekeeperStatusCode::STATUS_OK;
+}
+
+const uint32_t OpteeGateKeeperDevice::CONNECT_WAIT_MS;
+const uint32_t OpteeGateKeeperDevice::CONNECT_RETRY_MIN_MS;
+const uint32_t OpteeGateKeeperDevice::CONNECT_RETRY_MAX_MS;
+const uint32_t OpteeGateKeeperDevice::LOCKOUT_CACHE_MAX;
+
+OpteeGateKeeperDevice::OpteeGateKeeperDevice(uint32_t sessions,
+        TransportFactory factory, const CallDeadlines& deadlines)
+    : sessions_(sessions),
+      transportFactory_(factory ? factory : [] {
+          return std::unique_ptr<TeeTransport>(new (std::nothrow) OpteeIPC);
+      }),
+      deadlines_(deadlines),
+      connected_(false),
+      stopping_(false),
+      kdfIterations_(0),
+      kdfCostUs_(0),
+      batchSeq_(0),
+      batchLeaders_(0)
+{
+    connectThread_ = std::thread(&OpteeGateKeeperDevice::connectLoop, this);
 }
 
 OpteeGateKeeperDevice::~OpteeGateKeeperDevice()
 {
+    {
+        std::lock_guard<std::mutex> lock(stateMutex_);
+        stopping_ = true;
+    }
+    stateCv_.notify_all();
+    if (connectThread_.joinable()) {
+        connectThread_.join();
+    }
+
     disconnect();
 }
 
@@ -44,118 +131,118 @@ Return<void> OpteeGateKeeperDevice::enroll(uint32_t uid,
         const hidl_vec<uint8_t>& currentPasswordHandle,
         const hidl_vec<uint8_t>& currentPassword,
         const hidl_vec<uint8_t>& desiredPassword,
-        enroll_cb cb)
+        enroll_cb _hidl_cb)
 {
     ALOGV("Start enroll");
     GatekeeperResponse rsp;
+    GatekeeperMetrics::CallTrace trace(metrics_, GK_ENROLL);
+    auto cb = [&trace, &_hidl_cb](const GatekeeperResponse& response) {
+        trace.setStatus(response.code);
+        _hidl_cb(response);
+    };
 
-    if (!connected_) {
-        ALOGE("Device is not connected");
+    if (!desiredPassword.size()) {
+        ALOGE("No password was enrolled");
         rsp.code = GatekeeperStatusCode::ERROR_GENERAL_FAILURE;
         cb(rsp);
         return Void();
     }
 
-    if (!desiredPassword.size()) {
-        ALOGE("No password was enrolled");
+    // TA rejects the whole request otherwise
+    if (desiredPassword.size() > GK_MAX_PASSWORD_LENGTH ||
+            currentPassword.size() > GK_MAX_PASSWORD_LENGTH) {
+        ALOGE("Password is too long");
         rsp.code = GatekeeperStatusCode::ERROR_GENERAL_FAILURE;
         cb(rsp);
         return Void();
     }
 
-    /*
-     * Enroll request layout
-     * +--------------------------------+---------------------------------+
-     * | Name                           | Number of bytes                 |
-     * +--------------------------------+---------------------------------+
-     * | uid                            | 4                               |
-     * | desired_password_length        | 4                               |
-     * | desired_password               | #desired_password_length        |
-     * | current_password_length        | 4                               |
-     * | current_password               | #current_password_length        |
-     * | current_password_handle_length | 4                               |
-     * | current_password_handle        | #current_password_handle_length |
-     * +--------------------------------+---------------------------------+
-     */
-    const uint32_t request_size = sizeof(uid) +
-        sizeof(desiredPassword.size()) +
-        desiredPassword.size() +
-        sizeof(currentPassword.size()) +
-        currentPassword.size() +
-        sizeof(currentPasswordHandle.size()) +
-        currentPasswordHandle.size();
-    uint8_t request[request_size];
-
-    uint8_t *i_req = request;
-    serialize_int(&i_req, uid);
-    serialize_blob(&i_req, desiredPassword.data(), desiredPassword.size());
-    serialize_blob(&i_req, currentPassword.data(), currentPassword.size());
-    serialize_blob(&i_req, currentPasswordHandle.data(),
-            currentPasswordHandle.size());
-
-    uint32_t response_size = RECV_BUF_SIZE;
-    uint8_t response[response_size];
-
-    if(!Send(GK_ENROLL, request, request_size, response, response_size)) {
-        ALOGE("Enroll failed without respond");
+    if (checkLockout(currentPasswordHandle, rsp.timeout)) {
+        ALOGV("Enroll is locked out for %u", rsp.timeout);
+        rsp.code = GatekeeperStatusCode::ERROR_RETRY_TIMEOUT;
+        cb(rsp);
+        return Void();
+    }
+
+    if (!waitConnected()) {
+        ALOGE("Device is not connected");
         rsp.code = GatekeeperStatusCode::ERROR_GENERAL_FAILURE;
         cb(rsp);
         return Void();
     }
 
-    const uint8_t *i_resp = response;
-    uint32_t error;
-
-    /*
-     * Enroll response layout
-     * +--------------------------------+---------------------------------+
-     * | Name                           | Number of bytes                 |
-     * +--------------------------------+---------------------------------+
-     * | error                          | 4                               |
-     * +--------------------------------+---------------------------------+
-     * | retry_timeout                  | 4                               |
-     * +------------------------------ OR --------------------------------+
-     * | response_handle_length         | 4                               |
-     * | response_handle                | #response_handle_length         |
-     * +--------------------------------+---------------------------------+
-     */
-    deserialize_int(&i_resp, &error);
-    if (error == ERROR_RETRY) {
-        uint32_t retry_timeout;
-        deserialize_int(&i_resp, &retry_timeout);
-        ALOGV("Enroll returns retry timeout %u", retry_timeout);
-        rsp.timeout = retry_timeout;
-        rsp.code = GatekeeperStatusCode::ERROR_RETRY_TIMEOUT;
+    waitVerifies(uid, false);
+    OpteeIPCPool::Lease ipc = gatekeeperIPC_.acquire(uid);
+    if (!ipc) {
+        ALOGE("Device is not connected");
+        rsp.code = GatekeeperStatusCode::ERROR_GENERAL_FAILURE;
+        cb(rsp);
+        return Void();
+    }
+    trace.mark();
+
+    // Layouts are defined by GK_ENROLL_REQUEST/RESPONSE in gatekeeper_ipc.h
+    gk_enroll_request_t req;
+    req.uid = uid;
+    req.desired_password = blob(desiredPassword);
+    req.current_password = blob(currentPassword);
+    req.current_password_handle = blob(currentPasswordHandle);
+
+    const uint32_t request_size = gk_enroll_request_size(&req);
+    uint8_t *request = ipc->requestBuffer(request_size);
+    if (!request || !gk_enroll_request_encode(request, request_size, &req)) {
+        ALOGE("Cannot get shared memory for enroll");
+        rsp.code = GatekeeperStatusCode::ERROR_GENERAL_FAILURE;
         cb(rsp);
         return Void();
     }
 
-    if (error != ERROR_NONE) {
-        ALOGE("Enroll failed");
+    uint32_t response_size = 0;
+    const CommandResponse<GK_ENROLL> *response =
+        Send<GK_ENROLL>(*ipc, trace, request_size, response_size,
+                deadlines_.enrollMs);
+    if (!response && ipc->lastResult() == TEEC_ERROR_CANCEL) {
+        ALOGE("Enroll timed out");
+        rsp.timeout = deadlines_.retryMs;
+        rsp.code = GatekeeperStatusCode::ERROR_RETRY_TIMEOUT;
+        cb(rsp);
+        return Void();
+    }
+    if (!response) {
+        ALOGE("Enroll failed without respond");
         rsp.code = GatekeeperStatusCode::ERROR_GENERAL_FAILURE;
         cb(rsp);
         return Void();
     }
 
-    const uint8_t *response_handle = nullptr;
-    uint32_t response_handle_length = 0;
+    gk_enroll_response_t msg;
+    if (!gk_enroll_response_decode(&msg, response->data(), response_size)) {
+        ALOGE("Malformed enroll response");
+        rsp.code = GatekeeperStatusCode::ERROR_GENERAL_FAILURE;
+        cb(rsp);
+        return Void();
+    }
 
-    deserialize_blob(&i_resp, &response_handle, &response_handle_length);
+    if (msg.error == ERROR_RETRY) {
+        ALOGV("Enroll returns retry timeout %u", msg.retry_timeout);
+        updateLockout(uid, currentPasswordHandle, msg.retry_timeout);
+        rsp.timeout = msg.retry_timeout;
+        rsp.code = GatekeeperStatusCode::ERROR_RETRY_TIMEOUT;
+        cb(rsp);
+        return Void();
+    }
 
-    std::unique_ptr<uint8_t []> response_handle_ret(
-            new (std::nothrow) uint8_t[response_handle_length]);
-    if (!response_handle_ret) {
-        ALOGE("Cannot create enrolled password handle, not enough memory");
+    if (msg.error != ERROR_NONE) {
+        ALOGE("Enroll failed");
         rsp.code = GatekeeperStatusCode::ERROR_GENERAL_FAILURE;
         cb(rsp);
         return Void();
     }
 
-    memcpy(response_handle_ret.get(), response_handle, response_handle_length);
-
-    rsp.data.setToExternal(response_handle_ret.release(),
-                           response_handle_length,
-                           true);
+    // Binder copies the handle straight from the response area while cb
+    // runs, and the area is kept until the session lease is returned
+    rsp.data.setToExternal(const_cast<uint8_t *>(msg.password_handle.data),
+                           msg.password_handle.length);
     rsp.code = GatekeeperStatusCode::STATUS_OK;
 
     ALOGV("Enroll returns success");
@@ -168,114 +255,116 @@ Return<void> OpteeGateKeeperDevice::verify(uint32_t uid,
                                 uint64_t challenge,
                                 const hidl_vec<uint8_t>& enrolledPasswordHandle,
                                 const hidl_vec<uint8_t>& providedPassword,
-                                verify_cb cb)
+                                verify_cb _hidl_cb)
 {
     ALOGV("Start verify");
     GatekeeperResponse rsp;
-
-    if (!connected_) {
-        ALOGE("Device is not connected");
+    GatekeeperMetrics::CallTrace trace(metrics_, GK_VERIFY);
+    auto cb = [&trace, &_hidl_cb](const GatekeeperResponse& response) {
+        trace.setStatus(response.code);
+        _hidl_cb(response);
+    };
+
+    if (providedPassword.size() > GK_MAX_PASSWORD_LENGTH) {
+        ALOGE("Password is too long");
         rsp.code = GatekeeperStatusCode::ERROR_GENERAL_FAILURE;
         cb(rsp);
         return Void();
     }
 
-    /*
-     * Verify request layout
-     * +---------------------------------+----------------------------------+
-     * | Name                            | Number of bytes                  |
-     * +---------------------------------+----------------------------------+
-     * | uid                             | 4                                |
-     * | challenge                       | 8                                |
-     * | enrolled_password_handle_length | 4                                |
-     * | enrolled_password_handle        | #enrolled_password_handle_length |
-     * | provided_password_length        | 4                                |
-     * | provided_password               | #provided_password_length        |
-     * +---------------------------------+----------------------------------+
-     */
-    const uint32_t request_size = sizeof(uid) +
-        sizeof(challenge) +
-        sizeof(enrolledPasswordHandle.size()) +
-        enrolledPasswordHandle.size() +
-        sizeof(providedPassword.size()) +
-        providedPassword.size();
-    uint8_t request[request_size];
-
-    uint8_t *i_req = request;
-    serialize_int(&i_req, uid);
-    serialize_int64(&i_req, challenge);
-    serialize_blob(&i_req, enrolledPasswordHandle.data(),
-            enrolledPasswordHandle.size());
-    serialize_blob(&i_req, providedPassword.data(), providedPassword.size());
-
-    uint32_t response_size = RECV_BUF_SIZE;
-    uint8_t response[response_size];
-
-    if(!Send(GK_VERIFY, request, request_size, response, response_size)) {
-        ALOGE("Verify failed without respond");
+    if (checkLockout(enrolledPasswordHandle, rsp.timeout)) {
+        ALOGV("Verify is locked out for %u", rsp.timeout);
+        rsp.code = GatekeeperStatusCode::ERROR_RETRY_TIMEOUT;
+        cb(rsp);
+        return Void();
+    }
+
+    if (!waitConnected()) {
+        ALOGE("Device is not connected");
         rsp.code = GatekeeperStatusCode::ERROR_GENERAL_FAILURE;
         cb(rsp);
         return Void();
     }
 
-    const uint8_t *i_resp = response;
-    uint32_t error;
-
-    /*
-     * Verify response layout
-     * +--------------------------------+---------------------------------+
-     * | Name                           | Number of bytes                 |
-     * +--------------------------------+---------------------------------+
-     * | error                          | 4                               |
-     * +--------------------------------+---------------------------------+
-     * | retry_timeout                  | 4                               |
-     * +------------------------------ OR --------------------------------+
-     * | response_auth_token_length     | 4                               |
-     * | response_auth_token            | #response_handle_length         |
-     * | response_request_reenroll      | 4                               |
-     * +--------------------------------+---------------------------------+
-     */
-    deserialize_int(&i_resp, &error);
-    if (error == ERROR_RETRY) {
-        uint32_t retry_timeout;
-        deserialize_int(&i_resp, &retry_timeout);
-        ALOGV("Verify returns retry timeout %u", retry_timeout);
-        rsp.timeout = retry_timeout;
+    // Layouts are defined by GK_VERIFY_REQUEST/RESPONSE in gatekeeper_ipc.h
+    PendingVerify pending;
+    pending.request.uid = uid;
+    pending.request.challenge = challenge;
+    pending.request.enrolled_password_handle = blob(enrolledPasswordHandle);
+    pending.request.provided_password = blob(providedPassword);
+    pending.trace = &trace;
+    pending.sent = false;
+    pending.timedOut = false;
+    pending.done = false;
+
+    // Keeps the session whose arena holds our auth token
+    OpteeIPCPool::Lease held;
+    {
+        std::unique_lock<std::mutex> lock(batchMutex_);
+        pending.seq = batchSeq_++;
+        batchQueue_.push_back(&pending);
+
+        while (!pending.done) {
+            PendingVerify *batch[GK_VERIFY_BATCH_MAX];
+            uint32_t count = 0;
+
+            if (batchLeaders_ < sessions_) {
+                count = takeBatch(batch);
+            }
+            if (!count) {
+                batchCv_.wait(lock);
+                continue;
+            }
+
+            batchLeaders_++;
+            lock.unlock();
+            held = sendBatch(batch, count, &pending);
+            lock.lock();
+            batchLeaders_--;
+
+            for (uint32_t i = 0; i < count; i++) {
+                batchInFlight_.erase(std::find(batchInFlight_.begin(),
+                            batchInFlight_.end(), batch[i]));
+                batch[i]->done = true;
+            }
+            batchCv_.notify_all();
+        }
+    }
+
+    const gk_verify_response_t& msg = pending.response;
+    if (pending.timedOut) {
+        ALOGE("Verify timed out");
+        rsp.timeout = deadlines_.retryMs;
         rsp.code = GatekeeperStatusCode::ERROR_RETRY_TIMEOUT;
         cb(rsp);
         return Void();
-    } else if (error != ERROR_NONE) {
-        ALOGE("Verify failed");
+    }
+    if (!pending.sent) {
         rsp.code = GatekeeperStatusCode::ERROR_GENERAL_FAILURE;
         cb(rsp);
         return Void();
     }
 
-    const uint8_t *response_auth_token = nullptr;
-    uint32_t response_auth_token_length = 0;
-
-    deserialize_blob(&i_resp, &response_auth_token,
-        &response_auth_token_length);
-
-    std::unique_ptr<uint8_t []> auth_token_ret(
-            new (std::nothrow) uint8_t[response_auth_token_length]);
-    if (!auth_token_ret) {
-        ALOGE("Cannot create auth token, not enough memory");
+    if (msg.error == ERROR_RETRY) {
+        ALOGV("Verify returns retry timeout %u", msg.retry_timeout);
+        updateLockout(uid, enrolledPasswordHandle, msg.retry_timeout);
+        rsp.timeout = msg.retry_timeout;
+        rsp.code = GatekeeperStatusCode::ERROR_RETRY_TIMEOUT;
+        cb(rsp);
+        return Void();
+    } else if (msg.error != ERROR_NONE) {
+        ALOGE("Verify failed");
         rsp.code = GatekeeperStatusCode::ERROR_GENERAL_FAILURE;
         cb(rsp);
         return Void();
     }
 
-    memcpy(auth_token_ret.get(), response_auth_token,
-            response_auth_token_length);
-    rsp.data.setToExternal(auth_token_ret.release(),
-                           response_auth_token_length,
-                           true);
-
-    uint32_t response_request_reenroll;
-    deserialize_int(&i_resp, &response_request_reenroll);
+    // Auth token is passed to binder as a view of the response arena or
+    // of the leader's copy
+    rsp.data.setToExternal(const_cast<uint8_t *>(msg.auth_token.data),
+                           msg.auth_token.length);
 
-    if (response_request_reenroll != 0) {
+    if (msg.request_reenroll != 0) {
         rsp.code = GatekeeperStatusCode::STATUS_REENROLL;
     } else {
         rsp.code = GatekeeperStatusCode::STATUS_OK;
@@ -284,60 +373,561 @@ Return<void> OpteeGateKeeperDevice::verify(uint32_t uid,
     ALOGV("Verify returns success");
 
     cb(rsp);
+    memset(pending.authToken, 0, sizeof(pending.authToken));
     return Void();
 }
 
 Return<void> OpteeGateKeeperDevice::deleteUser(uint32_t uid, deleteUser_cb cb)
 {
+    ALOGV("Start delete user");
     GatekeeperResponse rsp;
-    (void)uid;
-    rsp.code = GatekeeperStatusCode::ERROR_NOT_IMPLEMENTED;
+    GatekeeperMetrics::CallTrace trace(metrics_, GK_DELETE_USER);
+
+    rsp.code = sendDeleteUser(uid, trace);
+    if (rsp.code == GatekeeperStatusCode::ERROR_RETRY_TIMEOUT) {
+        rsp.timeout = deadlines_.retryMs;
+    }
+    trace.setStatus(rsp.code);
     cb(rsp);
     return Void();
 }
 
 Return<void> OpteeGateKeeperDevice::deleteAllUsers(deleteAllUsers_cb cb)
 {
+    ALOGV("Start delete all users");
     GatekeeperResponse rsp;
-    rsp.code = GatekeeperStatusCode::ERROR_NOT_IMPLEMENTED;
+    GatekeeperMetrics::CallTrace trace(metrics_, GK_DELETE_ALL_USERS);
+
+    rsp.code = sendDeleteAllUsers(trace);
+    if (rsp.code == GatekeeperStatusCode::ERROR_RETRY_TIMEOUT) {
+        rsp.timeout = deadlines_.retryMs;
+    }
+    trace.setStatus(rsp.code);
     cb(rsp);
     return Void();
 }
 
+Return<void> OpteeGateKeeperDevice::debug(const hidl_handle& fd,
+        const hidl_vec<hidl_string>& options)
+{
+    const native_handle_t *handle = fd.getNativeHandle();
+    if (handle == nullptr || handle->numFds < 1) {
+        ALOGE("No file descriptor to dump into");
+        return Void();
+    }
+    int out = handle->data[0];
+
+    for (size_t i = 0; i < options.size(); i++) {
+        if (!strcmp(options[i].c_str(), "--reset")) {
+            metrics_.reset();
+            dprintf(out, "Metrics are reset\n");
+            return Void();
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(stateMutex_);
+        dprintf(out, "Connected: %s\n", connected_ ? "yes" : "no");
+        dprintf(out, "Password KDF: %u iterations, %u us\n",
+                kdfIterations_, kdfCostUs_);
+    }
+    dprintf(out, "Sessions: %u of %u\n", gatekeeperIPC_.size(), sessions_);
+    metrics_.dump(out);
+    dumpTaStats(out);
+
+    return Void();
+}
+
 bool OpteeGateKeeperDevice::connect()
 {
-    if (connected_) {
+    if (gatekeeperIPC_.size()) {
         ALOGE("Device is already connected");
         return false;
     }
 
-    if (!gatekeeperIPC_.connect(TA_GATEKEEPER_UUID)) {
+    if (!gatekeeperIPC_.connect(TA_GATEKEEPER_UUID, sessions_,
+                transportFactory_,
+                [this](TeeTransport& ipc) { warmUp(ipc); })) {
         ALOGE("Fail to load Gatekeeper TA");
         return false;
     }
-    connected_ = true;
 
-    ALOGV("Connected");
+    ALOGV("Connected with %u sessions", gatekeeperIPC_.size());
 
     return true;
 }
 
 void OpteeGateKeeperDevice::disconnect()
 {
-    if (connected_) {
-        gatekeeperIPC_.disconnect();
+    {
+        std::lock_guard<std::mutex> lock(stateMutex_);
         connected_ = false;
     }
+    gatekeeperIPC_.disconnect();
 
     ALOGV("Disconnected");
 }
 
-bool OpteeGateKeeperDevice::Send(uint32_t command,
-        const uint8_t *request, uint32_t request_size,
-        uint8_t *response, uint32_t& response_size)
+void OpteeGateKeeperDevice::connectLoop()
+{
+    uint32_t delay_ms = CONNECT_RETRY_MIN_MS;
+    std::unique_lock<std::mutex> lock(stateMutex_);
+
+    while (!stopping_) {
+        lock.unlock();
+        bool connected = connect();
+        lock.lock();
+
+        if (connected) {
+            connected_ = true;
+            stateCv_.notify_all();
+            return;
+        }
+
+        ALOGW("Retry to connect in %u ms", delay_ms);
+        stateCv_.wait_for(lock, std::chrono::milliseconds(delay_ms),
+                [this] { return stopping_; });
+        delay_ms = std::min(delay_ms * 2, CONNECT_RETRY_MAX_MS);
+    }
+}
+
+bool OpteeGateKeeperDevice::waitConnected()
+{
+    std::unique_lock<std::mutex> lock(stateMutex_);
+
+    stateCv_.wait_for(lock, std::chrono::milliseconds(CONNECT_WAIT_MS),
+            [this] { return connected_ || stopping_; });
+
+    return connected_;
+}
+
+void OpteeGateKeeperDevice::warmUp(TeeTransport& ipc)
+{
+    GatekeeperMetrics::CallTrace trace(metrics_, GK_WARMUP);
+    trace.mark();
+
+    // Never cancelled: on first boot warm-up calibrates the KDF, and a
+    // slow device must still finish and store the calibration
+    uint32_t response_size = 0;
+    const CommandResponse<GK_WARMUP> *response =
+        Send<GK_WARMUP>(ipc, trace, 0, response_size, 0);
+    if (!response) {
+        ALOGW("Warm-up failed without respond");
+        return;
+    }
+
+    gk_warmup_response_t msg;
+    if (!gk_warmup_response_decode(&msg, response->data(), response_size)) {
+        ALOGW("Malformed warm-up response");
+    } else if (msg.error != ERROR_NONE) {
+        ALOGW("Warm-up failed with error %u", msg.error);
+    } else {
+        std::lock_guard<std::mutex> lock(stateMutex_);
+        kdfIterations_ = msg.kdf_iterations;
+        kdfCostUs_ = msg.kdf_cost_us;
+    }
+}
+
+GatekeeperStatusCode OpteeGateKeeperDevice::sendDeleteUser(uint32_t uid,
+        GatekeeperMetrics::CallTrace& trace)
 {
-    return gatekeeperIPC_.call(command, request, request_size,
-            response, response_size);
+    if (!waitConnected()) {
+        ALOGE("Device is not connected");
+        return GatekeeperStatusCode::ERROR_GENERAL_FAILURE;
+    }
+
+    waitVerifies(uid, false);
+    OpteeIPCPool::Lease ipc = gatekeeperIPC_.acquire(uid);
+    if (!ipc) {
+        ALOGE("Device is not connected");
+        return GatekeeperStatusCode::ERROR_GENERAL_FAILURE;
+    }
+    trace.mark();
+
+    // Layouts are defined by GK_DELETE_USER_REQUEST/RESPONSE in
+    // gatekeeper_ipc.h
+    gk_delete_user_request_t req;
+    req.uid = uid;
+
+    const uint32_t request_size = gk_delete_user_request_size(&req);
+    uint8_t *request = ipc->requestBuffer(request_size);
+    if (!request ||
+            !gk_delete_user_request_encode(request, request_size, &req)) {
+        ALOGE("Cannot get shared memory for delete user");
+        return GatekeeperStatusCode::ERROR_GENERAL_FAILURE;
+    }
+
+    uint32_t response_size = 0;
+    const CommandResponse<GK_DELETE_USER> *response =
+        Send<GK_DELETE_USER>(*ipc, trace, request_size, response_size,
+                deadlines_.otherMs);
+    if (!response) {
+        return deleteFailure(*ipc);
+    }
+
+    gk_delete_user_response_t msg;
+    if (!gk_delete_user_response_decode(&msg, response->data(),
+                response_size)) {
+        ALOGE("Malformed delete response");
+        return GatekeeperStatusCode::ERROR_GENERAL_FAILURE;
+    }
+
+    const GatekeeperStatusCode status = deleteStatus(msg.error);
+    if (status == GatekeeperStatusCode::STATUS_OK) {
+        forgetLockouts(uid);
+    }
+    return status;
+}
+
+GatekeeperStatusCode OpteeGateKeeperDevice::sendDeleteAllUsers(
+        GatekeeperMetrics::CallTrace& trace)
+{
+    if (!waitConnected()) {
+        ALOGE("Device is not connected");
+        return GatekeeperStatusCode::ERROR_GENERAL_FAILURE;
+    }
+
+    // Ordered after earlier calls of every uid
+    waitVerifies(0, true);
+    OpteeIPCPool::Lease ipc = gatekeeperIPC_.acquireAll();
+    if (!ipc) {
+        ALOGE("Device is not connected");
+        return GatekeeperStatusCode::ERROR_GENERAL_FAILURE;
+    }
+    trace.mark();
+
+    // Request is empty, response layout is defined by
+    // GK_DELETE_ALL_USERS_RESPONSE in gatekeeper_ipc.h
+    uint32_t response_size = 0;
+    const CommandResponse<GK_DELETE_ALL_USERS> *response =
+        Send<GK_DELETE_ALL_USERS>(*ipc, trace, 0, response_size,
+                deadlines_.otherMs);
+    if (!response) {
+        return deleteFailure(*ipc);
+    }
+
+    gk_delete_all_users_response_t msg;
+    if (!gk_delete_all_users_response_decode(&msg, response->data(),
+                response_size)) {
+        ALOGE("Malformed delete response");
+        return GatekeeperStatusCode::ERROR_GENERAL_FAILURE;
+    }
+
+    const GatekeeperStatusCode status = deleteStatus(msg.error);
+    if (status == GatekeeperStatusCode::STATUS_OK) {
+        forgetAllLockouts();
+    }
+    return status;
+}
+
+void OpteeGateKeeperDevice::dumpTaStats(int fd)
+{
+    GatekeeperMetrics::CallTrace trace(metrics_, GK_GET_STATS);
+
+    // Dump does not wait for connection or for calls of any uid, empty
+    // lease means not connected
+    OpteeIPCPool::Lease ipc = gatekeeperIPC_.acquireAny();
+    if (!ipc) {
+        dprintf(fd, "TA stats: not connected\n");
+        return;
+    }
+    trace.mark();
+
+    uint32_t response_size = 0;
+    const CommandResponse<GK_GET_STATS> *response =
+        Send<GK_GET_STATS>(*ipc, trace, 0, response_size, deadlines_.otherMs);
+
+    gk_get_stats_response_t msg = {};
+    if (!response ||
+            !gk_get_stats_response_decode(&msg, response->data(),
+                response_size) ||
+            msg.error != ERROR_NONE) {
+        dprintf(fd, "TA stats: unavailable\n");
+        return;
+    }
+
+    auto stage = [fd](const char *name, uint32_t count, uint64_t ms) {
+        dprintf(fd, "  %-14s %10u %10llu %10llu\n", name, count,
+                (unsigned long long)ms,
+                (unsigned long long)(count ? ms * 1000 / count : 0));
+    };
+
+    dprintf(fd, "TA stages:\n");
+    dprintf(fd, "  %-14s %10s %10s %10s\n", "stage", "count", "total ms",
+            "avg us");
+    stage("master_key", msg.master_key_count, msg.master_key_ms);
+    stage("password_mac", msg.password_mac_count, msg.password_mac_ms);
+    stage("keymaster", msg.keymaster_count, msg.keymaster_ms);
+    stage("mint", msg.mint_count, msg.mint_ms);
+    stage("record_read", msg.record_read_count, msg.record_read_ms);
+    stage("record_write", msg.record_write_count, msg.record_write_ms);
+    dprintf(fd, "TA throttled requests: %u\n", msg.throttled);
+    dprintf(fd, "TA lockouts: %u\n", msg.lockouts);
+    dprintf(fd, "TA failure records: %u of %u\n", msg.records,
+            msg.record_capacity);
+}
+
+bool OpteeGateKeeperDevice::checkLockout(const hidl_vec<uint8_t>& handle,
+        uint32_t& timeout)
+{
+    uint64_t user_id;
+    if (!handleUserId(handle, user_id)) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(lockoutMutex_);
+    auto it = lockouts_.find(user_id);
+    if (it == lockouts_.end()) {
+        return false;
+    }
+
+    const LockoutClock::time_point now = LockoutClock::now();
+    if (now >= it->second.until) {
+        lockouts_.erase(it);
+        return false;
+    }
+
+    // Round up, so the caller does not come back before the TA allows
+    const uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(
+            it->second.until - now).count();
+    timeout = (us + 999) / 1000;
+    metrics_.recordLockoutHit();
+    return true;
+}
+
+void OpteeGateKeeperDevice::updateLockout(uint32_t uid,
+        const hidl_vec<uint8_t>& handle, uint32_t timeout)
+{
+    uint64_t user_id;
+    if (!handleUserId(handle, user_id)) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(lockoutMutex_);
+    if (!timeout) {
+        lockouts_.erase(user_id);
+        return;
+    }
+
+    const LockoutClock::time_point now = LockoutClock::now();
+    if (lockouts_.size() >= LOCKOUT_CACHE_MAX) {
+        for (auto it = lockouts_.begin(); it != lockouts_.end();) {
+            it = now >= it->second.until ? lockouts_.erase(it) :
+                std::next(it);
+        }
+        if (lockouts_.size() >= LOCKOUT_CACHE_MAX) {
+            return;
+        }
+    }
+
+    lockouts_[user_id] = {uid, now + std::chrono::milliseconds(timeout)};
+}
+
+void OpteeGateKeeperDevice::forgetLockouts(uint32_t uid)
+{
+    std::lock_guard<std::mutex> lock(lockoutMutex_);
+    for (auto it = lockouts_.begin(); it != lockouts_.end();) {
+        it = it->second.uid == uid ? lockouts_.erase(it) : std::next(it);
+    }
+}
+
+void OpteeGateKeeperDevice::forgetAllLockouts()
+{
+    std::lock_guard<std::mutex> lock(lockoutMutex_);
+    lockouts_.clear();
+}
+
+bool OpteeGateKeeperDevice::uidInFlight(uint32_t uid) const
+{
+    for (const PendingVerify *pending : batchInFlight_) {
+        if (pending->request.uid == uid) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void OpteeGateKeeperDevice::waitVerifies(uint32_t uid, bool all)
+{
+    std::unique_lock<std::mutex> lock(batchMutex_);
+    const uint64_t limit = batchSeq_;
+
+    auto earlier = [uid, all, limit](const PendingVerify *pending) {
+        return pending->seq < limit &&
+            (all || pending->request.uid == uid);
+    };
+    batchCv_.wait(lock, [this, &earlier] {
+        return std::none_of(batchQueue_.begin(), batchQueue_.end(),
+                earlier) &&
+            std::none_of(batchInFlight_.begin(), batchInFlight_.end(),
+                earlier);
+    });
+}
+
+uint32_t OpteeGateKeeperDevice::takeBatch(PendingVerify **batch)
+{
+    gk_verify_batch_request_t header;
+    uint32_t request_size;
+    uint32_t count = 0;
+
+    header.count = GK_VERIFY_BATCH_MAX;
+    request_size = gk_verify_batch_request_size(&header);
+
+    for (auto it = batchQueue_.begin();
+            it != batchQueue_.end() && count < GK_VERIFY_BATCH_MAX;) {
+        PendingVerify *pending = *it;
+        uint32_t size = gk_verify_request_size(&pending->request);
+
+        if (uidInFlight(pending->request.uid)) {
+            ++it;
+            continue;
+        }
+        // The first entry is always taken, the arena grows for it if
+        // needed, others must fit in what is already there
+        if (count && request_size + size > OpteeIPC::requestCapacity()) {
+            break;
+        }
+
+        request_size += size;
+        batch[count++] = pending;
+        batchInFlight_.push_back(pending);
+        it = batchQueue_.erase(it);
+    }
+
+    return count;
+}
+
+OpteeIPCPool::Lease OpteeGateKeeperDevice::sendBatch(PendingVerify **batch,
+        uint32_t count, const PendingVerify *self)
+{
+    // Stripes of all batched uids are held, so enroll and delete of any
+    // of them stay ordered with the verify
+    uint32_t uids[GK_VERIFY_BATCH_MAX] = {};
+    for (uint32_t i = 0; i < count; i++) {
+        uids[i] = batch[i]->request.uid;
+    }
+
+    OpteeIPCPool::Lease ipc = gatekeeperIPC_.acquire(uids, count);
+    if (!ipc) {
+        ALOGE("Device is not connected");
+        return ipc;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        batch[i]->trace->mark();
+    }
+
+    if (count == 1) {
+        sendVerify(*ipc, batch[0], self);
+        return batch[0] == self ? std::move(ipc) : OpteeIPCPool::Lease();
+    }
+
+    // Session is already leased, so queue stage of the batch is empty
+    GatekeeperMetrics::CallTrace trace(metrics_, GK_VERIFY_BATCH);
+    trace.mark();
+
+    gk_verify_batch_request_t header;
+    header.count = count;
+
+    uint32_t request_size = gk_verify_batch_request_size(&header);
+    for (uint32_t i = 0; i < count; i++) {
+        request_size += gk_verify_request_size(&batch[i]->request);
+    }
+
+    uint8_t *request = ipc->requestBuffer(request_size);
+    uint8_t *iter = request ? gk_verify_batch_request_encode(request,
+            request_size, &header) : nullptr;
+    for (uint32_t i = 0; i < count && iter; i++) {
+        iter = gk_verify_request_encode(iter,
+                request_size - (iter - request), &batch[i]->request);
+    }
+    if (!iter) {
+        ALOGE("Cannot get shared memory for verify batch");
+        return OpteeIPCPool::Lease();
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        batch[i]->trace->mark();
+    }
+
+    uint32_t response_size = 0;
+    const CommandResponse<GK_VERIFY_BATCH> *response =
+        Send<GK_VERIFY_BATCH>(*ipc, trace, request_size, response_size,
+                deadlines_.verifyMs * count);
+    for (uint32_t i = 0; i < count; i++) {
+        batch[i]->trace->mark();
+        batch[i]->timedOut = !response &&
+            ipc->lastResult() == TEEC_ERROR_CANCEL;
+    }
+    if (!response) {
+        ALOGE("Verify batch failed without respond");
+        return OpteeIPCPool::Lease();
+    }
+
+    bool own = false;
+    const uint8_t *data = response->data();
+    for (uint32_t i = 0; i < count; i++) {
+        PendingVerify *pending = batch[i];
+        gk_verify_response_t& msg = pending->response;
+
+        // Entries decoded so far stay sent, the leader's token among
+        // them needs the lease
+        if (!gk_verify_response_decode(&msg, data, response_size)) {
+            ALOGE("Malformed verify batch response");
+            break;
+        }
+        uint32_t size = gk_verify_response_size(&msg);
+        data += size;
+        response_size -= size;
+
+        if (pending == self) {
+            own = true;
+        } else if (msg.error == ERROR_NONE) {
+            msg.auth_token.length = std::min<uint32_t>(msg.auth_token.length,
+                    sizeof(pending->authToken));
+            memcpy(pending->authToken, msg.auth_token.data,
+                    msg.auth_token.length);
+            msg.auth_token.data = pending->authToken;
+        }
+        pending->sent = true;
+    }
+
+    return own ? std::move(ipc) : OpteeIPCPool::Lease();
+}
+
+void OpteeGateKeeperDevice::sendVerify(TeeTransport& ipc,
+        PendingVerify *pending, const PendingVerify *self)
+{
+    const uint32_t request_size = gk_verify_request_size(&pending->request);
+    uint8_t *request = ipc.requestBuffer(request_size);
+    if (!request || !gk_verify_request_encode(request, request_size,
+                &pending->request)) {
+        ALOGE("Cannot get shared memory for verify");
+        return;
+    }
+
+    uint32_t response_size = 0;
+    const CommandResponse<GK_VERIFY> *response =
+        Send<GK_VERIFY>(ipc, *pending->trace, request_size, response_size,
+                deadlines_.verifyMs);
+    if (!response) {
+        pending->timedOut = ipc.lastResult() == TEEC_ERROR_CANCEL;
+        ALOGE("Verify failed without respond");
+        return;
+    }
+
+    gk_verify_response_t& msg = pending->response;
+    if (!gk_verify_response_decode(&msg, response->data(), response_size)) {
+        ALOGE("Malformed verify response");
+        return;
+    }
+
+    if (pending != self && msg.error == ERROR_NONE) {
+        msg.auth_token.length = std::min<uint32_t>(msg.auth_token.length,
+                sizeof(pending->authToken));
+        memcpy(pending->authToken, msg.auth_token.data,
+                msg.auth_token.length);
+        msg.auth_token.data = pending->authToken;
+    }
+    pending->sent = true;
 }
 
 }  // namespace renesas
@@ -18,6 +18,14 @@
 #ifndef OPTEE_GATEKEEPER_H
 #define OPTEE_GATEKEEPER_H
 
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
 #include <android/hardware/gatekeeper/1.0/IGatekeeper.h>
 #include <hidl/Status.h>
 
@@ -25,7 +33,8 @@
 
 #include <hardware/hardware.h>
 
-#include "optee_ipc.h"
+#include "optee_gatekeeper_metrics.h"
+#include "optee_ipc_pool.h"
 
 namespace android {
 namespace hardware {
@@ -39,12 +48,35 @@ using android::hardware::Return;
 using android::hardware::Void;
 using android::hardware::hidl_vec;
 using android::hardware::hidl_string;
+using android::hardware::hidl_handle;
 using android::sp;
 
+/*
+ * Time a TA call may take before it is cancelled, ms, 0 for no limit.
+ * A cancelled enroll or verify fails with ERROR_RETRY_TIMEOUT and
+ * @retryMs, so the caller comes back soon instead of giving up. Warm-up
+ * is never cancelled, it may be calibrating the KDF.
+ */
+struct CallDeadlines {
+    uint32_t enrollMs = 3000;       // up to two password KDFs
+    uint32_t verifyMs = 2000;       // for every verify of a batch
+    uint32_t otherMs = 2000;        // delete and stats
+    uint32_t retryMs = 1000;
+};
+
 class OpteeGateKeeperDevice : public IGatekeeper
 {
 public:
-    OpteeGateKeeperDevice();
+    /*
+     * TA is connected in background, so the constructor does not block.
+     *
+     * @sessions number of TA sessions that serve calls in parallel
+     * @factory creates transport of every session, OP-TEE if not set
+     * @deadlines limits of TA calls
+     */
+    explicit OpteeGateKeeperDevice(uint32_t sessions = 1,
+            TransportFactory factory = nullptr,
+            const CallDeadlines& deadlines = CallDeadlines());
     ~OpteeGateKeeperDevice();
 
     // Methods from ::android::hardware::gatekeeper::V1_0::IGatekeeper follow.
@@ -60,15 +92,166 @@ public:
                         verify_cb _hidl_cb)  override;
     Return<void> deleteUser(uint32_t uid, deleteUser_cb _hidl_cb)  override;
     Return<void> deleteAllUsers(deleteAllUsers_cb _hidl_cb)  override;
+
+    // Methods from ::android::hidl::base::V1_0::IBase follow.
+    Return<void> debug(const hidl_handle& fd,
+                       const hidl_vec<hidl_string>& options)  override;
 private:
     bool connect();
     void disconnect();
 
-    bool Send(uint32_t command, const uint8_t *request, uint32_t request_size,
-                           uint8_t *response, uint32_t& response_size);
+    /*
+     * Retries connect() with back-off until it succeeds or device is
+     * destroyed
+     */
+    void connectLoop();
+    /*
+     * Waits until connectLoop() succeeds, at most CONNECT_WAIT_MS
+     */
+    bool waitConnected();
+    /*
+     * Makes TA load everything the first enroll or verify needs
+     */
+    void warmUp(TeeTransport& ipc);
+    /*
+     * Send GK_DELETE_USER of @uid and GK_DELETE_ALL_USERS
+     *
+     * @return ERROR_RETRY_TIMEOUT if the call was cancelled
+     */
+    GatekeeperStatusCode sendDeleteUser(uint32_t uid,
+            GatekeeperMetrics::CallTrace& trace);
+    GatekeeperStatusCode sendDeleteAllUsers(
+            GatekeeperMetrics::CallTrace& trace);
+    /*
+     * Prints TA side counters of GK_GET_STATS into @fd
+     */
+    void dumpTaStats(int fd);
+
+    /*
+     * Lockouts the TA reported with ERROR_RETRY are kept by secure user id
+     * of the password handle, so attempts before the deadline are refused
+     * without a TA call. The TA still checks every attempt after it.
+     *
+     * @return true and remaining lockout of @handle in @timeout, ms
+     */
+    bool checkLockout(const hidl_vec<uint8_t>& handle, uint32_t& timeout);
+    /*
+     * Remembers lockout of @handle of @uid for @timeout ms, forgets it if 0
+     */
+    void updateLockout(uint32_t uid, const hidl_vec<uint8_t>& handle,
+            uint32_t timeout);
+    /*
+     * Forget lockouts of @uid or of every user once the TA deleted them
+     */
+    void forgetLockouts(uint32_t uid);
+    void forgetAllLockouts();
+
+    /*
+     * Verify waiting to be sent to the TA. It lives on the stack of the
+     * calling binder thread, which sleeps until a batch leader fills
+     * @response or clears @sent on transport failure.
+     */
+    struct PendingVerify {
+        gk_verify_request_t request;
+        gk_verify_response_t response;
+        uint8_t authToken[GK_AUTH_TOKEN_SIZE];
+        GatekeeperMetrics::CallTrace *trace;
+        // Arrival order, later enroll and delete wait for lower ones
+        uint64_t seq;
+        bool sent;
+        bool timedOut;
+        bool done;
+    };
 
-    OpteeIPC gatekeeperIPC_;
+    /*
+     * Queued verifies are coalesced with flat combining: the caller that
+     * finds the queue non-empty and a session unused becomes a leader,
+     * takes up to GK_VERIFY_BATCH_MAX entries and sends them with one
+     * GK_VERIFY_BATCH, so the world switch and TA key setup are paid once.
+     * A lone entry goes as a plain GK_VERIFY. Entries of a uid that is in
+     * flight in another batch are left in the queue, which keeps verifies
+     * of the same uid in arrival order. Queued entries hold no stripe, so
+     * enroll and delete first wait for verifies queued before them with
+     * waitVerifies().
+     *
+     * Called with batchMutex_ held, returns number of taken entries.
+     */
+    uint32_t takeBatch(PendingVerify **batch);
+    /*
+     * Sends @batch. If the leader's own @self is in it, its auth token is
+     * left in the response arena and the lease is returned to be held
+     * until the token is passed to binder. Tokens of other callers are
+     * copied to their entries, as the session cannot wait for threads it
+     * does not control.
+     */
+    OpteeIPCPool::Lease sendBatch(PendingVerify **batch, uint32_t count,
+            const PendingVerify *self);
+    void sendVerify(TeeTransport& ipc, PendingVerify *pending,
+            const PendingVerify *self);
+    bool uidInFlight(uint32_t uid) const;
+    /*
+     * Blocks until verifies of @uid, or of any uid if @all is set, that
+     * were queued before the call are done.
+     */
+    void waitVerifies(uint32_t uid, bool all);
+
+    /*
+     * Request must be already serialized into @ipc requestBuffer().
+     * Returned response stays valid while @ipc is leased. The call is
+     * cancelled after @timeout_ms, see CallDeadlines.
+     */
+    template <gatekeeper_command_t Cmd>
+    const CommandResponse<Cmd> *Send(TeeTransport& ipc,
+            GatekeeperMetrics::CallTrace& trace, uint32_t request_size,
+            uint32_t& response_size, uint32_t timeout_ms)
+    {
+        trace.mark();
+        const CommandResponse<Cmd> *response =
+            ipc.invoke<Cmd>(request_size, response_size, timeout_ms);
+        trace.mark();
+
+        if (!response) {
+            metrics_.recordTeecError(ipc.lastResult(), ipc.lastOrigin());
+        }
+
+        return response;
+    }
+
+    static const uint32_t CONNECT_WAIT_MS = 10000;
+    static const uint32_t CONNECT_RETRY_MIN_MS = 100;
+    static const uint32_t CONNECT_RETRY_MAX_MS = 5000;
+    // Lockouts kept at once, more are left to the TA
+    static const uint32_t LOCKOUT_CACHE_MAX = 1024;
+
+    OpteeIPCPool gatekeeperIPC_;
+    const uint32_t sessions_;
+    const TransportFactory transportFactory_;
+    const CallDeadlines deadlines_;
+    GatekeeperMetrics metrics_;
+
+    std::mutex stateMutex_;
+    std::condition_variable stateCv_;
     bool connected_;
+    bool stopping_;
+    std::thread connectThread_;
+    // Password KDF calibration reported by warm-up, 0 if unknown
+    uint32_t kdfIterations_;
+    uint32_t kdfCostUs_;
+
+    std::mutex batchMutex_;
+    std::condition_variable batchCv_;
+    std::deque<PendingVerify *> batchQueue_;
+    std::vector<PendingVerify *> batchInFlight_;
+    uint64_t batchSeq_;
+    uint32_t batchLeaders_;
+
+    typedef std::chrono::steady_clock LockoutClock;
+    struct Lockout {
+        uint32_t uid;
+        LockoutClock::time_point until;
+    };
+    std::mutex lockoutMutex_;
+    std::unordered_map<uint64_t, Lockout> lockouts_;
 };
 
 }  // namespace renesas
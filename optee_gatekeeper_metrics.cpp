@@ -0,0 +1,355 @@
+/*
+ *
+ * Copyright (C) 2017 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+
+#include "optee_gatekeeper_metrics.h"
+
+namespace android {
+namespace hardware {
+namespace gatekeeper {
+namespace V1_0 {
+namespace renesas {
+
+static const char *commandName(uint32_t command)
+{
+    switch (command) {
+    case GK_ENROLL:
+        return "GK_ENROLL";
+    case GK_VERIFY:
+        return "GK_VERIFY";
+    case GK_WARMUP:
+        return "GK_WARMUP";
+    case GK_VERIFY_BATCH:
+        return "GK_VERIFY_BATCH";
+    case GK_DELETE_USER:
+        return "GK_DELETE_USER";
+    case GK_DELETE_ALL_USERS:
+        return "GK_DELETE_ALL_USERS";
+    case GK_GET_STATS:
+        return "GK_GET_STATS";
+    default:
+        return "UNKNOWN";
+    }
+}
+
+static const char *stageName(uint32_t stage)
+{
+    switch (stage) {
+    case GatekeeperMetrics::STAGE_QUEUE:
+        return "queue";
+    case GatekeeperMetrics::STAGE_SERIALIZE:
+        return "serialize";
+    case GatekeeperMetrics::STAGE_INVOKE:
+        return "invoke";
+    case GatekeeperMetrics::STAGE_DESERIALIZE:
+        return "deserialize";
+    case GatekeeperMetrics::STAGE_TOTAL:
+        return "total";
+    default:
+        return "unknown";
+    }
+}
+
+static const char *statusName(GatekeeperStatusCode code)
+{
+    switch (code) {
+    case GatekeeperStatusCode::STATUS_REENROLL:
+        return "STATUS_REENROLL";
+    case GatekeeperStatusCode::STATUS_OK:
+        return "STATUS_OK";
+    case GatekeeperStatusCode::ERROR_GENERAL_FAILURE:
+        return "ERROR_GENERAL_FAILURE";
+    case GatekeeperStatusCode::ERROR_RETRY_TIMEOUT:
+        return "ERROR_RETRY_TIMEOUT";
+    case GatekeeperStatusCode::ERROR_NOT_IMPLEMENTED:
+        return "ERROR_NOT_IMPLEMENTED";
+    default:
+        return "UNKNOWN";
+    }
+}
+
+LatencyHistogram::LatencyHistogram()
+{
+    reset();
+}
+
+void LatencyHistogram::record(uint64_t us)
+{
+    buckets_[bucketOf(us)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(us, std::memory_order_relaxed);
+
+    uint64_t max = max_.load(std::memory_order_relaxed);
+    while (us > max && !max_.compare_exchange_weak(max, us,
+                std::memory_order_relaxed)) {
+    }
+}
+
+void LatencyHistogram::reset()
+{
+    for (uint32_t i = 0; i < BUCKETS; i++) {
+        buckets_[i].store(0, std::memory_order_relaxed);
+    }
+    count_.store(0, std::memory_order_relaxed);
+    sum_.store(0, std::memory_order_relaxed);
+    max_.store(0, std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::count() const
+{
+    return count_.load(std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::max() const
+{
+    return max_.load(std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::average() const
+{
+    uint64_t count = count_.load(std::memory_order_relaxed);
+    return count ? sum_.load(std::memory_order_relaxed) / count : 0;
+}
+
+uint64_t LatencyHistogram::percentile(uint32_t permille) const
+{
+    uint64_t counts[BUCKETS];
+    uint64_t total = 0;
+
+    // Buckets are read one by one, so snapshot may be slightly skewed by
+    // concurrent writers. That is fine for statistics.
+    for (uint32_t i = 0; i < BUCKETS; i++) {
+        counts[i] = buckets_[i].load(std::memory_order_relaxed);
+        total += counts[i];
+    }
+    if (!total) {
+        return 0;
+    }
+
+    uint64_t rank = (total * permille + 999) / 1000;
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < BUCKETS; i++) {
+        seen += counts[i];
+        if (seen >= rank) {
+            return bucketUpperBound(i);
+        }
+    }
+
+    return bucketUpperBound(BUCKETS - 1);
+}
+
+uint32_t LatencyHistogram::bucketOf(uint64_t us)
+{
+    if (us < SUB_BUCKETS) {
+        return us;
+    }
+
+    uint32_t msb = 63 - __builtin_clzll(us);
+    uint32_t sub = (us >> (msb - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+    uint32_t bucket = (msb - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub;
+
+    return bucket < BUCKETS ? bucket : BUCKETS - 1;
+}
+
+uint64_t LatencyHistogram::bucketUpperBound(uint32_t bucket)
+{
+    if (bucket < SUB_BUCKETS) {
+        return bucket;
+    }
+
+    uint32_t msb = bucket / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+    uint64_t sub = bucket % SUB_BUCKETS;
+
+    return ((SUB_BUCKETS + sub + 1) << (msb - SUB_BUCKET_BITS)) - 1;
+}
+
+GatekeeperMetrics::CallTrace::CallTrace(GatekeeperMetrics& metrics,
+        gatekeeper_command_t command)
+    : metrics_(metrics),
+      command_(command),
+      start_(Clock::now()),
+      last_(start_),
+      stage_(STAGE_QUEUE),
+      hasStatus_(false),
+      status_(GatekeeperStatusCode::STATUS_OK)
+{
+}
+
+GatekeeperMetrics::CallTrace::~CallTrace()
+{
+    Clock::time_point now = Clock::now();
+
+    // Response stage only makes sense if TA was really invoked
+    if (stage_ == STAGE_DESERIALIZE) {
+        metrics_.recordStage(command_, stage_,
+                std::chrono::duration_cast<std::chrono::microseconds>(
+                    now - last_).count());
+    }
+    metrics_.recordStage(command_, STAGE_TOTAL,
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                now - start_).count());
+
+    if (hasStatus_) {
+        metrics_.recordStatus(status_);
+    }
+}
+
+void GatekeeperMetrics::CallTrace::mark()
+{
+    if (stage_ >= STAGE_DESERIALIZE) {
+        return;
+    }
+
+    Clock::time_point now = Clock::now();
+    metrics_.recordStage(command_, stage_,
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                now - last_).count());
+    last_ = now;
+    stage_++;
+}
+
+void GatekeeperMetrics::CallTrace::setStatus(GatekeeperStatusCode code)
+{
+    hasStatus_ = true;
+    status_ = code;
+}
+
+GatekeeperMetrics::GatekeeperMetrics()
+{
+    reset();
+}
+
+void GatekeeperMetrics::recordTeecError(uint32_t result, uint32_t origin)
+{
+    const uint64_t key = static_cast<uint64_t>(result) << 32 | origin;
+
+    for (uint32_t i = 0; i < TEEC_ERROR_SLOTS; i++) {
+        TeecErrorSlot& slot = teecErrors_[i];
+        uint64_t current = slot.key.load(std::memory_order_acquire);
+
+        if (current == 0) {
+            // Claim free slot, somebody else may be faster with same key
+            if (slot.key.compare_exchange_strong(current, key,
+                        std::memory_order_acq_rel)) {
+                current = key;
+            }
+        }
+        if (current == key) {
+            slot.count.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    }
+
+    teecErrorsDropped_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void GatekeeperMetrics::recordLockoutHit()
+{
+    lockoutHits_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void GatekeeperMetrics::reset()
+{
+    for (uint32_t i = 0; i < COMMANDS; i++) {
+        for (uint32_t j = 0; j < STAGE_COUNT; j++) {
+            latency_[i][j].reset();
+        }
+    }
+    for (uint32_t i = 0; i < STATUSES; i++) {
+        status_[i].store(0, std::memory_order_relaxed);
+    }
+    for (uint32_t i = 0; i < TEEC_ERROR_SLOTS; i++) {
+        teecErrors_[i].count.store(0, std::memory_order_relaxed);
+        teecErrors_[i].key.store(0, std::memory_order_release);
+    }
+    teecErrorsDropped_.store(0, std::memory_order_relaxed);
+    lockoutHits_.store(0, std::memory_order_relaxed);
+}
+
+void GatekeeperMetrics::dump(int fd) const
+{
+    dprintf(fd, "Latency, us:\n");
+    dprintf(fd, "  %-16s %-12s %10s %10s %10s %10s %10s\n", "command",
+            "stage", "count", "p50", "p99", "avg", "max");
+    for (uint32_t i = 0; i < COMMANDS; i++) {
+        for (uint32_t j = 0; j < STAGE_COUNT; j++) {
+            const LatencyHistogram& h = latency_[i][j];
+            if (!h.count()) {
+                continue;
+            }
+            dprintf(fd, "  %-16s %-12s %10llu %10llu %10llu %10llu %10llu\n",
+                    commandName(i), stageName(j),
+                    (unsigned long long)h.count(),
+                    (unsigned long long)h.percentile(500),
+                    (unsigned long long)h.percentile(990),
+                    (unsigned long long)h.average(),
+                    (unsigned long long)h.max());
+        }
+    }
+
+    dprintf(fd, "Status codes:\n");
+    for (uint32_t i = 0; i < STATUSES; i++) {
+        uint64_t count = status_[i].load(std::memory_order_relaxed);
+        if (count) {
+            dprintf(fd, "  %-22s %llu\n", statusName(
+                        static_cast<GatekeeperStatusCode>(STATUS_MIN + i)),
+                    (unsigned long long)count);
+        }
+    }
+
+    dprintf(fd, "TEEC errors:\n");
+    for (uint32_t i = 0; i < TEEC_ERROR_SLOTS; i++) {
+        uint64_t key = teecErrors_[i].key.load(std::memory_order_acquire);
+        if (key) {
+            dprintf(fd, "  code 0x%08x origin 0x%x: %llu\n",
+                    (uint32_t)(key >> 32), (uint32_t)key,
+                    (unsigned long long)teecErrors_[i].count.load(
+                        std::memory_order_relaxed));
+        }
+    }
+    uint64_t dropped = teecErrorsDropped_.load(std::memory_order_relaxed);
+    if (dropped) {
+        dprintf(fd, "  other: %llu\n", (unsigned long long)dropped);
+    }
+
+    dprintf(fd, "Lockouts answered by HAL: %llu\n",
+            (unsigned long long)lockoutHits_.load(
+                std::memory_order_relaxed));
+}
+
+void GatekeeperMetrics::recordStage(gatekeeper_command_t command,
+        uint32_t stage, uint64_t us)
+{
+    if (command < COMMANDS && stage < STAGE_COUNT) {
+        latency_[command][stage].record(us);
+    }
+}
+
+void GatekeeperMetrics::recordStatus(GatekeeperStatusCode code)
+{
+    int32_t value = static_cast<int32_t>(code);
+    if (value >= STATUS_MIN && value <= STATUS_MAX) {
+        status_[value - STATUS_MIN].fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+}  // namespace renesas
+}  // namespace V1_0
+}  // namespace gatekeeper
+}  // namespace hardware
+}  // namespace android
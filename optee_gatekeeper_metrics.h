@@ -0,0 +1,144 @@
+/*
+ *
+ * Copyright (C) 2017 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef OPTEE_GATEKEEPER_METRICS_H
+#define OPTEE_GATEKEEPER_METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+
+#include <android/hardware/gatekeeper/1.0/IGatekeeper.h>
+#include <gatekeeper_ipc.h>
+
+namespace android {
+namespace hardware {
+namespace gatekeeper {
+namespace V1_0 {
+namespace renesas {
+
+/*
+ * Lock-free latency histogram in microseconds. Every power of two is split
+ * into 4 buckets, so reported percentiles are within 25% of real value.
+ */
+class LatencyHistogram {
+public:
+    LatencyHistogram();
+
+    void record(uint64_t us);
+    void reset();
+
+    uint64_t count() const;
+    uint64_t max() const;
+    uint64_t average() const;
+    /*
+     * @return upper bound of the bucket that contains @permille of samples
+     */
+    uint64_t percentile(uint32_t permille) const;
+
+private:
+    static const uint32_t SUB_BUCKET_BITS = 2;
+    static const uint32_t SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const uint32_t BUCKETS = 128;
+
+    static uint32_t bucketOf(uint64_t us);
+    static uint64_t bucketUpperBound(uint32_t bucket);
+
+    std::atomic<uint64_t> buckets_[BUCKETS];
+    std::atomic<uint64_t> count_;
+    std::atomic<uint64_t> sum_;
+    std::atomic<uint64_t> max_;
+};
+
+/*
+ * HAL side statistics of TA calls, dumped with lshal debug
+ */
+class GatekeeperMetrics {
+public:
+    enum Stage {
+        STAGE_QUEUE,        // waiting for connection and free session
+        STAGE_SERIALIZE,    // request serialization
+        STAGE_INVOKE,       // TEEC_InvokeCommand
+        STAGE_DESERIALIZE,  // response parsing and HIDL callback
+        STAGE_TOTAL,
+        STAGE_COUNT,
+    };
+
+    /*
+     * Measures one HAL call. Every mark() closes current stage, destructor
+     * closes the last reached stage and the total.
+     */
+    class CallTrace {
+    public:
+        CallTrace(GatekeeperMetrics& metrics, gatekeeper_command_t command);
+        ~CallTrace();
+
+        void mark();
+        void setStatus(GatekeeperStatusCode code);
+
+    private:
+        typedef std::chrono::steady_clock Clock;
+
+        GatekeeperMetrics& metrics_;
+        const gatekeeper_command_t command_;
+        const Clock::time_point start_;
+        Clock::time_point last_;
+        uint32_t stage_;
+        bool hasStatus_;
+        GatekeeperStatusCode status_;
+    };
+
+    GatekeeperMetrics();
+
+    void recordTeecError(uint32_t result, uint32_t origin);
+    // Attempt refused from the HAL lockout cache without a TA call
+    void recordLockoutHit();
+    void reset();
+    void dump(int fd) const;
+
+private:
+    static const uint32_t COMMANDS = GK_GET_STATS + 1;
+    static const int32_t STATUS_MIN =
+        static_cast<int32_t>(GatekeeperStatusCode::ERROR_NOT_IMPLEMENTED);
+    static const int32_t STATUS_MAX =
+        static_cast<int32_t>(GatekeeperStatusCode::STATUS_REENROLL);
+    static const uint32_t STATUSES = STATUS_MAX - STATUS_MIN + 1;
+    static const uint32_t TEEC_ERROR_SLOTS = 32;
+
+    struct TeecErrorSlot {
+        std::atomic<uint64_t> key;      // result << 32 | origin, 0 if free
+        std::atomic<uint64_t> count;
+    };
+
+    void recordStage(gatekeeper_command_t command, uint32_t stage,
+            uint64_t us);
+    void recordStatus(GatekeeperStatusCode code);
+
+    LatencyHistogram latency_[COMMANDS][STAGE_COUNT];
+    std::atomic<uint64_t> status_[STATUSES];
+    TeecErrorSlot teecErrors_[TEEC_ERROR_SLOTS];
+    std::atomic<uint64_t> teecErrorsDropped_;
+    std::atomic<uint64_t> lockoutHits_;
+};
+
+}  // namespace renesas
+}  // namespace V1_0
+}  // namespace gatekeeper
+}  // namespace hardware
+}  // namespace android
+
+#endif /* OPTEE_GATEKEEPER_METRICS_H */
@@ -15,7 +15,14 @@
  * limitations under the License.
  */
 
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
 #include <cstring>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <sys/mman.h>
 
 #define LOG_TAG "OpteeIPC"
 #include <utils/Log.h>
@@ -28,9 +35,140 @@ namespace gatekeeper {
 namespace V1_0 {
 namespace renesas {
 
+constexpr uint32_t OpteeIPC::RESPONSE_OFFSET;
+constexpr uint32_t OpteeIPC::REQUEST_OFFSET;
+constexpr uint32_t OpteeIPC::ARENA_SIZE;
+
+/*
+ * memset() that compiler is not allowed to drop as dead store
+ */
+static void secureWipe(void *buffer, size_t size)
+{
+    volatile uint8_t *p = static_cast<volatile uint8_t *>(buffer);
+    while (size--) {
+        *p++ = 0;
+    }
+}
+
+/*
+ * Requests cancellation of TA calls that outlive their deadline. One
+ * thread serves every session of the process. It is started by the first
+ * call with a deadline and is woken only by a deadline earlier than the
+ * one it sleeps until, so calls that finish in time do not wake it.
+ */
+class CancelWatchdog {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    /*
+     * Deadline of one call, lives on the stack of the calling thread
+     */
+    struct Watch {
+        TEEC_Operation *op;
+        bool fired;
+        std::multimap<Clock::time_point, Watch *>::iterator entry;
+    };
+
+    static CancelWatchdog& instance()
+    {
+        static CancelWatchdog watchdog;
+        return watchdog;
+    }
+
+    void arm(Watch& watch, TEEC_Operation *op, uint32_t timeout_ms)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!thread_.joinable()) {
+            thread_ = std::thread(&CancelWatchdog::run, this);
+        }
+
+        const Clock::time_point deadline =
+            Clock::now() + std::chrono::milliseconds(timeout_ms);
+        watch.op = op;
+        watch.fired = false;
+        watch.entry = deadlines_.emplace(deadline, &watch);
+        if (deadline < wakeAt_) {
+            cv_.notify_one();
+        }
+    }
+
+    /*
+     * After return the watchdog does not touch the operation any more
+     *
+     * @return true if cancellation of the call was requested
+     */
+    bool disarm(Watch& watch)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        deadlines_.erase(watch.entry);
+        return watch.fired;
+    }
+
+private:
+    // Cancellation is requested again this often until the call returns
+    static const uint32_t CANCEL_RETRY_MS = 20;
+
+    CancelWatchdog() : wakeAt_(Clock::time_point::max()), stopping_(false)
+    {
+    }
+
+    ~CancelWatchdog()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        cv_.notify_one();
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!stopping_) {
+            if (deadlines_.empty()) {
+                wakeAt_ = Clock::time_point::max();
+                cv_.wait(lock);
+                continue;
+            }
+
+            // Deadline of a finished call is left to pass in sleep
+            auto first = deadlines_.begin();
+            if (Clock::now() < first->first) {
+                wakeAt_ = first->first;
+                cv_.wait_until(lock, wakeAt_);
+                continue;
+            }
+
+            // Operation stays valid until its caller disarms, which
+            // waits for this lock. A request made before libteec has
+            // set up the operation, or while the call waits for the
+            // TA, can go nowhere, so it is repeated until disarm.
+            Watch *watch = first->second;
+            deadlines_.erase(first);
+            watch->fired = true;
+            TEEC_RequestCancellation(watch->op);
+            watch->entry = deadlines_.emplace(Clock::now() +
+                    std::chrono::milliseconds(CANCEL_RETRY_MS), watch);
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::multimap<Clock::time_point, Watch *> deadlines_;
+    // Time the thread sleeps until, max if it waits for a call
+    Clock::time_point wakeAt_;
+    std::thread thread_;
+    bool stopping_;
+};
+
 OpteeIPC::OpteeIPC()
-    : inUse(false)
+    : requestUsed(0), responseUsed(0),
+      lastRes(TEEC_SUCCESS), lastErrOrigin(0), inUse(false)
 {
+    memset(&arena, 0, sizeof(arena));
 }
 
 OpteeIPC::~OpteeIPC()
@@ -67,12 +205,18 @@ bool OpteeIPC::connect(const TEEC_UUID& uuid)
 
     inUse = true;
 
+    if (!allocateArena(ARENA_SIZE)) {
+        disconnect();
+        return false;
+    }
+
     return true;
 }
 
 void OpteeIPC::disconnect()
 {
     if (inUse) {
+        releaseArena();
         TEEC_CloseSession(&sess);
         TEEC_FinalizeContext(&ctx);
     }
@@ -80,32 +224,149 @@ void OpteeIPC::disconnect()
     inUse = false;
 }
 
-bool OpteeIPC::call(uint32_t cmd,
-        const uint8_t *in,  uint32_t  in_size,
-              uint8_t *out, uint32_t& out_size)
+uint8_t *OpteeIPC::requestBuffer(uint32_t size)
 {
+    if (!inUse) {
+        ALOGE("Is not connected");
+        return nullptr;
+    }
+
+    if (arena.buffer == nullptr || size > arena.size - REQUEST_OFFSET) {
+        // Arena is too small for this payload, grow it for the rest
+        // of session
+        if (size > UINT32_MAX - REQUEST_OFFSET) {
+            return nullptr;
+        }
+        releaseArena();
+        if (!allocateArena(REQUEST_OFFSET + size)) {
+            return nullptr;
+        }
+    }
+
+    requestUsed = size;
+
+    return static_cast<uint8_t *>(arena.buffer) + REQUEST_OFFSET;
+}
+
+void OpteeIPC::scrub()
+{
+    if (arena.buffer == nullptr) {
+        return;
+    }
+
+    uint8_t *buffer = static_cast<uint8_t *>(arena.buffer);
+    secureWipe(buffer + REQUEST_OFFSET, requestUsed);
+    secureWipe(buffer + RESPONSE_OFFSET, responseUsed);
+    requestUsed = 0;
+    responseUsed = 0;
+}
+
+bool OpteeIPC::allocateArena(uint32_t size)
+{
+    memset(&arena, 0, sizeof(arena));
+    arena.flags = TEEC_MEM_INPUT | TEEC_MEM_OUTPUT;
+    arena.size = size;
+
+    TEEC_Result res = TEEC_AllocateSharedMemory(&ctx, &arena);
+    if (res != TEEC_SUCCESS) {
+        ALOGE("TEEC_AllocateSharedMemory of %u bytes failed with code 0x%x",
+                size, res);
+        memset(&arena, 0, sizeof(arena));
+        return false;
+    }
+
+    // Fault every page in now instead of on the unlock path and keep
+    // them out of swap
+    memset(arena.buffer, 0, arena.size);
+    if (mlock(arena.buffer, arena.size) != 0) {
+        ALOGW("Cannot lock scratch arena in memory: %s", strerror(errno));
+    }
+
+    return true;
+}
+
+void OpteeIPC::releaseArena()
+{
+    if (arena.buffer != nullptr) {
+        secureWipe(arena.buffer, arena.size);
+        munlock(arena.buffer, arena.size);
+        TEEC_ReleaseSharedMemory(&arena);
+    }
+    memset(&arena, 0, sizeof(arena));
+    requestUsed = 0;
+    responseUsed = 0;
+}
+
+const uint8_t *OpteeIPC::call(uint32_t cmd, uint32_t in_size,
+        uint32_t& out_size, uint32_t timeout_ms)
+{
+    if (!inUse) {
+        ALOGE("Is not connected");
+        lastRes = TEEC_ERROR_BAD_STATE;
+        lastErrOrigin = TEEC_ORIGIN_API;
+        return nullptr;
+    }
+
+    if (arena.buffer == nullptr || in_size > arena.size - REQUEST_OFFSET ||
+            out_size > REQUEST_OFFSET - RESPONSE_OFFSET) {
+        ALOGE("Payload does not fit shared memory, in %u out %u",
+                in_size, out_size);
+        lastRes = TEEC_ERROR_SHORT_BUFFER;
+        lastErrOrigin = TEEC_ORIGIN_API;
+        return nullptr;
+    }
+
     TEEC_Operation op;
     memset(&op, 0, sizeof(op));
 
-    op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
-                                     TEEC_MEMREF_TEMP_OUTPUT,
+    op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_PARTIAL_INPUT,
+                                     TEEC_MEMREF_PARTIAL_OUTPUT,
                                      TEEC_NONE, TEEC_NONE);
 
-    op.params[0].tmpref.buffer = (void*)in;
-    op.params[0].tmpref.size = in_size;
+    op.params[0].memref.parent = &arena;
+    op.params[0].memref.offset = REQUEST_OFFSET;
+    op.params[0].memref.size = in_size;
 
-    op.params[1].tmpref.buffer = out;
-    op.params[1].tmpref.size = out_size;
+    op.params[1].memref.parent = &arena;
+    op.params[1].memref.offset = RESPONSE_OFFSET;
+    op.params[1].memref.size = out_size;
 
-    uint32_t err_origin;
+    responseUsed = out_size;
+
+    CancelWatchdog::Watch watch;
+    if (timeout_ms) {
+        CancelWatchdog::instance().arm(watch, &op, timeout_ms);
+    }
+
+    uint32_t err_origin = TEEC_ORIGIN_API;
     TEEC_Result res = TEEC_InvokeCommand(&sess, cmd, &op, &err_origin);
+    const bool cancelled = timeout_ms &&
+        CancelWatchdog::instance().disarm(watch);
     if (res != TEEC_SUCCESS) {
-        ALOGE("TEEC_InvokeCommand cmd %u command failed with "
-                "code 0x%x origin 0x%x", cmd, res, err_origin);
-        return false;
+        // Whatever the TA made of the cancellation, it is a timeout
+        if (cancelled) {
+            ALOGE("TEEC_InvokeCommand cmd %u cancelled after %u ms",
+                    cmd, timeout_ms);
+            res = TEEC_ERROR_CANCEL;
+        } else {
+            ALOGE("TEEC_InvokeCommand cmd %u command failed with "
+                    "code 0x%x origin 0x%x", cmd, res, err_origin);
+        }
+        lastRes = res;
+        lastErrOrigin = err_origin;
+        return nullptr;
     }
 
-    return true;
+    if (op.params[1].memref.size > out_size) {
+        ALOGE("TA cmd %u returned %zu bytes into %u bytes response",
+                cmd, op.params[1].memref.size, out_size);
+        lastRes = TEEC_ERROR_SHORT_BUFFER;
+        lastErrOrigin = TEEC_ORIGIN_TRUSTED_APP;
+        return nullptr;
+    }
+    out_size = op.params[1].memref.size;
+
+    return static_cast<uint8_t *>(arena.buffer) + RESPONSE_OFFSET;
 }
 
 }  // namespace renesas
@@ -18,29 +18,82 @@
 #ifndef OPTEE_IPC_H
 #define OPTEE_IPC_H
 
-extern "C" {
-#include <tee_client_api.h>
-}
+#include "optee_transport.h"
+
 namespace android {
 namespace hardware {
 namespace gatekeeper {
 namespace V1_0 {
 namespace renesas {
 
-class OpteeIPC {
+/*
+ * Transport to the TA running in OP-TEE
+ */
+class OpteeIPC : public TeeTransport {
 public:
     OpteeIPC();
     ~OpteeIPC();
 
-    bool connect(const TEEC_UUID& uuid);
-    void disconnect();
-    bool call(uint32_t cmd,
-            const uint8_t *in,  uint32_t  in_size,
-                  uint8_t *out, uint32_t& out_size);
+    bool connect(const TEEC_UUID& uuid) override;
+    void disconnect() override;
+
+    /*
+     * All payloads of the session live in one scratch arena of shared
+     * memory. It is allocated, pre-faulted and locked in RAM at connect and
+     * reused for every call: request is serialized and response is read in
+     * place, so libteec does not bounce or copy the payload and password
+     * bytes never reach swap.
+     *
+     * @size minimal number of bytes the caller is going to use
+     * @return pointer to the request area or nullptr on failure
+     */
+    uint8_t *requestBuffer(uint32_t size) override;
+
+    /*
+     * Largest request that fits the arena without growing it
+     */
+    static constexpr uint32_t requestCapacity()
+    {
+        return ARENA_SIZE - REQUEST_OFFSET;
+    }
+
+    /*
+     * Response area is passed to the TA as a part of the arena. A call
+     * with @timeout_ms is cancelled by a watchdog thread with
+     * TEEC_RequestCancellation(), which the TA honours in the password
+     * KDF. Elsewhere the call runs to the end.
+     */
+    const uint8_t *call(uint32_t cmd, uint32_t in_size,
+            uint32_t& out_size, uint32_t timeout_ms) override;
+
+    /*
+     * Wipes request and response bytes of the last call
+     */
+    void scrub() override;
+
+    TEEC_Result lastResult() const override { return lastRes; }
+    uint32_t lastOrigin() const override { return lastErrOrigin; }
 
 private:
+    /*
+     * Arena layout: response area at the start, request area after it
+     * aligned to cache line
+     */
+    static constexpr uint32_t RESPONSE_OFFSET = 0;
+    static constexpr uint32_t REQUEST_OFFSET =
+        (MAX_RESPONSE_SIZE + 63) & ~63u;
+    static constexpr uint32_t ARENA_SIZE = RECV_BUF_SIZE;
+
+    bool allocateArena(uint32_t size);
+    void releaseArena();
+
     TEEC_Context ctx;
     TEEC_Session sess;
+    TEEC_SharedMemory arena;
+    uint32_t requestUsed;
+    uint32_t responseUsed;
+    TEEC_Result lastRes;
+    uint32_t lastErrOrigin;
     bool inUse;
 };
 }  // namespace renesas
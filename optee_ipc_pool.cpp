@@ -0,0 +1,226 @@
+/*
+ *
+ * Copyright (C) 2017 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "OpteeIPCPool"
+#include <utils/Log.h>
+
+#include "optee_ipc_pool.h"
+
+namespace android {
+namespace hardware {
+namespace gatekeeper {
+namespace V1_0 {
+namespace renesas {
+
+OpteeIPCPool::Lease::Lease()
+    : pool_(nullptr), ipc_(nullptr), stripes_(0)
+{
+}
+
+OpteeIPCPool::Lease::Lease(OpteeIPCPool *pool, TeeTransport *ipc,
+        uint32_t stripes)
+    : pool_(pool), ipc_(ipc), stripes_(stripes)
+{
+}
+
+OpteeIPCPool::Lease::Lease(Lease&& other)
+    : pool_(other.pool_), ipc_(other.ipc_), stripes_(other.stripes_)
+{
+    other.pool_ = nullptr;
+    other.ipc_ = nullptr;
+}
+
+OpteeIPCPool::Lease& OpteeIPCPool::Lease::operator=(Lease&& other)
+{
+    if (this != &other) {
+        if (pool_) {
+            pool_->release(ipc_, stripes_);
+        }
+        pool_ = other.pool_;
+        ipc_ = other.ipc_;
+        stripes_ = other.stripes_;
+        other.pool_ = nullptr;
+        other.ipc_ = nullptr;
+    }
+    return *this;
+}
+
+OpteeIPCPool::Lease::~Lease()
+{
+    if (pool_) {
+        pool_->release(ipc_, stripes_);
+    }
+}
+
+OpteeIPCPool::OpteeIPCPool()
+{
+}
+
+OpteeIPCPool::~OpteeIPCPool()
+{
+    disconnect();
+}
+
+bool OpteeIPCPool::connect(const TEEC_UUID& uuid, uint32_t size,
+        const TransportFactory& factory,
+        const std::function<void(TeeTransport&)>& prepare)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (!sessions_.empty()) {
+        ALOGE("Is already connected");
+        return false;
+    }
+
+    for (uint32_t i = 0; i < size; i++) {
+        std::unique_ptr<TeeTransport> ipc = factory();
+        if (!ipc || !ipc->connect(uuid)) {
+            ALOGE("Cannot open session %u of %u", i + 1, size);
+            break;
+        }
+        if (prepare) {
+            prepare(*ipc);
+            ipc->scrub();
+        }
+        free_.push_back(ipc.get());
+        sessions_.push_back(std::move(ipc));
+    }
+
+    if (sessions_.empty()) {
+        return false;
+    }
+
+    ALOGV("Opened %zu sessions", sessions_.size());
+    cv_.notify_all();
+
+    return true;
+}
+
+void OpteeIPCPool::disconnect()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    cv_.wait(lock, [this] { return free_.size() == sessions_.size(); });
+
+    for (auto& ipc : sessions_) {
+        ipc->disconnect();
+    }
+    sessions_.clear();
+    free_.clear();
+    cv_.notify_all();
+}
+
+OpteeIPCPool::Lease OpteeIPCPool::acquire(uint32_t uid)
+{
+    return acquireStripes(1u << (uid % UID_STRIPES));
+}
+
+OpteeIPCPool::Lease OpteeIPCPool::acquire(const uint32_t *uids,
+        uint32_t count)
+{
+    uint32_t stripes = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        stripes |= 1u << (uids[i] % UID_STRIPES);
+    }
+
+    return acquireStripes(stripes);
+}
+
+OpteeIPCPool::Lease OpteeIPCPool::acquireAll()
+{
+    return acquireStripes((1u << UID_STRIPES) - 1);
+}
+
+OpteeIPCPool::Lease OpteeIPCPool::acquireAny()
+{
+    return acquireStripes(0);
+}
+
+OpteeIPCPool::Lease OpteeIPCPool::acquireStripes(uint32_t stripes)
+{
+    for (uint32_t i = 0; i < UID_STRIPES; i++) {
+        if (!(stripes & (1u << i))) {
+            continue;
+        }
+
+        Stripe& s = stripes_[i];
+        std::unique_lock<std::mutex> lock(s.mutex);
+        const uint64_t ticket = s.next_ticket++;
+        s.cv.wait(lock, [&s, ticket] { return s.serving == ticket; });
+    }
+
+    TeeTransport *ipc = nullptr;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] {
+            return !free_.empty() || sessions_.empty();
+        });
+        if (!free_.empty()) {
+            ipc = free_.back();
+            free_.pop_back();
+        }
+    }
+
+    if (!ipc) {
+        finishTurn(stripes);
+        return Lease();
+    }
+
+    return Lease(this, ipc, stripes);
+}
+
+uint32_t OpteeIPCPool::size() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return sessions_.size();
+}
+
+void OpteeIPCPool::release(TeeTransport *ipc, uint32_t stripes)
+{
+    ipc->scrub();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        free_.push_back(ipc);
+    }
+    cv_.notify_all();
+
+    finishTurn(stripes);
+}
+
+void OpteeIPCPool::finishTurn(uint32_t stripes)
+{
+    for (uint32_t i = 0; i < UID_STRIPES; i++) {
+        if (!(stripes & (1u << i))) {
+            continue;
+        }
+
+        Stripe& s = stripes_[i];
+        {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            s.serving++;
+        }
+        s.cv.notify_all();
+    }
+}
+
+}  // namespace renesas
+}  // namespace V1_0
+}  // namespace gatekeeper
+}  // namespace hardware
+}  // namespace android
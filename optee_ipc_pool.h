@@ -0,0 +1,136 @@
+/*
+ *
+ * Copyright (C) 2017 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef OPTEE_IPC_POOL_H
+#define OPTEE_IPC_POOL_H
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "optee_transport.h"
+
+namespace android {
+namespace hardware {
+namespace gatekeeper {
+namespace V1_0 {
+namespace renesas {
+
+/*
+ * Set of sessions to the same TA. Every call leases a free session for its
+ * duration, so calls of different users run in parallel. Calls of the same
+ * uid are handed out strictly in arrival order. Each session owns its own
+ * scratch arena, which is wiped when the lease is returned.
+ */
+class OpteeIPCPool {
+public:
+    class Lease {
+    public:
+        Lease();
+        Lease(Lease&& other);
+        Lease& operator=(Lease&& other);
+        ~Lease();
+
+        explicit operator bool() const { return ipc_ != nullptr; }
+        TeeTransport *operator->() const { return ipc_; }
+        TeeTransport& operator*() const { return *ipc_; }
+
+    private:
+        friend class OpteeIPCPool;
+
+        Lease(OpteeIPCPool *pool, TeeTransport *ipc, uint32_t stripes);
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+
+        OpteeIPCPool *pool_;
+        TeeTransport *ipc_;
+        /* Bit per held stripe */
+        uint32_t stripes_;
+    };
+
+    OpteeIPCPool();
+    ~OpteeIPCPool();
+
+    /*
+     * Opens up to @size sessions created by @factory. Succeeds if at least
+     * one session is open. Optional @prepare is run on every session
+     * before it is handed out.
+     */
+    bool connect(const TEEC_UUID& uuid, uint32_t size,
+            const TransportFactory& factory,
+            const std::function<void(TeeTransport&)>& prepare = nullptr);
+    /*
+     * Waits for all leases to be returned and closes sessions
+     */
+    void disconnect();
+
+    /*
+     * Blocks until all earlier calls of @uid are finished and a session
+     * is free. Returns empty lease if pool is not connected.
+     */
+    Lease acquire(uint32_t uid);
+    /*
+     * Same as above for all @count @uids at once. Stripes are taken in
+     * ascending order, so leases of overlapping uid sets cannot deadlock.
+     */
+    Lease acquire(const uint32_t *uids, uint32_t count);
+    /*
+     * Same as above for every uid, for calls that touch all users.
+     */
+    Lease acquireAll();
+    /*
+     * Blocks only until a session is free, without waiting for any uid.
+     * For calls that do not touch per-user state.
+     */
+    Lease acquireAny();
+
+    uint32_t size() const;
+
+private:
+    static const uint32_t UID_STRIPES = 16;
+
+    /*
+     * FIFO ticket lock shared by all uids with the same hash
+     */
+    struct Stripe {
+        std::mutex mutex;
+        std::condition_variable cv;
+        uint64_t next_ticket = 0;
+        uint64_t serving = 0;
+    };
+
+    Lease acquireStripes(uint32_t stripes);
+    void release(TeeTransport *ipc, uint32_t stripes);
+    void finishTurn(uint32_t stripes);
+
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::vector<std::unique_ptr<TeeTransport>> sessions_;
+    std::vector<TeeTransport *> free_;
+
+    Stripe stripes_[UID_STRIPES];
+};
+
+}  // namespace renesas
+}  // namespace V1_0
+}  // namespace gatekeeper
+}  // namespace hardware
+}  // namespace android
+
+#endif /* OPTEE_IPC_POOL_H */
@@ -0,0 +1,411 @@
+/*
+ *
+ * Copyright (C) 2017 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdio.h>
+#include <thread>
+#include <unistd.h>
+
+#define LOG_TAG "OpteeTraceTransport"
+#include <utils/Log.h>
+
+#include "optee_trace_transport.h"
+
+namespace android {
+namespace hardware {
+namespace gatekeeper {
+namespace V1_0 {
+namespace renesas {
+
+std::shared_ptr<TraceWriter> TraceWriter::open(const char *path)
+{
+    int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+            0600);
+    if (fd < 0) {
+        ALOGE("Cannot create trace %s: %s", path, strerror(errno));
+        return nullptr;
+    }
+
+    TraceHeader header;
+    header.magic = TRACE_MAGIC;
+    header.version = TRACE_VERSION;
+    if (::write(fd, &header, sizeof(header)) != sizeof(header)) {
+        ALOGE("Cannot write trace %s: %s", path, strerror(errno));
+        close(fd);
+        return nullptr;
+    }
+
+    TraceWriter *writer = new (std::nothrow) TraceWriter(fd);
+    if (!writer) {
+        ALOGE("Cannot allocate trace writer");
+        close(fd);
+        return nullptr;
+    }
+    return std::shared_ptr<TraceWriter>(writer);
+}
+
+TraceWriter::TraceWriter(int fd)
+    : fd_(fd), start_(std::chrono::steady_clock::now())
+{
+}
+
+TraceWriter::~TraceWriter()
+{
+    close(fd_);
+}
+
+uint64_t TraceWriter::nowUs() const
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start_).count();
+}
+
+void TraceWriter::write(const TraceRecord& record)
+{
+    // O_APPEND keeps records of parallel sessions whole
+    if (::write(fd_, &record, sizeof(record)) != sizeof(record)) {
+        ALOGW("Cannot write trace record: %s", strerror(errno));
+    }
+}
+
+RecordingTransport::RecordingTransport(std::unique_ptr<TeeTransport> inner,
+        std::shared_ptr<TraceWriter> writer)
+    : inner_(std::move(inner)), writer_(writer), request_(nullptr)
+{
+}
+
+bool RecordingTransport::connect(const TEEC_UUID& uuid)
+{
+    return inner_->connect(uuid);
+}
+
+void RecordingTransport::disconnect()
+{
+    inner_->disconnect();
+}
+
+uint8_t *RecordingTransport::requestBuffer(uint32_t size)
+{
+    request_ = inner_->requestBuffer(size);
+    return request_;
+}
+
+/*
+ * Entries of a verify batch are recorded one by one with an even share of
+ * the call, replay may batch them differently
+ */
+const uint8_t *RecordingTransport::call(uint32_t cmd, uint32_t in_size,
+        uint32_t& out_size, uint32_t timeout_ms)
+{
+    gk_verify_batch_request_t header;
+
+    header.count = 1;
+    if (cmd == GK_VERIFY_BATCH && (!request_ ||
+                !gk_verify_batch_request_decode(&header, request_, in_size) ||
+                header.count == 0)) {
+        header.count = 1;
+    }
+
+    const uint64_t start_us = writer_->nowUs();
+    const uint8_t *response = inner_->call(cmd, in_size, out_size,
+            timeout_ms);
+    const uint32_t duration_us = writer_->nowUs() - start_us;
+
+    const uint8_t *data = response;
+    uint32_t left = response ? out_size : 0;
+    for (uint32_t i = 0; i < header.count; i++) {
+        TraceRecord record;
+
+        record.start_us = start_us;
+        record.duration_us = duration_us / header.count;
+        record.command = cmd;
+        record.request_size = in_size / header.count;
+        record.response_size = left / (header.count - i);
+        record.result = response ? TEEC_SUCCESS : inner_->lastResult();
+        record.origin = response ? TEEC_ORIGIN_TRUSTED_APP :
+            inner_->lastOrigin();
+        record.error = TRACE_NO_ERROR;
+        record.retry_timeout = 0;
+
+        // Only the leading error code and retry timeout of the response
+        if (cmd == GK_VERIFY_BATCH) {
+            gk_verify_response_t msg;
+
+            if (data && gk_verify_response_decode(&msg, data, left)) {
+                const uint32_t size = gk_verify_response_size(&msg);
+
+                record.error = msg.error;
+                record.retry_timeout = msg.retry_timeout;
+                record.response_size = size;
+                data += size;
+                left -= size;
+            }
+        } else if (data && left >= GK_WIRE_SIZE_INT) {
+            const uint8_t *iter = data;
+            uint32_t value;
+
+            deserialize_int(&iter, &value);
+            record.error = value;
+            if (value == ERROR_RETRY && left >= 2 * GK_WIRE_SIZE_INT) {
+                deserialize_int(&iter, &value);
+                record.retry_timeout = value;
+            }
+        }
+
+        writer_->write(record);
+    }
+
+    return response;
+}
+
+void RecordingTransport::scrub()
+{
+    inner_->scrub();
+}
+
+TEEC_Result RecordingTransport::lastResult() const
+{
+    return inner_->lastResult();
+}
+
+uint32_t RecordingTransport::lastOrigin() const
+{
+    return inner_->lastOrigin();
+}
+
+std::shared_ptr<TraceReader> TraceReader::open(const char *path)
+{
+    FILE *file = fopen(path, "rbe");
+    if (file == nullptr) {
+        ALOGE("Cannot open trace %s: %s", path, strerror(errno));
+        return nullptr;
+    }
+
+    std::shared_ptr<TraceReader> reader(new (std::nothrow) TraceReader);
+    TraceHeader header;
+    TraceRecord record;
+
+    if (!reader || fread(&header, sizeof(header), 1, file) != 1 ||
+            header.magic != TRACE_MAGIC || header.version != TRACE_VERSION) {
+        ALOGE("%s is not a gatekeeper trace", path);
+        fclose(file);
+        return nullptr;
+    }
+
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        reader->records_.push_back(record);
+    }
+    fclose(file);
+
+    return reader;
+}
+
+static bool sameCommand(uint32_t a, uint32_t b)
+{
+    const auto verify = [](uint32_t cmd) {
+        return cmd == GK_VERIFY || cmd == GK_VERIFY_BATCH;
+    };
+
+    return a == b || (verify(a) && verify(b));
+}
+
+bool TraceReader::next(uint32_t command, TraceRecord *records,
+        uint32_t count)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint32_t found = 0;
+
+    for (size_t i = 0; found < count; i++) {
+        // A whole lap without a match means there is none
+        if (i == records_.size() && found == 0) {
+            return false;
+        }
+
+        size_t index = (cursor_ + i) % records_.size();
+        if (sameCommand(records_[index].command, command)) {
+            records[found++] = records_[index];
+            cursor_ = index + 1;
+        }
+    }
+
+    return true;
+}
+
+ReplayTransport::ReplayTransport(std::shared_ptr<TraceReader> reader)
+    : reader_(reader), response_(MAX_RESPONSE_SIZE),
+      lastRes_(TEEC_SUCCESS), lastOrigin_(0)
+{
+}
+
+bool ReplayTransport::connect(const TEEC_UUID& uuid)
+{
+    (void)uuid;
+    return true;
+}
+
+void ReplayTransport::disconnect()
+{
+    scrub();
+}
+
+uint8_t *ReplayTransport::requestBuffer(uint32_t size)
+{
+    if (request_.size() < size) {
+        request_.resize(size);
+    }
+    return request_.data();
+}
+
+/*
+ * Recorded outcome is replayed as is, a call that was cancelled in the
+ * trace fails here too whatever @timeout_ms is
+ */
+const uint8_t *ReplayTransport::call(uint32_t cmd, uint32_t in_size,
+        uint32_t& out_size, uint32_t timeout_ms)
+{
+    (void)timeout_ms;
+
+    TraceRecord records[GK_VERIFY_BATCH_MAX];
+    gk_verify_batch_request_t header;
+
+    header.count = 1;
+    if (in_size > request_.size() || out_size > response_.size() ||
+            (cmd == GK_VERIFY_BATCH &&
+             (!gk_verify_batch_request_decode(&header, request_.data(),
+                                              in_size) ||
+              header.count == 0 || header.count > GK_VERIFY_BATCH_MAX)) ||
+            !reader_->next(cmd, records, header.count)) {
+        lastRes_ = TEEC_ERROR_BAD_PARAMETERS;
+        lastOrigin_ = TEEC_ORIGIN_API;
+        return nullptr;
+    }
+
+    // A batch takes as long as its entries did and fails as the first
+    // failed one
+    uint64_t duration_us = 0;
+    const TraceRecord *failed = nullptr;
+    for (uint32_t i = 0; i < header.count; i++) {
+        duration_us += records[i].duration_us;
+        if (!failed && records[i].result != TEEC_SUCCESS) {
+            failed = &records[i];
+        }
+    }
+
+    std::this_thread::sleep_for(std::chrono::microseconds(duration_us));
+
+    if (failed) {
+        lastRes_ = failed->result;
+        lastOrigin_ = failed->origin;
+        return nullptr;
+    }
+
+    uint8_t *end = synthesize(cmd, records, header.count, out_size);
+    if (!end) {
+        lastRes_ = TEEC_ERROR_SHORT_BUFFER;
+        lastOrigin_ = TEEC_ORIGIN_TRUSTED_APP;
+        return nullptr;
+    }
+
+    out_size = get_size(response_.data(), end);
+    return response_.data();
+}
+
+static uint32_t recordedError(const TraceRecord& record)
+{
+    return record.error == TRACE_NO_ERROR ?
+        static_cast<uint32_t>(ERROR_UNKNOWN) : record.error;
+}
+
+uint8_t *ReplayTransport::synthesize(uint32_t cmd, const TraceRecord *records,
+        uint32_t count, uint32_t out_size)
+{
+    static const uint8_t zeros[GK_MAX(GK_PASSWORD_HANDLE_SIZE,
+            GK_AUTH_TOKEN_SIZE)] = {0};
+    const TraceRecord& record = records[0];
+    const uint32_t error = recordedError(record);
+    uint8_t *buffer = response_.data();
+
+    switch (cmd) {
+    case GK_ENROLL: {
+        gk_enroll_response_t msg;
+        msg.error = error;
+        msg.retry_timeout = record.retry_timeout;
+        msg.password_handle.data = zeros;
+        msg.password_handle.length = GK_PASSWORD_HANDLE_SIZE;
+        return gk_enroll_response_encode(buffer, out_size, &msg);
+    }
+    case GK_VERIFY:
+    case GK_VERIFY_BATCH: {
+        gk_verify_response_t msg;
+        uint8_t *iter = buffer;
+
+        msg.auth_token.data = zeros;
+        msg.auth_token.length = GK_AUTH_TOKEN_SIZE;
+        msg.request_reenroll = 0;
+        for (uint32_t i = 0; i < count && iter; i++) {
+            msg.error = recordedError(records[i]);
+            msg.retry_timeout = records[i].retry_timeout;
+            iter = gk_verify_response_encode(iter,
+                    out_size - get_size(buffer, iter), &msg);
+        }
+        return iter;
+    }
+    case GK_WARMUP: {
+        gk_warmup_response_t msg;
+        msg.error = error;
+        msg.retry_timeout = record.retry_timeout;
+        msg.kdf_iterations = 0;
+        msg.kdf_cost_us = 0;
+        return gk_warmup_response_encode(buffer, out_size, &msg);
+    }
+    case GK_DELETE_USER: {
+        gk_delete_user_response_t msg;
+        msg.error = error;
+        msg.retry_timeout = record.retry_timeout;
+        return gk_delete_user_response_encode(buffer, out_size, &msg);
+    }
+    case GK_DELETE_ALL_USERS: {
+        gk_delete_all_users_response_t msg;
+        msg.error = error;
+        msg.retry_timeout = record.retry_timeout;
+        return gk_delete_all_users_response_encode(buffer, out_size, &msg);
+    }
+    case GK_GET_STATS: {
+        gk_get_stats_response_t msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.error = error;
+        msg.retry_timeout = record.retry_timeout;
+        return gk_get_stats_response_encode(buffer, out_size, &msg);
+    }
+    default:
+        return nullptr;
+    }
+}
+
+void ReplayTransport::scrub()
+{
+    std::fill(request_.begin(), request_.end(), 0);
+    std::fill(response_.begin(), response_.end(), 0);
+}
+
+}  // namespace renesas
+}  // namespace V1_0
+}  // namespace gatekeeper
+}  // namespace hardware
+}  // namespace android
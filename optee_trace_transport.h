@@ -0,0 +1,172 @@
+/*
+ *
+ * Copyright (C) 2017 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef OPTEE_TRACE_TRANSPORT_H
+#define OPTEE_TRACE_TRANSPORT_H
+
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+#include "optee_transport.h"
+
+namespace android {
+namespace hardware {
+namespace gatekeeper {
+namespace V1_0 {
+namespace renesas {
+
+/*
+ * Binary trace of TA calls: TraceHeader followed by one TraceRecord per
+ * call, or per entry of a verify batch, little-endian and packed.
+ * Payloads are never written, only the command, sizes, outcome and
+ * timing, so a trace of real unlocks carries no passwords, password
+ * handles or auth tokens.
+ */
+struct __attribute__((packed)) TraceHeader {
+    uint32_t magic;
+    uint32_t version;
+};
+
+struct __attribute__((packed)) TraceRecord {
+    uint64_t start_us;          // since the trace was opened
+    uint32_t duration_us;
+    uint32_t command;
+    uint32_t request_size;
+    uint32_t response_size;
+    uint32_t result;            // TEEC result of the call
+    uint32_t origin;
+    uint32_t error;             // gatekeeper_error_t
+    uint32_t retry_timeout;
+};
+
+static const uint32_t TRACE_MAGIC = 0x52544b47;  // "GKTR"
+static const uint32_t TRACE_VERSION = 1;
+static const uint32_t TRACE_NO_ERROR = UINT32_MAX;
+
+/*
+ * Trace file shared by all sessions
+ */
+class TraceWriter {
+public:
+    /*
+     * @return writer or nullptr if @path cannot be created
+     */
+    static std::shared_ptr<TraceWriter> open(const char *path);
+    ~TraceWriter();
+
+    uint64_t nowUs() const;
+    void write(const TraceRecord& record);
+
+private:
+    TraceWriter(int fd);
+
+    const int fd_;
+    const std::chrono::steady_clock::time_point start_;
+};
+
+/*
+ * Records every call of the wrapped transport
+ */
+class RecordingTransport : public TeeTransport {
+public:
+    RecordingTransport(std::unique_ptr<TeeTransport> inner,
+            std::shared_ptr<TraceWriter> writer);
+
+    bool connect(const TEEC_UUID& uuid) override;
+    void disconnect() override;
+    uint8_t *requestBuffer(uint32_t size) override;
+    const uint8_t *call(uint32_t cmd, uint32_t in_size,
+            uint32_t& out_size, uint32_t timeout_ms) override;
+    void scrub() override;
+    TEEC_Result lastResult() const override;
+    uint32_t lastOrigin() const override;
+
+private:
+    std::unique_ptr<TeeTransport> inner_;
+    std::shared_ptr<TraceWriter> writer_;
+    /* Last request arena, to split batches into entries */
+    uint8_t *request_;
+};
+
+/*
+ * Loaded trace shared by all replaying sessions
+ */
+class TraceReader {
+public:
+    /*
+     * @return reader or nullptr if @path is not a trace
+     */
+    static std::shared_ptr<TraceReader> open(const char *path);
+
+    /*
+     * Takes the next @count records of @command, starting over at the end
+     * of trace. GK_VERIFY and GK_VERIFY_BATCH records are interchangeable,
+     * as whether verifies were batched depends on timing only. Returns
+     * false if the trace has no @command at all.
+     */
+    bool next(uint32_t command, TraceRecord *records, uint32_t count = 1);
+
+    size_t size() const { return records_.size(); }
+
+private:
+    std::mutex mutex_;
+    std::vector<TraceRecord> records_;
+    size_t cursor_ = 0;
+};
+
+/*
+ * Serves calls from a trace instead of the TA: every call takes as long as
+ * the recorded one and fails or answers with the recorded outcome. As
+ * payloads are not recorded, password handles and auth tokens are zeroed.
+ */
+class ReplayTransport : public TeeTransport {
+public:
+    explicit ReplayTransport(std::shared_ptr<TraceReader> reader);
+
+    bool connect(const TEEC_UUID& uuid) override;
+    void disconnect() override;
+    uint8_t *requestBuffer(uint32_t size) override;
+    const uint8_t *call(uint32_t cmd, uint32_t in_size,
+            uint32_t& out_size, uint32_t timeout_ms) override;
+    void scrub() override;
+    TEEC_Result lastResult() const override { return lastRes_; }
+    uint32_t lastOrigin() const override { return lastOrigin_; }
+
+private:
+    /*
+     * Writes response of @cmd with outcomes of @count @records, one per
+     * verify of a batch. Returns its end or nullptr if it does not fit
+     * @out_size.
+     */
+    uint8_t *synthesize(uint32_t cmd, const TraceRecord *records,
+            uint32_t count, uint32_t out_size);
+
+    std::shared_ptr<TraceReader> reader_;
+    std::vector<uint8_t> request_;
+    std::vector<uint8_t> response_;
+    TEEC_Result lastRes_;
+    uint32_t lastOrigin_;
+};
+
+}  // namespace renesas
+}  // namespace V1_0
+}  // namespace gatekeeper
+}  // namespace hardware
+}  // namespace android
+
+#endif /* OPTEE_TRACE_TRANSPORT_H */
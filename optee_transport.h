@@ -0,0 +1,162 @@
+/*
+ *
+ * Copyright (C) 2017 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef OPTEE_TRANSPORT_H
+#define OPTEE_TRANSPORT_H
+
+#include <algorithm>
+#include <array>
+#include <functional>
+#include <memory>
+
+extern "C" {
+#include <tee_client_api.h>
+}
+
+#include <gatekeeper_ipc.h>
+
+namespace android {
+namespace hardware {
+namespace gatekeeper {
+namespace V1_0 {
+namespace renesas {
+
+/*
+ * Compile time description of the TA command response
+ */
+template <gatekeeper_command_t Cmd>
+struct CommandTraits;
+
+template <>
+struct CommandTraits<GK_ENROLL> {
+    static constexpr uint32_t response_size = GK_ENROLL_RESPONSE_SIZE;
+};
+
+template <>
+struct CommandTraits<GK_VERIFY> {
+    static constexpr uint32_t response_size = GK_VERIFY_RESPONSE_SIZE;
+};
+
+template <>
+struct CommandTraits<GK_WARMUP> {
+    static constexpr uint32_t response_size = GK_WARMUP_RESPONSE_SIZE;
+};
+
+template <>
+struct CommandTraits<GK_VERIFY_BATCH> {
+    static constexpr uint32_t response_size = GK_VERIFY_BATCH_RESPONSE_SIZE;
+};
+
+template <>
+struct CommandTraits<GK_DELETE_USER> {
+    static constexpr uint32_t response_size = GK_DELETE_USER_RESPONSE_SIZE;
+};
+
+template <>
+struct CommandTraits<GK_DELETE_ALL_USERS> {
+    static constexpr uint32_t response_size =
+        GK_DELETE_ALL_USERS_RESPONSE_SIZE;
+};
+
+template <>
+struct CommandTraits<GK_GET_STATS> {
+    static constexpr uint32_t response_size = GK_GET_STATS_RESPONSE_SIZE;
+};
+
+template <gatekeeper_command_t Cmd>
+using CommandResponse = std::array<uint8_t, CommandTraits<Cmd>::response_size>;
+
+constexpr uint32_t MAX_RESPONSE_SIZE = std::max({
+    CommandTraits<GK_ENROLL>::response_size,
+    CommandTraits<GK_VERIFY>::response_size,
+    CommandTraits<GK_WARMUP>::response_size,
+    CommandTraits<GK_VERIFY_BATCH>::response_size,
+    CommandTraits<GK_DELETE_USER>::response_size,
+    CommandTraits<GK_DELETE_ALL_USERS>::response_size,
+    CommandTraits<GK_GET_STATS>::response_size,
+});
+
+/*
+ * One session to the TA as seen by the HAL. OpteeIPC talks to OP-TEE,
+ * other implementations record, replay or disturb the calls, so the HAL
+ * can be measured on a Linux host against recorded or degraded TEE.
+ */
+class TeeTransport {
+public:
+    virtual ~TeeTransport() {}
+
+    virtual bool connect(const TEEC_UUID& uuid) = 0;
+    virtual void disconnect() = 0;
+
+    /*
+     * @size minimal number of bytes the caller is going to use
+     * @return pointer to the request area or nullptr on failure
+     */
+    virtual uint8_t *requestBuffer(uint32_t size) = 0;
+
+    /*
+     * Invokes @cmd with first @in_size bytes of request area as input.
+     * On input @out_size is the size of response area given to the TA, on
+     * success it is number of bytes written by the TA. A call still
+     * running after @timeout_ms is cancelled, 0 means no limit.
+     *
+     * @return response area or nullptr on failure, lastResult() is
+     * TEEC_ERROR_CANCEL if the call was cancelled
+     */
+    virtual const uint8_t *call(uint32_t cmd, uint32_t in_size,
+            uint32_t& out_size, uint32_t timeout_ms) = 0;
+
+    /*
+     * Wipes request and response bytes of the last call
+     */
+    virtual void scrub() = 0;
+
+    /*
+     * TEEC result and origin of the last failed call
+     */
+    virtual TEEC_Result lastResult() const = 0;
+    virtual uint32_t lastOrigin() const = 0;
+
+    /*
+     * Invokes @Cmd with response area exactly as big as the largest
+     * response of @Cmd, see call()
+     */
+    template <gatekeeper_command_t Cmd>
+    const CommandResponse<Cmd> *invoke(uint32_t in_size, uint32_t& out_size,
+            uint32_t timeout_ms)
+    {
+        static_assert(sizeof(CommandResponse<Cmd>) <= MAX_RESPONSE_SIZE,
+                "Response area is too small");
+
+        out_size = CommandTraits<Cmd>::response_size;
+        return reinterpret_cast<const CommandResponse<Cmd> *>(
+                call(Cmd, in_size, out_size, timeout_ms));
+    }
+};
+
+/*
+ * Creates a not connected transport for one session
+ */
+typedef std::function<std::unique_ptr<TeeTransport>()> TransportFactory;
+
+}  // namespace renesas
+}  // namespace V1_0
+}  // namespace gatekeeper
+}  // namespace hardware
+}  // namespace android
+
+#endif /* OPTEE_TRANSPORT_H */
@@ -20,22 +20,98 @@
 
 #include <hidl/HidlTransportSupport.h>
 #include <hidl/LegacySupport.h>
+#include <cutils/properties.h>
 #include <utils/Log.h>
 
 #include "optee_gatekeeper_device.h"
+#include "optee_ipc.h"
+#include "optee_trace_transport.h"
 
 using android::hardware::configureRpcThreadpool;
 using android::hardware::joinRpcThreadpool;
 using android::hardware::gatekeeper::V1_0::IGatekeeper;
+using android::hardware::gatekeeper::V1_0::renesas::CallDeadlines;
 using android::hardware::gatekeeper::V1_0::renesas::OpteeGateKeeperDevice;
+using android::hardware::gatekeeper::V1_0::renesas::OpteeIPC;
+using android::hardware::gatekeeper::V1_0::renesas::RecordingTransport;
+using android::hardware::gatekeeper::V1_0::renesas::TeeTransport;
+using android::hardware::gatekeeper::V1_0::renesas::TraceWriter;
+using android::hardware::gatekeeper::V1_0::renesas::TransportFactory;
 using ::android::OK;
 using ::android::sp;
 
-const uint32_t max_threads = 1;
+/*
+ * Number of binder threads, every thread is backed by its own TA session.
+ * TA is single instance, so all sessions share its failure records. TA
+ * runs one command at a time, more threads overlap binder and marshalling
+ * with TA work and let verifies of several users batch.
+ */
+const char *max_threads_property = "ro.vendor.gatekeeper.threads";
+const int32_t max_threads_default = 2;
+const int32_t max_threads_limit = 16;
+
+/*
+ * File to record trace of all TA calls into, see optee_trace_transport.h.
+ * Trace holds no payloads, only commands, outcomes and timings.
+ */
+const char *trace_property = "persist.vendor.gatekeeper.trace";
+
+/*
+ * Enroll and verify calls are cancelled after these times, ms, 0 for no
+ * limit. Defaults are in CallDeadlines.
+ */
+const char *enroll_timeout_property = "ro.vendor.gatekeeper.enroll_timeout_ms";
+const char *verify_timeout_property = "ro.vendor.gatekeeper.verify_timeout_ms";
+
+static void readTimeout(const char *property, uint32_t *timeout_ms)
+{
+    int32_t value = property_get_int32(property, *timeout_ms);
+    if (value < 0) {
+        ALOGW("Ignore %s = %d", property, value);
+        return;
+    }
+    *timeout_ms = value;
+}
+
+static TransportFactory transportFactory()
+{
+    char path[PROPERTY_VALUE_MAX];
+
+    if (property_get(trace_property, path, "") <= 0) {
+        return nullptr;
+    }
+
+    std::shared_ptr<TraceWriter> writer = TraceWriter::open(path);
+    if (!writer) {
+        return nullptr;
+    }
+
+    ALOGI("Recording TA calls to %s", path);
+    return [writer] {
+        std::unique_ptr<TeeTransport> ipc(new (std::nothrow) OpteeIPC);
+        if (!ipc) {
+            return ipc;
+        }
+        return std::unique_ptr<TeeTransport>(new (std::nothrow)
+                RecordingTransport(std::move(ipc), writer));
+    };
+}
 
 int main() {
     ALOGI("Loading...");
-    sp<IGatekeeper> gatekeeper = new (std::nothrow) OpteeGateKeeperDevice;
+    int32_t max_threads = property_get_int32(max_threads_property,
+            max_threads_default);
+    if (max_threads < 1 || max_threads > max_threads_limit) {
+        ALOGW("Ignore %s = %d", max_threads_property, max_threads);
+        max_threads = max_threads_default;
+    }
+
+    CallDeadlines deadlines;
+    readTimeout(enroll_timeout_property, &deadlines.enrollMs);
+    readTimeout(verify_timeout_property, &deadlines.verifyMs);
+
+    sp<IGatekeeper> gatekeeper = new (std::nothrow) OpteeGateKeeperDevice(
+            max_threads, transportFactory(), deadlines);
     if (gatekeeper == nullptr) {
         ALOGE("Could not create gatekeeper instance");
         return 1;
@@ -18,78 +18,516 @@
 #include <string.h>
 #include <tee_internal_api.h>
 #include "failure_record.h"
+#include "gatekeeper_ipc.h"
+#include "ta_stats.h"
 
-#define MAX_FAILURE_RECORDS 32
+/*
+ * Failure records live in an open addressing hash table with linear
+ * probing, keyed by secure user id. Free slots have zero failure_counter,
+ * so a cleared record gives its slot back. Records of one Android uid are
+ * also linked into a list whose head is kept in a second table keyed by
+ * uid, so deleting a user touches only the records of that user.
+ */
+#define FAILURE_RECORD_SLOTS CFG_GATEKEEPER_FAILURE_RECORDS
+#define FAILURE_RECORD_MASK (FAILURE_RECORD_SLOTS - 1)
+
+_Static_assert((FAILURE_RECORD_SLOTS & FAILURE_RECORD_MASK) == 0,
+		"CFG_GATEKEEPER_FAILURE_RECORDS must be a power of 2");
+
+/*
+ * Users changed and uids deleted since the last commit. If more change at
+ * once, the commit writes the whole table instead.
+ */
+#define MAX_PENDING_RECORDS (2 * GK_VERIFY_BATCH_MAX)
+#define MAX_PENDING_DELETES 4
+
+/*
+ * Failure records are kept in RAM and mirrored to an append-only journal
+ * in secure storage, so a HAL restart or TA reload does not reset
+ * throttling. The journal is journal_header_t followed by one
+ * journal_entry_t per changed record, the last entry of a user wins, or
+ * per deleted uid, which drops records of the uid that were not locked out
+ * at its timestamp.
+ */
+#define JOURNAL_MAGIC 0x4a524647	/* "GFRJ" */
+#define JOURNAL_VERSION 3
+#define JOURNAL_VERSION_NO_TYPE 2
+#define JOURNAL_VERSION_NO_UID 1
+
+#define JOURNAL_ENTRY_RECORD 0
+#define JOURNAL_ENTRY_DELETE_UID 1
+
+/*
+ * Journal is rewritten with live records only once it has this many
+ * entries more than there are records
+ */
+#define JOURNAL_COMPACT_ENTRIES 256
+
+/*
+ * Entries read or written at once
+ */
+#define JOURNAL_BUFFER_ENTRIES 32
+
+_Static_assert(MAX_PENDING_RECORDS + MAX_PENDING_DELETES <=
+		JOURNAL_BUFFER_ENTRIES,
+		"Pending records must fit one journal write");
+
+#define JOURNAL_FLAGS (TEE_DATA_FLAG_ACCESS_READ | \
+		TEE_DATA_FLAG_ACCESS_WRITE | TEE_DATA_FLAG_ACCESS_WRITE_META)
+
+typedef struct __packed {
+	uint32_t magic;
+	uint32_t version;
+} journal_header_t;
+
+typedef struct __packed {
+	secure_id_t secure_user_id;
+	uint64_t last_checked_timestamp;
+	uint32_t failure_counter;
+	uint32_t uid;
+	/* JOURNAL_ENTRY_DELETE_UID uses @uid and @last_checked_timestamp */
+	uint32_t type;
+} journal_entry_t;
+
+/*
+ * Entries of JOURNAL_VERSION_NO_TYPE and JOURNAL_VERSION_NO_UID journals,
+ * read once and compacted
+ */
+typedef struct __packed {
+	secure_id_t secure_user_id;
+	uint64_t last_checked_timestamp;
+	uint32_t failure_counter;
+	uint32_t uid;
+} journal_entry_no_type_t;
+
+typedef struct __packed {
+	secure_id_t secure_user_id;
+	uint64_t last_checked_timestamp;
+	uint32_t failure_counter;
+} journal_entry_no_uid_t;
 
 typedef struct {
 	uint32_t size;
-	failure_record_t records[MAX_FAILURE_RECORDS];
+	/* Keys the slot hash, so ids from forged handles cannot pile up */
+	uint64_t seed;
+	/* FAILURE_RECORD_SLOTS slots on the TA heap */
+	failure_record_t *records;
+	/* FAILURE_RECORD_SLOTS uid list heads following records */
+	failure_record_uid_t *uids;
+	/* Journal state of users changed since the last commit */
+	uint32_t pendingSize;
+	bool pendingOverflow;
+	failure_record_t pending[MAX_PENDING_RECORDS];
+	/* Uids deleted since the last commit */
+	uint32_t pendingDeleteSize;
+	journal_entry_t pendingDeletes[MAX_PENDING_DELETES];
 } failure_record_table_t;
 
 static failure_record_table_t failureRecordTable;
 
+static uint8_t journal_ID[] = {0xB1, 0x6B, 0x00, 0xF1};
+static uint8_t journal_tmp_ID[] = {0xB1, 0x6B, 0x00, 0xF2};
 
-void InitFailureRecords(void)
+static TEE_ObjectHandle journal = TEE_HANDLE_NULL;
+static uint32_t journalEntries;
+static bool journalLoaded;
+static journal_entry_t journalBuffer[JOURNAL_BUFFER_ENTRIES];
+
+
+TEE_Result InitFailureRecords(void)
 {
+	failure_record_t *records = failureRecordTable.records;
+
+	if (records == NULL) {
+		records = TEE_Malloc(FAILURE_RECORD_TABLE_SIZE,
+				TEE_MALLOC_FILL_ZERO);
+		if (records == NULL) {
+			EMSG("Failed to allocate failure record table");
+			return TEE_ERROR_OUT_OF_MEMORY;
+		}
+	} else {
+		memset(records, 0, FAILURE_RECORD_TABLE_SIZE);
+	}
+
 	memset(&failureRecordTable, 0, sizeof(failureRecordTable));
+	failureRecordTable.records = records;
+	failureRecordTable.uids =
+		(failure_record_uid_t *)&records[FAILURE_RECORD_SLOTS];
+	// free uid slots have no head
+	memset(failureRecordTable.uids, 0xff,
+			FAILURE_RECORD_SLOTS * sizeof(failure_record_uid_t));
+	TEE_GenerateRandom(&failureRecordTable.seed,
+			sizeof(failureRecordTable.seed));
+
+	return TEE_SUCCESS;
 }
 
 
-void GetFailureRecord(secure_id_t user_id, failure_record_t *record)
+static uint32_t HashFailureKey(uint64_t key)
+{
+	uint64_t hash = key ^ failureRecordTable.seed;
+
+	// murmur3 finalizer
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+
+	return (uint32_t)hash & FAILURE_RECORD_MASK;
+}
+
+
+/*
+ * Returns slot of @user_id or the free slot its record would take
+ */
+static uint32_t FindFailureRecord(secure_id_t user_id)
+{
+	const failure_record_t *records = failureRecordTable.records;
+	uint32_t i = HashFailureKey(user_id);
+
+	while (records[i].failure_counter &&
+			records[i].secure_user_id != user_id) {
+		i = (i + 1) & FAILURE_RECORD_MASK;
+	}
+
+	return i;
+}
+
+
+static uint32_t HashFailureUid(uint32_t uid)
+{
+	// golden ratio multiplier spreads uid over all bits of the key
+	return HashFailureKey(uid * 0x9e3779b97f4a7c15ULL);
+}
+
+
+/*
+ * Returns uid table slot of @uid or the free slot it would take. There is
+ * always a free slot, as no more uids than records are listed.
+ */
+static uint32_t FindFailureRecordUid(uint32_t uid)
+{
+	const failure_record_uid_t *uids = failureRecordTable.uids;
+	uint32_t i = HashFailureUid(uid);
+
+	while (uids[i].head != FAILURE_RECORD_NO_SLOT && uids[i].uid != uid) {
+		i = (i + 1) & FAILURE_RECORD_MASK;
+	}
+
+	return i;
+}
+
+
+/*
+ * Frees uid table slot @i, same as RemoveFailureRecord()
+ */
+static void RemoveFailureRecordUid(uint32_t i)
+{
+	failure_record_uid_t *uids = failureRecordTable.uids;
+	uint32_t j = i;
+
+	for (;;) {
+		uint32_t home;
+
+		j = (j + 1) & FAILURE_RECORD_MASK;
+		if (uids[j].head == FAILURE_RECORD_NO_SLOT) {
+			break;
+		}
+
+		home = HashFailureUid(uids[j].uid);
+		if (((j - home) & FAILURE_RECORD_MASK) >=
+				((j - i) & FAILURE_RECORD_MASK)) {
+			uids[i] = uids[j];
+			i = j;
+		}
+	}
+
+	uids[i].uid = 0;
+	uids[i].head = FAILURE_RECORD_NO_SLOT;
+}
+
+
+/*
+ * Puts record in slot @i at the head of the list of its uid
+ */
+static void LinkFailureRecord(uint32_t i)
 {
-	uint32_t i;
 	failure_record_t *records = failureRecordTable.records;
-	uint32_t tableSize = failureRecordTable.size;
+	failure_record_uid_t *entry =
+		&failureRecordTable.uids[FindFailureRecordUid(records[i].uid)];
 
-	for (i = 0; i < tableSize; i++) {
-		if (records[i].secure_user_id == user_id) {
-			*record = records[i];
+	if (entry->head == FAILURE_RECORD_NO_SLOT) {
+		entry->uid = records[i].uid;
+		records[i].next = FAILURE_RECORD_NO_SLOT;
+	} else {
+		records[i].next = entry->head;
+		records[entry->head].prev = i;
+	}
+	records[i].prev = FAILURE_RECORD_NO_SLOT;
+	entry->head = i;
+}
+
+
+/*
+ * Takes record in slot @i out of the list of its uid, the uid leaves the
+ * uid table with its last record
+ */
+static void UnlinkFailureRecord(uint32_t i)
+{
+	failure_record_t *records = failureRecordTable.records;
+	const failure_record_t *record = &records[i];
+	uint32_t j;
+
+	if (record->next != FAILURE_RECORD_NO_SLOT) {
+		records[record->next].prev = record->prev;
+	}
+	if (record->prev != FAILURE_RECORD_NO_SLOT) {
+		records[record->prev].next = record->next;
+		return;
+	}
+
+	j = FindFailureRecordUid(record->uid);
+	if (record->next != FAILURE_RECORD_NO_SLOT) {
+		failureRecordTable.uids[j].head = record->next;
+	} else {
+		RemoveFailureRecordUid(j);
+	}
+}
+
+
+/*
+ * Moves record from slot @from to free slot @to, keeping its uid list
+ */
+static void MoveFailureRecord(uint32_t from, uint32_t to)
+{
+	failure_record_t *records = failureRecordTable.records;
+	const failure_record_t *record = &records[to];
+
+	records[to] = records[from];
+	if (record->next != FAILURE_RECORD_NO_SLOT) {
+		records[record->next].prev = to;
+	}
+	if (record->prev != FAILURE_RECORD_NO_SLOT) {
+		records[record->prev].next = to;
+	} else {
+		failureRecordTable.uids[FindFailureRecordUid(record->uid)]
+			.head = to;
+	}
+}
+
+
+/*
+ * Frees slot @i, moving later records of its probe sequence back so that
+ * lookups never stop early
+ */
+static void RemoveFailureRecord(uint32_t i)
+{
+	failure_record_t *records = failureRecordTable.records;
+	uint32_t j = i;
+
+	UnlinkFailureRecord(i);
+
+	for (;;) {
+		uint32_t home;
+
+		j = (j + 1) & FAILURE_RECORD_MASK;
+		if (!records[j].failure_counter) {
+			break;
+		}
+
+		// record at j may move to i unless its home is in (i, j]
+		home = HashFailureKey(records[j].secure_user_id);
+		if (((j - home) & FAILURE_RECORD_MASK) >=
+				((j - i) & FAILURE_RECORD_MASK)) {
+			MoveFailureRecord(j, i);
+			i = j;
+		}
+	}
+
+	memset(&records[i], 0, sizeof(records[i]));
+	failureRecordTable.size--;
+}
+
+
+/*
+ * @return true if @record is locked out at @timestamp
+ */
+static bool FailureRecordLocked(const failure_record_t *record,
+		uint64_t timestamp)
+{
+	uint32_t timeout = ComputeRetryTimeout(record);
+
+	// a record from the future is locked out again, see ThrottleRequest
+	return timeout > 0 &&
+		(timestamp <= record->last_checked_timestamp ||
+		 timestamp < record->last_checked_timestamp + timeout);
+}
+
+
+/*
+ * Makes room for a new user by dropping the record with the fewest
+ * failures, oldest first. Users in a lockout are never dropped, so the
+ * table cannot be used to lift a lockout.
+ */
+static TEE_Result EvictFailureRecord(void)
+{
+	const failure_record_t *records = failureRecordTable.records;
+	const uint64_t timestamp = GetTimestamp();
+	uint32_t victim = FAILURE_RECORD_SLOTS;
+	uint32_t i;
+
+	for (i = 0; i < FAILURE_RECORD_SLOTS; i++) {
+		if (!records[i].failure_counter ||
+				FailureRecordLocked(&records[i], timestamp)) {
+			continue;
+		}
+
+		if (victim == FAILURE_RECORD_SLOTS ||
+				records[i].failure_counter <
+				records[victim].failure_counter ||
+				(records[i].failure_counter ==
+				 records[victim].failure_counter &&
+				 records[i].last_checked_timestamp <
+				 records[victim].last_checked_timestamp)) {
+			victim = i;
+		}
+	}
+
+	if (victim == FAILURE_RECORD_SLOTS) {
+		EMSG("Every failure record is locked out");
+		return TEE_ERROR_OUT_OF_MEMORY;
+	}
+
+	DMSG("Evicting failure record with %u failures",
+			records[victim].failure_counter);
+	RemoveFailureRecord(victim);
+	return TEE_SUCCESS;
+}
+
+
+/*
+ * Remembers journal state of @user_id before its first change since the
+ * last commit, @current is its slot
+ */
+static void MarkPendingRecord(secure_id_t user_id,
+		const failure_record_t *current)
+{
+	failure_record_t *pending = failureRecordTable.pending;
+	uint32_t i;
+
+	if (failureRecordTable.pendingOverflow) {
+		return;
+	}
+
+	// a change after a delete would be written before it
+	if (failureRecordTable.pendingDeleteSize) {
+		failureRecordTable.pendingOverflow = true;
+		return;
+	}
+
+	for (i = 0; i < failureRecordTable.pendingSize; i++) {
+		if (pending[i].secure_user_id == user_id) {
 			return;
 		}
 	}
 
+	if (i == MAX_PENDING_RECORDS) {
+		failureRecordTable.pendingOverflow = true;
+		return;
+	}
+
+	if (current->failure_counter) {
+		pending[i] = *current;
+	} else {
+		pending[i].secure_user_id = user_id;
+		pending[i].last_checked_timestamp = 0;
+		pending[i].failure_counter = 0;
+	}
+	failureRecordTable.pendingSize++;
+}
+
+
+void GetFailureRecord(secure_id_t user_id, failure_record_t *record)
+{
+	const failure_record_t *slot =
+		&failureRecordTable.records[FindFailureRecord(user_id)];
+
+	if (slot->failure_counter) {
+		*record = *slot;
+		return;
+	}
+
 	record->secure_user_id = user_id;
 	record->failure_counter = 0;
 	record->last_checked_timestamp = 0;
+	record->uid = FAILURE_RECORD_NO_UID;
 }
 
 
-void WriteFailureRecord(const failure_record_t *record)
+/*
+ * Stores @record in the table, @journaled is false when the record comes
+ * from the journal itself
+ */
+static TEE_Result StoreFailureRecord(const failure_record_t *record,
+		bool journaled)
 {
-	uint32_t i;
 	failure_record_t *records = failureRecordTable.records;
+	uint32_t i = FindFailureRecord(record->secure_user_id);
+	TEE_Result res;
 
-	int min_idx = 0;
-	uint64_t min_timestamp = ~0ULL;
-
-	for (i = 0; i < failureRecordTable.size; i++) {
-		if (records[i].secure_user_id == record->secure_user_id) {
-			break;
-		}
+	if (journaled) {
+		MarkPendingRecord(record->secure_user_id, &records[i]);
+	}
 
-		if (records[i].last_checked_timestamp <= min_timestamp) {
-			min_timestamp = records[i].last_checked_timestamp;
-			min_idx = i;
+	if (!record->failure_counter) {
+		if (records[i].failure_counter) {
+			RemoveFailureRecord(i);
 		}
+		return TEE_SUCCESS;
 	}
 
-	if (i >= MAX_FAILURE_RECORDS) {
-		// replace the oldest element if all records are in use
-		i = min_idx;
-	} else if (i == failureRecordTable.size) {
+	if (!records[i].failure_counter) {
+		if (failureRecordTable.size >= MAX_FAILURE_RECORDS) {
+			res = EvictFailureRecord();
+			if (res != TEE_SUCCESS) {
+				return res;
+			}
+			i = FindFailureRecord(record->secure_user_id);
+		}
 		failureRecordTable.size++;
+	} else if (records[i].uid == record->uid) {
+		// links of @record may be stale, the slot keeps its own
+		records[i].last_checked_timestamp =
+			record->last_checked_timestamp;
+		records[i].failure_counter = record->failure_counter;
+		return TEE_SUCCESS;
+	} else {
+		UnlinkFailureRecord(i);
 	}
 
 	records[i] = *record;
+	LinkFailureRecord(i);
+	return TEE_SUCCESS;
 }
 
 
-void IncrementFailureRecord(failure_record_t *record, uint64_t timestamp)
+TEE_Result WriteFailureRecord(const failure_record_t *record)
+{
+	return StoreFailureRecord(record, true);
+}
+
+
+TEE_Result IncrementFailureRecord(failure_record_t *record,
+		uint64_t timestamp)
 {
 	record->failure_counter++;
 	record->last_checked_timestamp = timestamp;
+	if (ComputeRetryTimeout(record)) {
+		ta_stats.lockouts++;
+	}
 
-	WriteFailureRecord(record);
+	return WriteFailureRecord(record);
 }
 
 
@@ -100,11 +538,478 @@ void ClearFailureRecord(secure_id_t user_id)
 	record.secure_user_id = user_id;
 	record.last_checked_timestamp = 0;
 	record.failure_counter = 0;
+	record.uid = FAILURE_RECORD_NO_UID;
 
 	WriteFailureRecord(&record);
 }
 
 
+/*
+ * Clears records of @uid that are not locked out at @timestamp, without
+ * journaling them
+ */
+static void DropUidFailureRecords(uint32_t uid, uint64_t timestamp)
+{
+	const failure_record_t *records = failureRecordTable.records;
+	uint32_t i = failureRecordTable.uids[FindFailureRecordUid(uid)].head;
+
+	while (i != FAILURE_RECORD_NO_SLOT) {
+		uint32_t next = records[i].next;
+		secure_id_t next_id = 0;
+
+		if (FailureRecordLocked(&records[i], timestamp)) {
+			i = next;
+			continue;
+		}
+
+		// removal may move the next record, find it again by its key
+		if (next != FAILURE_RECORD_NO_SLOT) {
+			next_id = records[next].secure_user_id;
+		}
+		RemoveFailureRecord(i);
+		i = next != FAILURE_RECORD_NO_SLOT ?
+			FindFailureRecord(next_id) : FAILURE_RECORD_NO_SLOT;
+	}
+}
+
+
+void DeleteUserFailureRecords(uint32_t uid)
+{
+	const uint64_t timestamp = GetTimestamp();
+	journal_entry_t *entry;
+
+	DropUidFailureRecords(uid, timestamp);
+
+	// compaction writes the records left anyway
+	if (failureRecordTable.pendingOverflow) {
+		return;
+	}
+	if (failureRecordTable.pendingDeleteSize == MAX_PENDING_DELETES) {
+		failureRecordTable.pendingOverflow = true;
+		return;
+	}
+
+	entry = &failureRecordTable.pendingDeletes[
+		failureRecordTable.pendingDeleteSize++];
+	memset(entry, 0, sizeof(*entry));
+	entry->last_checked_timestamp = timestamp;
+	entry->uid = uid;
+	entry->type = JOURNAL_ENTRY_DELETE_UID;
+}
+
+
+void DeleteAllFailureRecords(void)
+{
+	const failure_record_t *records = failureRecordTable.records;
+	const uint64_t timestamp = GetTimestamp();
+	uint32_t i = 0;
+
+	// slots behind i hold only kept records, so whatever moves back
+	// into slot i has not been looked at yet
+	while (i < FAILURE_RECORD_SLOTS) {
+		if (records[i].failure_counter &&
+				!FailureRecordLocked(&records[i], timestamp)) {
+			RemoveFailureRecord(i);
+			continue;
+		}
+		i++;
+	}
+
+	failureRecordTable.pendingSize = 0;
+	failureRecordTable.pendingDeleteSize = 0;
+	failureRecordTable.pendingOverflow = true;
+}
+
+
+static void FillJournalEntry(journal_entry_t *entry,
+		const failure_record_t *record)
+{
+	entry->secure_user_id = record->secure_user_id;
+	entry->last_checked_timestamp = record->last_checked_timestamp;
+	entry->failure_counter = record->failure_counter;
+	entry->uid = record->uid;
+	entry->type = JOURNAL_ENTRY_RECORD;
+}
+
+
+/*
+ * Opens the journal, finishing an interrupted compaction or creating an
+ * empty journal if needed
+ */
+static TEE_Result OpenJournal(void)
+{
+	TEE_Result res;
+	journal_header_t header;
+
+	res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE, journal_ID,
+			sizeof(journal_ID), JOURNAL_FLAGS, &journal);
+	if (res != TEE_ERROR_ITEM_NOT_FOUND) {
+		goto exit;
+	}
+
+	// compaction stopped between removing the old journal and renaming
+	// the new one, which is complete
+	res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE, journal_tmp_ID,
+			sizeof(journal_tmp_ID), JOURNAL_FLAGS, &journal);
+	if (res == TEE_SUCCESS) {
+		if (TEE_RenamePersistentObject(journal, journal_ID,
+					sizeof(journal_ID)) != TEE_SUCCESS) {
+			EMSG("Failed to rename compacted journal");
+		}
+		goto exit;
+	}
+	if (res != TEE_ERROR_ITEM_NOT_FOUND) {
+		goto exit;
+	}
+
+	header.magic = JOURNAL_MAGIC;
+	header.version = JOURNAL_VERSION;
+	res = TEE_CreatePersistentObject(TEE_STORAGE_PRIVATE, journal_ID,
+			sizeof(journal_ID), JOURNAL_FLAGS, TEE_HANDLE_NULL,
+			&header, sizeof(header), &journal);
+
+exit:
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to open failure record journal, error=%X", res);
+		journal = TEE_HANDLE_NULL;
+	}
+	return res;
+}
+
+
+/*
+ * Reads journal entry @i of @buffer in @version format into @record
+ *
+ * @return JOURNAL_ENTRY_RECORD or JOURNAL_ENTRY_DELETE_UID
+ */
+static uint32_t ReadJournalEntry(const void *buffer, uint32_t i,
+		uint32_t version, failure_record_t *record)
+{
+	const journal_entry_no_uid_t *no_uid = buffer;
+	const journal_entry_no_type_t *no_type = buffer;
+	const journal_entry_t *entry = buffer;
+
+	if (version == JOURNAL_VERSION_NO_UID) {
+		record->secure_user_id = no_uid[i].secure_user_id;
+		record->last_checked_timestamp =
+			no_uid[i].last_checked_timestamp;
+		record->failure_counter = no_uid[i].failure_counter;
+		record->uid = FAILURE_RECORD_NO_UID;
+		return JOURNAL_ENTRY_RECORD;
+	}
+
+	if (version == JOURNAL_VERSION_NO_TYPE) {
+		record->secure_user_id = no_type[i].secure_user_id;
+		record->last_checked_timestamp =
+			no_type[i].last_checked_timestamp;
+		record->failure_counter = no_type[i].failure_counter;
+		record->uid = no_type[i].uid;
+		return JOURNAL_ENTRY_RECORD;
+	}
+
+	record->secure_user_id = entry[i].secure_user_id;
+	record->last_checked_timestamp = entry[i].last_checked_timestamp;
+	record->failure_counter = entry[i].failure_counter;
+	record->uid = entry[i].uid;
+	return entry[i].type;
+}
+
+
+/*
+ * Replays the whole journal into the table, @version is set to the
+ * format the journal was written in
+ */
+static TEE_Result ReadJournal(uint32_t *version)
+{
+	TEE_Result res;
+	journal_header_t header;
+	failure_record_t record;
+	uint32_t entry_size = sizeof(journal_entry_t);
+	uint32_t count = 0;
+	uint32_t i;
+
+	journalEntries = 0;
+	*version = JOURNAL_VERSION;
+
+	res = TEE_ReadObjectData(journal, &header, sizeof(header), &count);
+	if (res != TEE_SUCCESS) {
+		goto exit;
+	}
+	if (count == sizeof(header) && header.magic == JOURNAL_MAGIC &&
+			header.version == JOURNAL_VERSION_NO_UID) {
+		*version = JOURNAL_VERSION_NO_UID;
+		entry_size = sizeof(journal_entry_no_uid_t);
+	} else if (count == sizeof(header) && header.magic == JOURNAL_MAGIC &&
+			header.version == JOURNAL_VERSION_NO_TYPE) {
+		*version = JOURNAL_VERSION_NO_TYPE;
+		entry_size = sizeof(journal_entry_no_type_t);
+	} else if (count != sizeof(header) ||
+			header.magic != JOURNAL_MAGIC ||
+			header.version != JOURNAL_VERSION) {
+		EMSG("Failure record journal is damaged, starting over");
+		header.magic = JOURNAL_MAGIC;
+		header.version = JOURNAL_VERSION;
+		res = TEE_TruncateObjectData(journal, 0);
+		if (res == TEE_SUCCESS) {
+			res = TEE_SeekObjectData(journal, 0, TEE_DATA_SEEK_SET);
+		}
+		if (res == TEE_SUCCESS) {
+			res = TEE_WriteObjectData(journal, &header,
+					sizeof(header));
+		}
+		goto exit;
+	}
+
+	do {
+		res = TEE_ReadObjectData(journal, journalBuffer,
+				JOURNAL_BUFFER_ENTRIES * entry_size, &count);
+		if (res != TEE_SUCCESS) {
+			goto exit;
+		}
+
+		for (i = 0; i < count / entry_size; i++) {
+			if (ReadJournalEntry(journalBuffer, i, *version,
+						&record) ==
+					JOURNAL_ENTRY_DELETE_UID) {
+				DropUidFailureRecords(record.uid,
+						record.last_checked_timestamp);
+			} else {
+				StoreFailureRecord(&record, false);
+			}
+		}
+		journalEntries += count / entry_size;
+	} while (count == JOURNAL_BUFFER_ENTRIES * entry_size);
+
+	// a torn tail would misalign every later append
+	if (count % entry_size) {
+		EMSG("Dropping partial failure record journal entry");
+		res = TEE_TruncateObjectData(journal, sizeof(header) +
+				journalEntries * entry_size);
+	}
+
+exit:
+	return res;
+}
+
+
+/*
+ * Replaces the journal with one holding only records in use. The new
+ * journal is written in full under journal_tmp_ID and renamed over the
+ * old one, OpenJournal() finishes the job if we stop in between.
+ */
+static TEE_Result CompactJournal(void)
+{
+	TEE_Result res;
+	TEE_ObjectHandle compacted = TEE_HANDLE_NULL;
+	journal_header_t header;
+	const failure_record_t *records = failureRecordTable.records;
+	uint32_t entries = 0;
+	uint32_t count = 0;
+	uint32_t i;
+
+	// the old journal must be open to be replaced
+	if (journal == TEE_HANDLE_NULL) {
+		res = OpenJournal();
+		if (res != TEE_SUCCESS) {
+			goto exit;
+		}
+	}
+
+	header.magic = JOURNAL_MAGIC;
+	header.version = JOURNAL_VERSION;
+	res = TEE_CreatePersistentObject(TEE_STORAGE_PRIVATE, journal_tmp_ID,
+			sizeof(journal_tmp_ID),
+			JOURNAL_FLAGS | TEE_DATA_FLAG_OVERWRITE,
+			TEE_HANDLE_NULL, &header, sizeof(header), &compacted);
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to create compacted journal, error=%X", res);
+		goto exit;
+	}
+
+	res = TEE_SeekObjectData(compacted, 0, TEE_DATA_SEEK_END);
+	for (i = 0; i < FAILURE_RECORD_SLOTS && res == TEE_SUCCESS; i++) {
+		if (records[i].failure_counter) {
+			FillJournalEntry(&journalBuffer[count++], &records[i]);
+		}
+
+		if (count == JOURNAL_BUFFER_ENTRIES ||
+				(count && i == FAILURE_RECORD_SLOTS - 1)) {
+			res = TEE_WriteObjectData(compacted, journalBuffer,
+					count * sizeof(journalBuffer[0]));
+			entries += count;
+			count = 0;
+		}
+	}
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to write compacted journal, error=%X", res);
+		TEE_CloseAndDeletePersistentObject1(compacted);
+		goto exit;
+	}
+
+	res = TEE_CloseAndDeletePersistentObject1(journal);
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to remove journal, error=%X", res);
+		TEE_CloseAndDeletePersistentObject1(compacted);
+		journal = TEE_HANDLE_NULL;
+		goto exit;
+	}
+
+	journal = compacted;
+	journalEntries = entries;
+	failureRecordTable.pendingSize = 0;
+	failureRecordTable.pendingDeleteSize = 0;
+	failureRecordTable.pendingOverflow = false;
+
+	if (TEE_RenamePersistentObject(journal, journal_ID,
+				sizeof(journal_ID)) != TEE_SUCCESS) {
+		EMSG("Failed to rename compacted journal");
+	}
+
+exit:
+	return res;
+}
+
+
+TEE_Result LoadFailureRecords(void)
+{
+	TEE_Result res;
+	uint32_t version;
+	uint64_t start;
+
+	if (journalLoaded) {
+		return TEE_SUCCESS;
+	}
+
+	start = StageStart();
+
+	res = InitFailureRecords();
+	if (res != TEE_SUCCESS) {
+		goto exit;
+	}
+
+	res = OpenJournal();
+	if (res != TEE_SUCCESS) {
+		goto exit;
+	}
+
+	res = ReadJournal(&version);
+	if (res == TEE_SUCCESS && version != JOURNAL_VERSION) {
+		// entries are only ever appended in the current format
+		res = CompactJournal();
+	}
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to read failure record journal, error=%X", res);
+		TEE_CloseObject(journal);
+		journal = TEE_HANDLE_NULL;
+		InitFailureRecords();
+		goto exit;
+	}
+
+	journalLoaded = true;
+	DMSG("Loaded %u failure records from %u journal entries",
+			failureRecordTable.size, journalEntries);
+exit:
+	StageEnd(STAGE_RECORD_READ, start);
+	return res;
+}
+
+
+TEE_Result CommitFailureRecords(void)
+{
+	TEE_Result res = TEE_SUCCESS;
+	const failure_record_t *pending = failureRecordTable.pending;
+	failure_record_t current;
+	uint32_t count = 0;
+	uint64_t start;
+	uint32_t i;
+
+	if (!failureRecordTable.pendingSize &&
+			!failureRecordTable.pendingDeleteSize &&
+			!failureRecordTable.pendingOverflow) {
+		return TEE_SUCCESS;
+	}
+
+	start = StageStart();
+
+	if (!journalLoaded) {
+		// never replace what was counted in RAM with the journal
+		EMSG("Failure record journal is not loaded");
+		res = TEE_ERROR_BAD_STATE;
+		goto exit;
+	}
+
+	if (failureRecordTable.pendingOverflow) {
+		res = CompactJournal();
+		goto exit;
+	}
+
+	for (i = 0; i < failureRecordTable.pendingSize; i++) {
+		GetFailureRecord(pending[i].secure_user_id, &current);
+		if (current.failure_counter != pending[i].failure_counter ||
+				current.last_checked_timestamp !=
+				pending[i].last_checked_timestamp) {
+			FillJournalEntry(&journalBuffer[count++], &current);
+		}
+	}
+	// deletes go last, MarkPendingRecord() makes sure nothing changed
+	// after them
+	for (i = 0; i < failureRecordTable.pendingDeleteSize; i++) {
+		journalBuffer[count++] = failureRecordTable.pendingDeletes[i];
+	}
+
+	if (count) {
+		if (journal == TEE_HANDLE_NULL) {
+			res = OpenJournal();
+			if (res != TEE_SUCCESS) {
+				goto exit;
+			}
+		}
+
+		// position is past the end if a torn tail was cut off
+		res = TEE_SeekObjectData(journal, 0, TEE_DATA_SEEK_END);
+		if (res == TEE_SUCCESS) {
+			res = TEE_WriteObjectData(journal, journalBuffer,
+					count * sizeof(journalBuffer[0]));
+		}
+		if (res != TEE_SUCCESS) {
+			EMSG("Failed to write failure records, error=%X", res);
+			TEE_CloseObject(journal);
+			journal = TEE_HANDLE_NULL;
+			goto exit;
+		}
+	}
+
+	failureRecordTable.pendingSize = 0;
+	failureRecordTable.pendingDeleteSize = 0;
+	journalEntries += count;
+
+	if (journalEntries >= JOURNAL_COMPACT_ENTRIES +
+			failureRecordTable.size) {
+		CompactJournal();
+	}
+
+exit:
+	StageEnd(STAGE_RECORD_WRITE, start);
+	return res;
+}
+
+
+uint32_t CountFailureRecords(void)
+{
+	return failureRecordTable.size;
+}
+
+
+void CloseFailureRecords(void)
+{
+	TEE_CloseObject(journal);
+	journal = TEE_HANDLE_NULL;
+	journalLoaded = false;
+	TEE_Free(failureRecordTable.records);
+	failureRecordTable.records = NULL;
+}
+
+
 uint32_t ComputeRetryTimeout(const failure_record_t *record)
 {
 	static const int FAILURE_TIMEOUT_MS = 30000;
@@ -151,6 +1056,7 @@ bool ThrottleRequest(failure_record_t *record, uint64_t timestamp,
 				timestamp > last_checked) {
 			// attempt before timeout expired, return remaining time
 			*response_timeout = timeout - (timestamp-last_checked);
+			ta_stats.throttled++;
 			return true;
 		} else if (timestamp <= last_checked) {
 			// device was rebooted or timer reset, don't count as
@@ -158,6 +1064,7 @@ bool ThrottleRequest(failure_record_t *record, uint64_t timestamp,
 			record->last_checked_timestamp = timestamp;
 			WriteFailureRecord(record);
 			*response_timeout = timeout;
+			ta_stats.throttled++;
 			return true;
 		}
 	}
@@ -20,8 +20,19 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <tee_internal_api.h>
 #include "ta_gatekeeper.h"
 
+/*
+ * Android uid of a record written before uids were tracked
+ */
+#define FAILURE_RECORD_NO_UID UINT32_MAX
+
+/*
+ * Slot link that points to no record
+ */
+#define FAILURE_RECORD_NO_SLOT UINT32_MAX
+
 /*
  * Structure is a failure table entry
  */
@@ -29,12 +40,64 @@ typedef struct {
 	secure_id_t secure_user_id;
 	uint64_t last_checked_timestamp;
 	uint32_t failure_counter;
+	/* Android user the record belongs to */
+	uint32_t uid;
+	/* Slots of the previous and next record of @uid in the table */
+	uint32_t prev;
+	uint32_t next;
 } failure_record_t;
 
 /*
- * Initialize failure record table
+ * Structure is the head of the list of records of an Android uid
+ */
+typedef struct {
+	uint32_t uid;
+	/* Slot of the first record, FAILURE_RECORD_NO_SLOT if unused */
+	uint32_t head;
+} failure_record_uid_t;
+
+/*
+ * Slots of the failure record table, power of 2. The table takes
+ * FAILURE_RECORD_TABLE_SIZE bytes of TA heap and holds records of up to
+ * MAX_FAILURE_RECORDS users, free slots keep probe sequences short. The
+ * uid list heads have as many slots again.
+ */
+#ifndef CFG_GATEKEEPER_FAILURE_RECORDS
+#define CFG_GATEKEEPER_FAILURE_RECORDS 512
+#endif
+
+#define FAILURE_RECORD_TABLE_SIZE \
+	(CFG_GATEKEEPER_FAILURE_RECORDS * \
+	 (sizeof(failure_record_t) + sizeof(failure_record_uid_t)))
+#define MAX_FAILURE_RECORDS \
+	(CFG_GATEKEEPER_FAILURE_RECORDS - CFG_GATEKEEPER_FAILURE_RECORDS / 8)
+
+/*
+ * Initialize empty failure record table in RAM
+ */
+TEE_Result InitFailureRecords(void);
+
+/*
+ * Load failure record table from the journal in secure storage. Does
+ * nothing once the table is loaded.
  */
-void InitFailureRecords(void);
+TEE_Result LoadFailureRecords(void);
+
+/*
+ * Append records changed since the last commit to the journal with one
+ * write. Must succeed before the outcome of a counted attempt is returned.
+ */
+TEE_Result CommitFailureRecords(void);
+
+/*
+ * Close the journal, next LoadFailureRecords() reads it again
+ */
+void CloseFailureRecords(void);
+
+/*
+ * @return number of users with a failure record
+ */
+uint32_t CountFailureRecords(void);
 
 /*
  * Returns failure @record for secure @user_id
@@ -42,21 +105,39 @@ void InitFailureRecords(void);
 void GetFailureRecord(secure_id_t user_id, failure_record_t *record);
 
 /*
- * Write failure @record to failure record table. Function will rewrite the
- * oldest record if failure record table is full
+ * Write failure @record to failure record table. If the table is full,
+ * the record with the fewest failures which is not locked out is dropped.
+ *
+ * @return TEE_ERROR_OUT_OF_MEMORY if every record is locked out
  */
-void WriteFailureRecord(const failure_record_t *record);
+TEE_Result WriteFailureRecord(const failure_record_t *record);
 
 /*
- * Increment failure counter for @record and set new @timestamp
+ * Increment failure counter for @record and set new @timestamp, see
+ * WriteFailureRecord()
  */
-void IncrementFailureRecord(failure_record_t *record, uint64_t timestamp);
+TEE_Result IncrementFailureRecord(failure_record_t *record,
+		uint64_t timestamp);
 
 /*
  * Clean failure record counter and timestamp for @user_id
  */
 void ClearFailureRecord(secure_id_t user_id);
 
+/*
+ * Clear failure records of Android user @uid, found through its list of
+ * records, and journal the delete as one entry. Records in a lockout are
+ * kept, so deleting a user cannot lift a lockout; they are dropped like
+ * any other record once it expires.
+ */
+void DeleteUserFailureRecords(uint32_t uid);
+
+/*
+ * Clear failure records of all users except those in a lockout. The next
+ * commit rewrites the journal with the records left.
+ */
+void DeleteAllFailureRecords(void);
+
 /*
  * Calculates the timeout in milliseconds as a function of the failure
  * counter 'x' for @record as follows:
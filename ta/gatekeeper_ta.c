@@ -22,8 +22,71 @@
 #include "ta_gatekeeper.h"
 #include "gatekeeper_ipc.h"
 #include "failure_record.h"
+#include "ta_stats.h"
+#ifdef CFG_GATEKEEPER_HMAC_SHA256
+#include "hmac_sha256.h"
+#endif
+
+_Static_assert(sizeof(password_handle_t) == GK_PASSWORD_HANDLE_SIZE,
+		"GK_PASSWORD_HANDLE_SIZE does not match password_handle_t");
+_Static_assert(sizeof(hw_auth_token_t) == GK_AUTH_TOKEN_SIZE,
+		"GK_AUTH_TOKEN_SIZE does not match hw_auth_token_t");
+_Static_assert(offsetof(password_handle_t, user_id) ==
+		GK_PASSWORD_HANDLE_USER_ID_OFFSET,
+		"GK_PASSWORD_HANDLE_USER_ID_OFFSET is wrong");
+_Static_assert(HANDLE_METADATA_LENGTH == offsetof(password_handle_t, salt),
+		"HANDLE_METADATA_LENGTH does not match password_handle_t");
 
 static uint8_t	secret_ID[] = {0xB1, 0x6B, 0x00, 0xB5};
+static uint8_t	kdf_ID[] = {0xB1, 0x6B, 0x00, 0xC1};
+
+/*
+ * Password KDF calibration, persisted in kdf_ID. It is redone only if
+ * CFG_GATEKEEPER_KDF_TARGET_MS changes, so new handles of a device all
+ * get the same cost. Zero @iterations means not loaded yet.
+ */
+typedef struct {
+	uint32_t target_ms;
+	uint32_t iterations;
+	uint32_t cost_us;	/* estimated run time of @iterations */
+} kdf_calibration_t;
+
+static kdf_calibration_t kdf;
+
+/*
+ * Resident HMAC-SHA256 key: a GP operation or, with
+ * CFG_GATEKEEPER_HMAC_SHA256, key midstates of hmac_sha256.c, which
+ * skip the ipad and opad blocks and the crypto syscalls on every MAC
+ */
+#ifdef CFG_GATEKEEPER_HMAC_SHA256
+typedef hmac_sha256_key_t *ta_mac_t;
+#define TA_MAC_NULL NULL
+#else
+typedef TEE_OperationHandle ta_mac_t;
+#define TA_MAC_NULL TEE_HANDLE_NULL
+#endif
+
+/*
+ * HMAC keyed with the master key. It is set up once per TA instance, so
+ * enroll and verify do not touch secure storage.
+ */
+static ta_mac_t master_op = TA_MAC_NULL;
+
+/*
+ * Keymaster session and HMAC operation keyed with its auth token key.
+ * The session is kept open, so keymaster is not loaded on the unlock path
+ * and its per-boot key does not change under us. The key is fetched again
+ * every AUTH_TOKEN_KEY_REFRESH_MS to notice a restarted keymaster.
+ */
+static TEE_TASessionHandle keymaster_sess = TEE_HANDLE_NULL;
+static ta_mac_t auth_token_op = TA_MAC_NULL;
+static uint64_t auth_token_key_timestamp;
+
+ta_stats_t ta_stats;
+
+static TEE_Result TA_LoadMasterKey(void);
+static void TA_FreeSignOperation(ta_mac_t *op);
+static void TA_CloseKeymaster(void);
 
 TEE_Result TA_CreateEntryPoint(void)
 {
@@ -58,11 +121,19 @@ TEE_Result TA_CreateEntryPoint(void)
 		EMSG("Failed to open secret, error=%X", res);
 	}
 
+	if (res == TEE_SUCCESS) {
+		res = TA_LoadMasterKey();
+	}
+
 	return res;
 }
 
 void TA_DestroyEntryPoint(void)
 {
+	TA_FreeSignOperation(&master_op);
+	TA_FreeSignOperation(&auth_token_op);
+	TA_CloseKeymaster();
+	CloseFailureRecords();
 }
 
 TEE_Result TA_OpenSessionEntryPoint(uint32_t param_types,
@@ -75,7 +146,11 @@ TEE_Result TA_OpenSessionEntryPoint(uint32_t param_types,
 	if (param_types != exp_param_types)
 		return TEE_ERROR_BAD_PARAMETERS;
 
-	InitFailureRecords();
+	/*
+	 * Throttling survives TA reloads through the journal. Commands load
+	 * it again if storage is not ready yet.
+	 */
+	LoadFailureRecords();
 
 	/* Unused parameters */
 	(void)&params;
@@ -90,11 +165,9 @@ void TA_CloseSessionEntryPoint(void *sess_ctx)
 	(void)&sess_ctx;
 }
 
-static TEE_Result TA_GetMasterKey(TEE_ObjectHandle masterKey)
+static TEE_Result TA_GetMasterKey(uint8_t *secretData, uint32_t size)
 {
 	TEE_Result		res;
-	TEE_Attribute		attrs[1];
-	uint8_t			secretData[HMAC_SHA256_KEY_SIZE_BYTE];
 	TEE_ObjectHandle	secretObj = TEE_HANDLE_NULL;
 	uint32_t		readSize = 0;
 
@@ -105,82 +178,374 @@ static TEE_Result TA_GetMasterKey(TEE_ObjectHandle masterKey)
 		goto exit;
 	}
 
-	res = TEE_ReadObjectData(secretObj, secretData, sizeof(secretData),
-			&readSize);
-	if (res != TEE_SUCCESS || sizeof(secretData) != readSize) {
-		EMSG("Failed to read secret data, bytes = %u", readSize);
-		goto close_obj;
+	res = TEE_ReadObjectData(secretObj, secretData, size, &readSize);
+	if (res == TEE_SUCCESS && size != readSize) {
+		res = TEE_ERROR_CORRUPT_OBJECT;
 	}
-
-	TEE_InitRefAttribute(&attrs[0], TEE_ATTR_SECRET_VALUE, secretData,
-			sizeof(secretData));
-
-	res = TEE_PopulateTransientObject(masterKey, attrs,
-			sizeof(attrs)/sizeof(attrs[0]));
 	if (res != TEE_SUCCESS) {
-		EMSG("Failed to set master key attributes");
-		goto close_obj;
+		EMSG("Failed to read secret data, bytes = %u", readSize);
 	}
 
-close_obj:
 	TEE_CloseObject(secretObj);
 exit:
 	return res;
 }
 
 static TEE_Result TA_ComputeSignature(uint8_t *signature, size_t signature_length,
-		TEE_ObjectHandle key, const uint8_t *message, size_t length)
+		ta_mac_t op, const uint8_t *message, size_t length)
 {
 	uint32_t buf_length = HMAC_SHA256_KEY_SIZE_BYTE;
 	uint8_t buf[buf_length];
-	TEE_OperationHandle op = TEE_HANDLE_NULL;
-	TEE_Result res;
+	TEE_Result res = TEE_SUCCESS;
 	uint32_t to_write;
 
-	res = TEE_AllocateOperation(&op, TEE_ALG_HMAC_SHA256, TEE_MODE_MAC,
+#ifdef CFG_GATEKEEPER_HMAC_SHA256
+	HmacSha256(op, message, length, buf);
+#else
+	/*
+	 * @op is resident and keyed once, only bring it back to the initial
+	 * state in case an earlier use was left unfinished
+	 */
+	TEE_ResetOperation(op);
+	TEE_MACInit(op, NULL, 0);
+
+	res = TEE_MACComputeFinal(op, (void *)message, length, buf,
+			&buf_length);
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to compute HMAC");
+		TEE_ResetOperation(op);
+		return res;
+	}
+#endif
+
+	to_write = buf_length;
+	if (buf_length > signature_length)
+		to_write = signature_length;
+
+	memset(signature, 0, signature_length);
+	memcpy(signature, buf, to_write);
+
+	return res;
+}
+
+/*
+ * Allocates HMAC keyed with @size bytes of @key_data
+ */
+static TEE_Result TA_AllocateSignOperation(ta_mac_t *op,
+		const uint8_t *key_data, uint32_t size)
+{
+#ifdef CFG_GATEKEEPER_HMAC_SHA256
+	*op = TEE_Malloc(sizeof(**op), TEE_MALLOC_FILL_ZERO);
+	if (*op == NULL) {
+		EMSG("Failed to allocate HMAC key");
+		return TEE_ERROR_OUT_OF_MEMORY;
+	}
+
+	HmacSha256SetKey(*op, key_data, size);
+	return TEE_SUCCESS;
+#else
+	TEE_ObjectHandle key = TEE_HANDLE_NULL;
+	TEE_Attribute attrs[1];
+	TEE_Result res;
+
+	*op = TEE_HANDLE_NULL;
+
+	res = TEE_AllocateTransientObject(TEE_TYPE_HMAC_SHA256,
+			HMAC_SHA256_KEY_SIZE_BIT, &key);
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to allocate HMAC key");
+		goto exit;
+	}
+
+	TEE_InitRefAttribute(&attrs[0], TEE_ATTR_SECRET_VALUE,
+			(void *)key_data, size);
+	res = TEE_PopulateTransientObject(key, attrs,
+			sizeof(attrs)/sizeof(attrs[0]));
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to set HMAC key attributes");
+		goto free_key;
+	}
+
+	res = TEE_AllocateOperation(op, TEE_ALG_HMAC_SHA256, TEE_MODE_MAC,
 			HMAC_SHA256_KEY_SIZE_BIT);
 	if (res != TEE_SUCCESS) {
 		EMSG("Failed to allocate HMAC operation");
-		goto exit;
+		*op = TEE_HANDLE_NULL;
+		goto free_key;
 	}
 
-	res = TEE_SetOperationKey(op, key);
+	res = TEE_SetOperationKey(*op, key);
 	if (res != TEE_SUCCESS) {
 		EMSG("Failed to set secret key");
-		goto free_op;
+		TEE_FreeOperation(*op);
+		*op = TEE_HANDLE_NULL;
 	}
 
-	TEE_MACInit(op, NULL, 0);
+free_key:
+	TEE_FreeTransientObject(key);
+exit:
+	return res;
+#endif
+}
 
-	TEE_MACComputeFinal(op, (void *)message, length, buf, &buf_length);
-	if (res != TEE_SUCCESS) {
-		EMSG("Failed to compute HMAC");
-		goto free_op;
+static void TA_FreeSignOperation(ta_mac_t *op)
+{
+#ifdef CFG_GATEKEEPER_HMAC_SHA256
+	if (*op != NULL) {
+		memset(*op, 0, sizeof(**op));
+		TEE_Free(*op);
 	}
+#else
+	TEE_FreeOperation(*op);
+#endif
+	*op = TA_MAC_NULL;
+}
 
-	to_write = buf_length;
-	if (buf_length > signature_length)
-		to_write = signature_length;
+static TEE_Result TA_LoadMasterKey(void)
+{
+	uint8_t secretData[HMAC_SHA256_KEY_SIZE_BYTE];
+	const uint64_t start = StageStart();
+	TEE_Result res;
 
-	memset(signature, 0, signature_length);
-	memcpy(signature, buf, to_write);
+	res = TA_GetMasterKey(secretData, sizeof(secretData));
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to get master key");
+		goto exit;
+	}
+
+	res = TA_AllocateSignOperation(&master_op, secretData,
+			sizeof(secretData));
 
-free_op:
-	TEE_FreeOperation(op);
 exit:
+	memset(secretData, 0, sizeof(secretData));
+	StageEnd(STAGE_MASTER_KEY, start);
 	return res;
 }
 
+static TEE_Result TA_GetMasterOperation(ta_mac_t *op)
+{
+	TEE_Result res = TEE_SUCCESS;
+
+	/* Retry if storage was not ready when the instance was created */
+	if (master_op == TA_MAC_NULL) {
+		res = TA_LoadMasterKey();
+	}
+
+	*op = master_op;
+	return res;
+}
+
+/*
+ * PBKDF2 style KDF keyed with the master key:
+ * U1 = HMAC(salt || metadata || password), Ui = HMAC(Ui-1) and signature
+ * is U1 ^ ... ^ Un for n = @iterations. Single iteration is the plain HMAC
+ * of handles before HANDLE_VERSION_KDF.
+ *
+ * U1 is computed piecewise, so the password is read straight from the
+ * request and never copied.
+ */
 static TEE_Result TA_ComputePasswordSignature(
 		uint8_t *signature, size_t signature_length,
-		TEE_ObjectHandle key,
-		const uint8_t *password, size_t password_length, salt_t salt)
+		ta_mac_t op,
+		const void *metadata, size_t metadata_length,
+		const uint8_t *password, size_t password_length, salt_t salt,
+		uint32_t iterations)
 {
-	uint8_t salted_password[password_length + sizeof(salt)];
-	memcpy(salted_password, &salt, sizeof(salt));
-	memcpy(salted_password + sizeof(salt), password, password_length);
-	return TA_ComputeSignature(signature, signature_length, key,
-			salted_password, sizeof(salted_password));
+	uint8_t block[HMAC_SHA256_KEY_SIZE_BYTE];
+#ifdef CFG_GATEKEEPER_HMAC_SHA256
+	hmac_sha256_ctx_t ctx;
+#else
+	uint32_t block_length = sizeof(block);
+#endif
+	TEE_Result res = TEE_SUCCESS;
+	bool masked = false;
+	uint32_t i;
+	size_t j;
+
+	if (password_length > GK_MAX_PASSWORD_LENGTH) {
+		EMSG("Password is too long");
+		res = TEE_ERROR_BAD_PARAMETERS;
+		goto exit;
+	}
+
+#ifdef CFG_GATEKEEPER_HMAC_SHA256
+	HmacSha256Init(&ctx, op);
+	HmacSha256Update(&ctx, &salt, sizeof(salt));
+	HmacSha256Update(&ctx, metadata, metadata_length);
+	HmacSha256Update(&ctx, password, password_length);
+	HmacSha256Final(&ctx, block);
+#else
+	TEE_ResetOperation(op);
+	TEE_MACInit(op, NULL, 0);
+	TEE_MACUpdate(op, &salt, sizeof(salt));
+	TEE_MACUpdate(op, (void *)metadata, metadata_length);
+	res = TEE_MACComputeFinal(op, (void *)password, password_length,
+			block, &block_length);
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to compute HMAC");
+		TEE_ResetOperation(op);
+		goto exit;
+	}
+#endif
+
+	memset(signature, 0, signature_length);
+	if (signature_length > sizeof(block)) {
+		signature_length = sizeof(block);
+	}
+	memcpy(signature, block, signature_length);
+
+	/* Only the KDF loop can be cancelled, storage writes run to the end */
+	masked = TEE_UnmaskCancellation();
+	for (i = 1; i < iterations; i++) {
+		if (i % KDF_CANCEL_CHECK_ITERATIONS == 0 &&
+				TEE_GetCancellationFlag()) {
+			EMSG("KDF is cancelled after %u iterations", i);
+			res = TEE_ERROR_CANCEL;
+			goto exit;
+		}
+		res = TA_ComputeSignature(block, sizeof(block), op,
+				block, sizeof(block));
+		if (res != TEE_SUCCESS) {
+			goto exit;
+		}
+		for (j = 0; j < signature_length; j++) {
+			signature[j] ^= block[j];
+		}
+	}
+
+exit:
+	if (masked) {
+		TEE_MaskCancellation();
+	}
+	memset(block, 0, sizeof(block));
+	return res;
+}
+
+/*
+ * @return KDF iterations of a handle or 0 if the handle is not valid
+ */
+static uint32_t TA_HandleKdfIterations(uint8_t version, uint64_t flags)
+{
+	uint64_t iterations;
+
+	if (version < HANDLE_VERSION_KDF) {
+		return 1;
+	}
+
+	iterations = flags >> HANDLE_FLAG_KDF_ITERATIONS_SHIFT;
+	if (iterations == 0 || iterations > KDF_MAX_ITERATIONS) {
+		return 0;
+	}
+	return iterations;
+}
+
+/*
+ * Finds how many KDF iterations take CFG_GATEKEEPER_KDF_TARGET_MS
+ */
+static TEE_Result TA_CalibrateKdf(ta_mac_t op,
+		kdf_calibration_t *calibration)
+{
+	const uint8_t metadata[HANDLE_METADATA_LENGTH] = {0};
+	const uint8_t password[] = {0};
+	uint8_t signature[HMAC_SHA256_KEY_SIZE_BYTE];
+	uint32_t iterations = 1;
+	uint64_t target;
+	uint64_t elapsed;
+	uint64_t start;
+	TEE_Result res;
+
+	calibration->target_ms = CFG_GATEKEEPER_KDF_TARGET_MS;
+	calibration->iterations = 1;
+	calibration->cost_us = 0;
+	if (!CFG_GATEKEEPER_KDF_TARGET_MS) {
+		return TEE_SUCCESS;
+	}
+
+	for (;;) {
+		start = GetTimestamp();
+		res = TA_ComputePasswordSignature(signature, sizeof(signature),
+				op, metadata, sizeof(metadata), password,
+				sizeof(password), 0, iterations);
+		elapsed = GetTimestamp() - start;
+		if (res != TEE_SUCCESS) {
+			EMSG("Failed to run KDF, error=%X", res);
+			return res;
+		}
+		if (elapsed >= KDF_CALIBRATION_MIN_MS ||
+				iterations >= KDF_MAX_ITERATIONS) {
+			break;
+		}
+		iterations *= 2;
+	}
+
+	if (!elapsed) {
+		elapsed = 1;
+	}
+	target = (uint64_t)iterations * CFG_GATEKEEPER_KDF_TARGET_MS / elapsed;
+	if (target < 1) {
+		target = 1;
+	} else if (target > KDF_MAX_ITERATIONS) {
+		target = KDF_MAX_ITERATIONS;
+	}
+
+	calibration->iterations = target;
+	calibration->cost_us = target * elapsed * 1000 / iterations;
+	DMSG("KDF takes %u us with %u iterations", calibration->cost_us,
+			calibration->iterations);
+	return TEE_SUCCESS;
+}
+
+/*
+ * Loads KDF calibration, calibrating and persisting it on first boot
+ */
+static TEE_Result TA_LoadKdf(void)
+{
+	TEE_ObjectHandle obj = TEE_HANDLE_NULL;
+	ta_mac_t op;
+	kdf_calibration_t calibration;
+	uint32_t count = 0;
+	TEE_Result res;
+
+	if (kdf.iterations) {
+		return TEE_SUCCESS;
+	}
+
+	res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE, kdf_ID,
+			sizeof(kdf_ID), TEE_DATA_FLAG_ACCESS_READ, &obj);
+	if (res == TEE_SUCCESS) {
+		res = TEE_ReadObjectData(obj, &calibration,
+				sizeof(calibration), &count);
+		TEE_CloseObject(obj);
+		if (res == TEE_SUCCESS && count == sizeof(calibration) &&
+				calibration.target_ms ==
+				CFG_GATEKEEPER_KDF_TARGET_MS &&
+				calibration.iterations > 0 &&
+				calibration.iterations <= KDF_MAX_ITERATIONS) {
+			kdf = calibration;
+			return TEE_SUCCESS;
+		}
+	}
+
+	res = TA_GetMasterOperation(&op);
+	if (res == TEE_SUCCESS) {
+		res = TA_CalibrateKdf(op, &calibration);
+	}
+	if (res != TEE_SUCCESS) {
+		goto exit;
+	}
+
+	/* Calibration still holds for this boot if it cannot be stored */
+	if (TEE_CreatePersistentObject(TEE_STORAGE_PRIVATE, kdf_ID,
+				sizeof(kdf_ID), TEE_DATA_FLAG_ACCESS_WRITE |
+				TEE_DATA_FLAG_OVERWRITE, TEE_HANDLE_NULL,
+				&calibration, sizeof(calibration),
+				NULL) != TEE_SUCCESS) {
+		EMSG("Failed to store KDF calibration");
+	}
+	kdf = calibration;
+
+exit:
+	return res;
 }
 
 static TEE_Result TA_CreatePasswordHandle(password_handle_t *password_handle,
@@ -189,18 +554,21 @@ static TEE_Result TA_CreatePasswordHandle(password_handle_t *password_handle,
 		uint32_t password_length)
 {
 	password_handle_t pw_handle;
-	const uint32_t metadata_length = sizeof(pw_handle.user_id) +
-		sizeof(pw_handle.flags) +
-		sizeof(pw_handle.version);
-	uint8_t to_sign[password_length + metadata_length];
+	const uint32_t iterations = TA_HandleKdfIterations(handle_version,
+			flags);
 
-	TEE_ObjectHandle masterKey = TEE_HANDLE_NULL;
+	ta_mac_t op;
+	uint64_t start;
 	TEE_Result res;
 
-	res = TEE_AllocateTransientObject(TEE_TYPE_HMAC_SHA256,
-			HMAC_SHA256_KEY_SIZE_BIT, &masterKey);
+	if (!iterations) {
+		EMSG("Wrong KDF iterations");
+		res = TEE_ERROR_BAD_PARAMETERS;
+		goto exit;
+	}
+
+	res = TA_GetMasterOperation(&op);
 	if (res != TEE_SUCCESS) {
-		EMSG("Failed to allocate password key");
 		goto exit;
 	}
 
@@ -210,58 +578,62 @@ static TEE_Result TA_CreatePasswordHandle(password_handle_t *password_handle,
 	pw_handle.flags = flags;
 	pw_handle.hardware_backed = true;
 
-	memcpy(to_sign, &pw_handle, metadata_length);
-	memcpy(to_sign + metadata_length, password, password_length);
-
-	res = TA_GetMasterKey(masterKey);
-	if (res != TEE_SUCCESS) {
-		EMSG("Failed to get master key");
-		goto free_key;
-	}
-
+	start = StageStart();
 	res = TA_ComputePasswordSignature(pw_handle.signature,
-			sizeof(pw_handle.signature), masterKey,
-			to_sign, sizeof(to_sign), salt);
+			sizeof(pw_handle.signature), op,
+			&pw_handle, HANDLE_METADATA_LENGTH,
+			password, password_length, salt, iterations);
+	StageEnd(STAGE_PASSWORD_MAC, start);
 	if (res != TEE_SUCCESS) {
 		EMSG("Failed to compute password signature");
-		goto free_key;
+		goto exit;
 	}
 
 	memcpy(password_handle, &pw_handle, sizeof(pw_handle));
 
-free_key:
-	TEE_FreeTransientObject(masterKey);
 exit:
 	return res;
 }
 
-static TEE_Result TA_GetAuthTokenKey(TEE_ObjectHandle key)
+static void TA_CloseKeymaster(void)
 {
-	TEE_Result		res;
+	if (keymaster_sess != TEE_HANDLE_NULL) {
+		TEE_CloseTASession(keymaster_sess);
+		keymaster_sess = TEE_HANDLE_NULL;
+	}
+}
+
+/*
+ * Asks keymaster for the auth token key, opens the session if needed.
+ * Session is closed on failure, so the next request starts over.
+ */
+static TEE_Result TA_RequestAuthTokenKey(uint8_t *key_data, uint32_t size)
+{
+	TEE_Result		res = TEE_SUCCESS;
 
 	uint8_t			dummy[HMAC_SHA256_KEY_SIZE_BYTE];
-	uint8_t			authTokenKeyData[HMAC_SHA256_KEY_SIZE_BYTE];
 	uint32_t		paramTypes;
 	TEE_Param		params[TEE_NUM_PARAMS];
-	TEE_TASessionHandle	sess;
 	uint32_t 		returnOrigin;
 	const TEE_UUID		uuid = TA_KEYMASTER_UUID;
-	TEE_Attribute		attrs[1];
-
 
-	DMSG("Connect to keymaster");
+	if (keymaster_sess == TEE_HANDLE_NULL) {
+		DMSG("Connect to keymaster");
 
-	paramTypes = TEE_PARAM_TYPES(TEE_PARAM_TYPE_NONE,
-				     TEE_PARAM_TYPE_NONE,
-				     TEE_PARAM_TYPE_NONE,
-				     TEE_PARAM_TYPE_NONE);
-	memset(params, 0, sizeof(params));
+		paramTypes = TEE_PARAM_TYPES(TEE_PARAM_TYPE_NONE,
+					     TEE_PARAM_TYPE_NONE,
+					     TEE_PARAM_TYPE_NONE,
+					     TEE_PARAM_TYPE_NONE);
+		memset(params, 0, sizeof(params));
 
-	res = TEE_OpenTASession(&uuid, TEE_TIMEOUT_INFINITE, paramTypes, params, &sess,
-			&returnOrigin);
-	if (res != TEE_SUCCESS) {
-		EMSG("Failed to connect to keymaster");
-		goto exit;
+		res = TEE_OpenTASession(&uuid, KEYMASTER_TIMEOUT_MS,
+				paramTypes, params, &keymaster_sess,
+				&returnOrigin);
+		if (res != TEE_SUCCESS) {
+			EMSG("Failed to connect to keymaster, error=%X", res);
+			keymaster_sess = TEE_HANDLE_NULL;
+			goto exit;
+		}
 	}
 
 	paramTypes = TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
@@ -273,34 +645,88 @@ static TEE_Result TA_GetAuthTokenKey(TEE_ObjectHandle key)
 	params[0].memref.buffer = dummy;
 	params[0].memref.size = sizeof(dummy);
 
-	params[1].memref.buffer = authTokenKeyData;
-	params[1].memref.size = sizeof(authTokenKeyData);
+	params[1].memref.buffer = key_data;
+	params[1].memref.size = size;
 
-	res = TEE_InvokeTACommand(sess, TEE_TIMEOUT_INFINITE, KM_GET_AUTHTOKEN_KEY,
-			paramTypes, params, &returnOrigin);
+	res = TEE_InvokeTACommand(keymaster_sess, KEYMASTER_TIMEOUT_MS,
+			KM_GET_AUTHTOKEN_KEY, paramTypes, params,
+			&returnOrigin);
 	if (res != TEE_SUCCESS) {
-		EMSG("Failed in keymaster");
+		EMSG("Failed in keymaster, error=%X", res);
 		goto close_sess;
 	}
 
-	if (params[1].memref.size != sizeof(authTokenKeyData)) {
+	if (params[1].memref.size != size) {
 		EMSG("Wrong auth_token key size");
 		res = TEE_ERROR_CORRUPT_OBJECT;
 		goto close_sess;
 	}
 
-	TEE_InitRefAttribute(&attrs[0], TEE_ATTR_SECRET_VALUE, authTokenKeyData,
-			sizeof(authTokenKeyData));
-	res = TEE_PopulateTransientObject(key, attrs,
-			sizeof(attrs)/sizeof(attrs[0]));
+	goto exit;
+
+close_sess:
+	TA_CloseKeymaster();
+exit:
+	return res;
+}
+
+static TEE_Result TA_GetAuthTokenKey(uint8_t *authTokenKeyData,
+		uint32_t size)
+{
+	TEE_Result		res;
+
+	res = TA_RequestAuthTokenKey(authTokenKeyData, size);
+	if (res == TEE_ERROR_TARGET_DEAD) {
+		DMSG("Keymaster session is dead, reconnect");
+		res = TA_RequestAuthTokenKey(authTokenKeyData, size);
+	}
+
+	return res;
+}
+
+/*
+ * Returns cached auth token operation, refreshing the key from keymaster
+ * when it is missing or older than AUTH_TOKEN_KEY_REFRESH_MS. Failed
+ * refresh keeps the cached key until the next period.
+ */
+static TEE_Result TA_GetAuthTokenOperation(ta_mac_t *op)
+{
+	uint8_t authTokenKeyData[HMAC_SHA256_KEY_SIZE_BYTE];
+	ta_mac_t new_op = TA_MAC_NULL;
+	TEE_Result res = TEE_SUCCESS;
+	uint64_t now = GetTimestamp();
+	uint64_t start;
+
+	if (auth_token_op != TA_MAC_NULL &&
+			now - auth_token_key_timestamp < AUTH_TOKEN_KEY_REFRESH_MS)
+		goto exit;
+
+	start = StageStart();
+	res = TA_GetAuthTokenKey(authTokenKeyData, sizeof(authTokenKeyData));
+	StageEnd(STAGE_KEYMASTER, start);
 	if (res != TEE_SUCCESS) {
-		EMSG("Failed to set auth_token key attributes");
-		goto close_sess;
+		EMSG("Failed to get auth_token key from keymaster");
+		goto check_cached;
 	}
 
-close_sess:
-	TEE_CloseTASession(sess);
+	res = TA_AllocateSignOperation(&new_op, authTokenKeyData,
+			sizeof(authTokenKeyData));
+	if (res == TEE_SUCCESS) {
+		TA_FreeSignOperation(&auth_token_op);
+		auth_token_op = new_op;
+	}
+
+check_cached:
+	memset(authTokenKeyData, 0, sizeof(authTokenKeyData));
+	if (res != TEE_SUCCESS && auth_token_op != TA_MAC_NULL) {
+		EMSG("Keep cached auth_token key");
+		res = TEE_SUCCESS;
+	}
+	if (res == TEE_SUCCESS) {
+		auth_token_key_timestamp = now;
+	}
 exit:
+	*op = auth_token_op;
 	return res;
 }
 
@@ -310,7 +736,8 @@ static void TA_MintAuthToken(hw_auth_token_t *auth_token, int64_t timestamp,
 	TEE_Result		res;
 
 	hw_auth_token_t		token;
-	TEE_ObjectHandle	authTokenKey = TEE_HANDLE_NULL;
+	ta_mac_t		op;
+	uint64_t		start;
 
 	const uint8_t		*toSign = (const uint8_t *)&token;
 	const uint32_t		toSignLen = sizeof(token) - sizeof(token.hmac);
@@ -324,29 +751,21 @@ static void TA_MintAuthToken(hw_auth_token_t *auth_token, int64_t timestamp,
 	token.timestamp =  TEE_U64_TO_BIG_ENDIAN(timestamp);
 	memset(token.hmac, 0, sizeof(token.hmac));
 
-	res = TEE_AllocateTransientObject(TEE_TYPE_HMAC_SHA256,
-			HMAC_SHA256_KEY_SIZE_BIT, &authTokenKey);
+	res = TA_GetAuthTokenOperation(&op);
 	if (res != TEE_SUCCESS) {
-		EMSG("Failed to allocate auth_token key");
 		goto exit;
 	}
 
-	res = TA_GetAuthTokenKey(authTokenKey);
-	if (res != TEE_SUCCESS) {
-		EMSG("Failed to get auth_token key from keymaster");
-		goto free_key;
-	}
-
-	res = TA_ComputeSignature(token.hmac, sizeof(token.hmac), authTokenKey,
+	start = StageStart();
+	res = TA_ComputeSignature(token.hmac, sizeof(token.hmac), op,
 			toSign, toSignLen);
+	StageEnd(STAGE_MINT, start);
 	if (res != TEE_SUCCESS) {
 		EMSG("Failed to compute auth_token signature");
 		memset(token.hmac, 0, sizeof(token.hmac));
-		goto free_key;
+		goto exit;
 	}
 
-free_key:
-	TEE_FreeTransientObject(authTokenKey);
 exit:
 	memcpy(auth_token, &token, sizeof(token));
 }
@@ -381,71 +800,42 @@ exit:
 	return res;
 }
 
-static TEE_Result TA_Enroll(TEE_Param params[TEE_NUM_PARAMS])
+/*
+ * Set response size from the end of encoded response, @end is NULL if
+ * the response did not fit
+ */
+static TEE_Result TA_SerializeResponse(TEE_Param params[TEE_NUM_PARAMS],
+		const uint8_t *end)
 {
-	TEE_Result res = TEE_SUCCESS;
+	if (!end) {
+		EMSG("Wrong response buffer size");
+		return TEE_ERROR_SHORT_BUFFER;
+	}
 
-	/*
-	 * Enroll request layout
-	 * +--------------------------------+---------------------------------+
-	 * | Name                           | Number of bytes                 |
-	 * +--------------------------------+---------------------------------+
-	 * | uid                            | 4                               |
-	 * | desired_password_length        | 4                               |
-	 * | desired_password               | #desired_password_length        |
-	 * | current_password_length        | 4                               |
-	 * | current_password               | #current_password_length        |
-	 * | current_password_handle_length | 4                               |
-	 * | current_password_handle        | #current_password_handle_length |
-	 * +--------------------------------+---------------------------------+
-	 */
-	uint32_t uid;
-	uint32_t desired_password_length;
-	const uint8_t *desired_password;
-	uint32_t current_password_length;
-	const uint8_t *current_password;
-	uint32_t current_password_handle_length;
-	const uint8_t *current_password_handle;
+	params[1].memref.size = get_size(params[1].memref.buffer, end);
+	return TEE_SUCCESS;
+}
 
-	const uint8_t *request = (const uint8_t *)params[0].memref.buffer;
-	const uint8_t *i_req = request;
+static TEE_Result TA_Enroll(TEE_Param params[TEE_NUM_PARAMS])
+{
+	TEE_Result res = TEE_SUCCESS;
 
-	/*
-	 * Enroll response layout
-	 * +--------------------------------+---------------------------------+
-	 * | Name                           | Number of bytes                 |
-	 * +--------------------------------+---------------------------------+
-	 * | error                          | 4                               |
-	 * +--------------------------------+---------------------------------+
-	 * | timeout                        | 4                               |
-	 * +------------------------------ OR --------------------------------+
-	 * | password_handle_length         | 4                               |
-	 * | password_handle                | #password_handle_length         |
-	 * +--------------------------------+---------------------------------+
-	 */
-	uint32_t error = ERROR_NONE;
-	uint32_t timeout = 0;
+	/* Layouts are defined by GK_ENROLL_REQUEST/RESPONSE in gatekeeper_ipc.h */
+	gk_enroll_request_t req;
+	gk_enroll_response_t rsp;
 	password_handle_t password_handle;
 
-	uint8_t *response = params[1].memref.buffer;
-	uint8_t *i_resp = response;
-
-	const uint32_t max_response_size = sizeof(uint32_t) +
-		sizeof(uint32_t) +
-		sizeof(password_handle_t);
+	const uint32_t max_response_size = GK_ENROLL_RESPONSE_SIZE;
 
 	secure_id_t user_id = 0;
 	uint64_t flags = 0;
 	salt_t salt;
 
-	deserialize_int(&i_req, &uid);
-	deserialize_blob(&i_req, &desired_password, &desired_password_length);
-	deserialize_blob(&i_req, &current_password, &current_password_length);
-	deserialize_blob(&i_req, &current_password_handle,
-			&current_password_handle_length);
+	rsp.error = ERROR_NONE;
+	rsp.retry_timeout = 0;
 
-	// Check request buffer size
-	if (get_size(request, i_req) > params[0].memref.size) {
+	if (!gk_enroll_request_decode(&req, params[0].memref.buffer,
+				params[0].memref.size)) {
 		EMSG("Wrong request buffer size");
 		res = TEE_ERROR_BAD_PARAMETERS;
 		goto exit;
@@ -458,15 +848,24 @@ static TEE_Result TA_Enroll(TEE_Param params[TEE_NUM_PARAMS])
 		goto exit;
 	}
 
+	// New handle gets KDF cost of this device
+	res = TA_LoadKdf();
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to load KDF calibration");
+		goto exit;
+	}
+	flags |= (uint64_t)kdf.iterations << HANDLE_FLAG_KDF_ITERATIONS_SHIFT;
+
 	// Check password handle length
-	if (current_password_handle_length != 0 &&
-			current_password_handle_length != sizeof(password_handle_t)) {
+	if (req.current_password_handle.length != 0 &&
+			req.current_password_handle.length !=
+			sizeof(password_handle_t)) {
 		EMSG("Wrong password handle size");
 		res = TEE_ERROR_BAD_PARAMETERS;
 		goto exit;
 	}
 
-	if (!current_password_handle_length) {
+	if (!req.current_password_handle.length) {
 		// Password handle does not match what is stored, generate new
 		// secure user_id
 		TEE_GenerateRandom(&user_id, sizeof(user_id));
@@ -474,15 +873,24 @@ static TEE_Result TA_Enroll(TEE_Param params[TEE_NUM_PARAMS])
 		uint64_t timestamp;
 		bool throttle;
 
-		password_handle_t *pw_handle =
-			(password_handle_t *)current_password_handle;
+		const password_handle_t *pw_handle =
+			(const password_handle_t *)req.current_password_handle.data;
 		if (pw_handle->version > HANDLE_VERSION) {
 			EMSG("Wrong handle version %u, required version is %u",
 					pw_handle->version, HANDLE_VERSION);
-			error = ERROR_INVALID;
+			rsp.error = ERROR_INVALID;
 			goto serialize_response;
 		}
 
+		// forged handle must not make us run an unbounded KDF, and
+		// is not a wrong password to count
+		if (!TA_HandleKdfIterations(pw_handle->version,
+					pw_handle->flags)) {
+			EMSG("Wrong KDF iterations");
+			res = TEE_ERROR_BAD_PARAMETERS;
+			goto exit;
+		}
+
 		user_id = pw_handle->user_id;
 		timestamp = GetTimestamp();
 
@@ -492,28 +900,37 @@ static TEE_Result TA_Enroll(TEE_Param params[TEE_NUM_PARAMS])
 			flags |= HANDLE_FLAG_THROTTLE_SECURE;
 			GetFailureRecord(user_id, &record);
 
-			if (ThrottleRequest(&record, timestamp, &timeout)) {
-				error = ERROR_RETRY;
+			if (ThrottleRequest(&record, timestamp,
+						&rsp.retry_timeout)) {
+				rsp.error = ERROR_RETRY;
 				goto serialize_response;
 			}
 
-			IncrementFailureRecord(&record, timestamp);
+			record.uid = req.uid;
+			res = IncrementFailureRecord(&record, timestamp);
+			if (res != TEE_SUCCESS) {
+				EMSG("Failed to count attempt");
+				goto exit;
+			}
 		}
 
-		res = TA_DoVerify(pw_handle, current_password,
-				current_password_length);
+		res = TA_DoVerify(pw_handle, req.current_password.data,
+				req.current_password.length);
 		switch (res) {
 		case TEE_TRUE:
 			break;
 		case TEE_FALSE:
-			if (throttle && timeout > 0) {
-				error = ERROR_RETRY;
+			res = TEE_SUCCESS;
+			if (throttle && rsp.retry_timeout > 0) {
+				rsp.error = ERROR_RETRY;
 			} else {
-				error = ERROR_INVALID;
+				rsp.error = ERROR_INVALID;
 			}
 			goto serialize_response;
 		default:
 			EMSG("Failed to verify password handle");
+			/* Attempt stays counted if the check was cancelled */
+			CommitFailureRecords();
 			goto exit;
 		}
 	}
@@ -522,133 +939,77 @@ static TEE_Result TA_Enroll(TEE_Param params[TEE_NUM_PARAMS])
 
 	TEE_GenerateRandom(&salt, sizeof(salt));
 	res = TA_CreatePasswordHandle(&password_handle, salt, user_id, flags,
-			HANDLE_VERSION, desired_password,
-			desired_password_length);
+			HANDLE_VERSION, req.desired_password.data,
+			req.desired_password.length);
 	if (res != TEE_SUCCESS) {
 		EMSG("Failed to create password handle");
 		goto exit;
 	}
+	rsp.password_handle.data = (const uint8_t *)&password_handle;
+	rsp.password_handle.length = sizeof(password_handle);
 
 serialize_response:
-	serialize_int(&i_resp, error);
-	switch (error) {
-	case ERROR_INVALID:
-	case ERROR_UNKNOWN:
-		break;
-	case ERROR_RETRY:
-		serialize_int(&i_resp, timeout);
-		break;
-	case ERROR_NONE:
-		serialize_blob(&i_resp, (const uint8_t *)&password_handle,
-				sizeof(password_handle));
-		break;
-	default:
-		EMSG("Unknown error message!");
-		res = TEE_ERROR_GENERIC;
+	/* Counted attempt must be stored before its outcome leaves the TA */
+	res = CommitFailureRecords();
+	if (res != TEE_SUCCESS) {
+		goto exit;
 	}
-	params[1].memref.size = get_size(response, i_resp);
+
+	res = TA_SerializeResponse(params, gk_enroll_response_encode(
+				params[1].memref.buffer, params[1].memref.size,
+				&rsp));
 exit:
-	DMSG("Enroll returns 0x%08X, error = %d", res, error);
+	DMSG("Enroll returns 0x%08X, error = %d", res, rsp.error);
 	return res;
 }
 
-static TEE_Result TA_Verify(TEE_Param params[TEE_NUM_PARAMS])
+/*
+ * Verifies one decoded request and fills @rsp, @auth_token keeps the token
+ * @rsp points to. Returns error only if the TA failed to do the check.
+ */
+static TEE_Result TA_VerifyOne(const gk_verify_request_t *req,
+		gk_verify_response_t *rsp, hw_auth_token_t *auth_token)
 {
 	TEE_Result res = TEE_SUCCESS;
 
-	/*
-	 * Verify request layout
-	 * +---------------------------------+----------------------------------+
-	 * | Name                            | Number of bytes                  |
-	 * +---------------------------------+----------------------------------+
-	 * | uid                             | 4                                |
-	 * | challenge                       | 8                                |
-	 * | enrolled_password_handle_length | 4                                |
-	 * | enrolled_password_handle        | #enrolled_password_handle_length |
-	 * | provided_password_length        | 4                                |
-	 * | provided_password               | #provided_password_length        |
-	 * +---------------------------------+----------------------------------+
-	 */
-	uint32_t uid;
-	uint64_t challenge;
-	uint32_t enrolled_password_handle_length;
-	const uint8_t *enrolled_password_handle;
-	uint32_t provided_password_length;
-	const uint8_t *provided_password;
-
-	const uint8_t *request = (const uint8_t *)params[0].memref.buffer;
-	const uint8_t *i_req = request;
-
-	/*
-	 * Verify response layout
-	 * +--------------------------------+---------------------------------+
-	 * | Name                           | Number of bytes                 |
-	 * +--------------------------------+---------------------------------+
-	 * | error                          | 4                               |
-	 * +--------------------------------+---------------------------------+
-	 * | retry_timeout                  | 4                               |
-	 * +------------------------------ OR --------------------------------+
-	 * | response_auth_token_length     | 4                               |
-	 * | response_auth_token            | #response_handle_length         |
-	 * | response_request_reenroll      | 4                               |
-	 * +--------------------------------+---------------------------------+
-	 */
-	uint32_t error = ERROR_NONE;
-	uint32_t timeout = 0;
-	hw_auth_token_t auth_token;
-	bool request_reenroll = false;
-
-	uint8_t *response = params[1].memref.buffer;
-	uint8_t *i_resp = response;
-
-	const uint32_t max_response_size = sizeof(uint32_t) +
-		sizeof(uint32_t) +
-		sizeof(password_handle_t) +
-		sizeof(uint32_t);
-
-	password_handle_t *password_handle;
+	const password_handle_t *password_handle;
 	secure_id_t user_id;
 	secure_id_t authenticator_id = 0;
 
 	uint64_t timestamp = GetTimestamp();
+	uint32_t iterations;
 	bool throttle;
 
-	deserialize_int(&i_req, &uid);
-	deserialize_int64(&i_req, &challenge);
-	deserialize_blob(&i_req, &enrolled_password_handle,
-			&enrolled_password_handle_length);
-	deserialize_blob(&i_req, &provided_password,
-			&provided_password_length);
-
-	// Check request buffer size
-	if (get_size(request, i_req) > params[0].memref.size) {
-		EMSG("Wrong request buffer size");
-		res = TEE_ERROR_BAD_PARAMETERS;
-		goto exit;
-	}
-
-	// Check response buffer size
-	if (max_response_size > params[1].memref.size) {
-		EMSG("Wrong response buffer size");
-		res = TEE_ERROR_BAD_PARAMETERS;
-		goto exit;
-	}
+	rsp->error = ERROR_NONE;
+	rsp->retry_timeout = 0;
+	rsp->auth_token.data = NULL;
+	rsp->auth_token.length = 0;
+	rsp->request_reenroll = false;
 
 	// Check password handle length
-	if (enrolled_password_handle_length == 0 ||
-			enrolled_password_handle_length != sizeof(password_handle_t)) {
+	if (req->enrolled_password_handle.length != sizeof(password_handle_t)) {
 		EMSG("Wrong password handle size");
 		res = TEE_ERROR_BAD_PARAMETERS;
 		goto exit;
 	}
 
-	password_handle = (password_handle_t *)enrolled_password_handle;
+	password_handle =
+		(const password_handle_t *)req->enrolled_password_handle.data;
 
 	if (password_handle->version > HANDLE_VERSION) {
 		EMSG("Wrong handle version %u, required version is %u",
 				password_handle->version, HANDLE_VERSION);
-		error = ERROR_INVALID;
-		goto serialize_response;
+		rsp->error = ERROR_INVALID;
+		goto exit;
+	}
+
+	// forged handle must not make us run an unbounded KDF, and is not
+	// a wrong password to count
+	if (!TA_HandleKdfIterations(password_handle->version,
+				password_handle->flags)) {
+		EMSG("Wrong KDF iterations");
+		res = TEE_ERROR_BAD_PARAMETERS;
+		goto exit;
 	}
 
 	user_id = password_handle->user_id;
@@ -658,61 +1019,369 @@ static TEE_Result TA_Verify(TEE_Param params[TEE_NUM_PARAMS])
 		failure_record_t record;
 		GetFailureRecord(user_id, &record);
 
-		if (ThrottleRequest(&record, timestamp, &timeout)) {
-			error = ERROR_RETRY;
-			goto serialize_response;
+		if (ThrottleRequest(&record, timestamp, &rsp->retry_timeout)) {
+			rsp->error = ERROR_RETRY;
+			goto exit;
 		}
 
-		IncrementFailureRecord(&record, timestamp);
+		record.uid = req->uid;
+		res = IncrementFailureRecord(&record, timestamp);
+		if (res != TEE_SUCCESS) {
+			EMSG("Failed to count attempt");
+			goto exit;
+		}
 	} else {
-		request_reenroll = true;
+		rsp->request_reenroll = true;
 	}
 
-	res = TA_DoVerify(password_handle, provided_password,
-			provided_password_length);
+	res = TA_DoVerify(password_handle, req->provided_password.data,
+			req->provided_password.length);
 	switch (res) {
 	case TEE_TRUE:
-		TA_MintAuthToken(&auth_token, timestamp, user_id,
-				authenticator_id, challenge);
+		TA_MintAuthToken(auth_token, timestamp, user_id,
+				authenticator_id, req->challenge);
+		// migrate old handles and handles cheaper than calibrated
+		iterations = TA_HandleKdfIterations(password_handle->version,
+				password_handle->flags);
+		if (password_handle->version < HANDLE_VERSION ||
+				iterations < kdf.iterations) {
+			rsp->request_reenroll = true;
+		}
 		if (throttle) {
 			ClearFailureRecord(user_id);
 		}
-		goto serialize_response;
+		rsp->auth_token.data = (const uint8_t *)auth_token;
+		rsp->auth_token.length = sizeof(*auth_token);
+		break;
 	case TEE_FALSE:
-		if (throttle && timeout > 0) {
-			error = ERROR_RETRY;
+		res = TEE_SUCCESS;
+		if (throttle && rsp->retry_timeout > 0) {
+			rsp->error = ERROR_RETRY;
 		} else {
-			error = ERROR_INVALID;
+			rsp->error = ERROR_INVALID;
 		}
-		goto serialize_response;
+		break;
 	default:
 		EMSG("Failed to verify password handle");
+		break;
+	}
+
+exit:
+	return res;
+}
+
+static TEE_Result TA_Verify(TEE_Param params[TEE_NUM_PARAMS])
+{
+	TEE_Result res = TEE_SUCCESS;
+	TEE_Result commit_res;
+
+	/* Layouts are defined by GK_VERIFY_REQUEST/RESPONSE in gatekeeper_ipc.h */
+	gk_verify_request_t req;
+	gk_verify_response_t rsp;
+	hw_auth_token_t auth_token;
+
+	const uint32_t max_response_size = GK_VERIFY_RESPONSE_SIZE;
+
+	rsp.error = ERROR_NONE;
+
+	if (!gk_verify_request_decode(&req, params[0].memref.buffer,
+				params[0].memref.size)) {
+		EMSG("Wrong request buffer size");
+		res = TEE_ERROR_BAD_PARAMETERS;
 		goto exit;
 	}
 
-serialize_response:
-	serialize_int(&i_resp, error);
-	switch (error) {
-	case ERROR_INVALID:
-	case ERROR_UNKNOWN:
-		break;
-	case ERROR_RETRY:
-		serialize_int(&i_resp, timeout);
-		break;
-	case ERROR_NONE:
-		serialize_blob(&i_resp, (uint8_t *)&auth_token, sizeof(auth_token));
-		serialize_int(&i_resp, (uint32_t) request_reenroll);
-		break;
-	default:
-		EMSG("Unknown error message!");
-		res = TEE_ERROR_GENERIC;
+	// Check response buffer size
+	if (max_response_size > params[1].memref.size) {
+		EMSG("Wrong response buffer size");
+		res = TEE_ERROR_BAD_PARAMETERS;
+		goto exit;
+	}
+
+	res = TA_VerifyOne(&req, &rsp, &auth_token);
+
+	/*
+	 * Counted attempt must be stored before its outcome leaves, also
+	 * when the check was cancelled
+	 */
+	commit_res = CommitFailureRecords();
+	if (res == TEE_SUCCESS) {
+		res = commit_res;
+	}
+	if (res != TEE_SUCCESS) {
+		goto exit;
+	}
+
+	res = TA_SerializeResponse(params, gk_verify_response_encode(
+				params[1].memref.buffer, params[1].memref.size,
+				&rsp));
+exit:
+	DMSG("Verify returns 0x%08X, error = %d", res, rsp.error);
+	return res;
+}
+
+/*
+ * Outcomes of a verify batch. The instance runs one command at a time, so
+ * they live here rather than on the 2 KiB TA stack.
+ */
+static gk_verify_response_t batchResponses[GK_VERIFY_BATCH_MAX];
+static hw_auth_token_t batchTokens[GK_VERIFY_BATCH_MAX];
+
+static TEE_Result TA_VerifyBatch(TEE_Param params[TEE_NUM_PARAMS])
+{
+	TEE_Result res = TEE_SUCCESS;
+	TEE_Result commit_res;
+
+	/*
+	 * GK_VERIFY_BATCH_REQUEST header and GK_VERIFY_REQUEST messages in,
+	 * GK_VERIFY_RESPONSE messages out, see gatekeeper_ipc.h
+	 */
+	gk_verify_batch_request_t header;
+	gk_verify_request_t req;
+	gk_verify_response_t *rsp = batchResponses;
+	hw_auth_token_t *auth_token = batchTokens;
+
+	const uint8_t *request = params[0].memref.buffer;
+	uint32_t request_left = params[0].memref.size;
+	uint8_t *response = params[1].memref.buffer;
+	uint32_t response_left = params[1].memref.size;
+	uint32_t consumed;
+	uint32_t i;
+
+
+	if (!gk_verify_batch_request_decode(&header, request, request_left) ||
+			header.count == 0 ||
+			header.count > GK_VERIFY_BATCH_MAX) {
+		EMSG("Wrong batch header");
+		res = TEE_ERROR_BAD_PARAMETERS;
+		goto exit;
 	}
-	params[1].memref.size = get_size(response, i_resp);
+	consumed = gk_verify_batch_request_size(&header);
+	request += consumed;
+	request_left -= consumed;
+
+	// Check response buffer size
+	if (header.count * GK_VERIFY_RESPONSE_SIZE > response_left) {
+		EMSG("Wrong response buffer size");
+		res = TEE_ERROR_BAD_PARAMETERS;
+		goto exit;
+	}
+
+	for (i = 0; i < header.count; i++) {
+		if (!gk_verify_request_decode(&req, request, request_left)) {
+			EMSG("Wrong request %u of batch", i);
+			res = TEE_ERROR_BAD_PARAMETERS;
+			goto exit;
+		}
+		consumed = gk_verify_request_size(&req);
+		request += consumed;
+		request_left -= consumed;
+
+		/* Cancellation ends the batch, it is out of time */
+		res = TA_VerifyOne(&req, &rsp[i], &auth_token[i]);
+		if (res == TEE_ERROR_CANCEL) {
+			break;
+		}
+
+		/* Failure of one entry must not fail others */
+		if (res != TEE_SUCCESS) {
+			rsp[i].error = ERROR_UNKNOWN;
+			res = TEE_SUCCESS;
+		}
+	}
+
+	/*
+	 * Attempts of the whole batch are stored with one write, before any
+	 * outcome reaches the shared response buffer
+	 */
+	commit_res = CommitFailureRecords();
+	if (res == TEE_SUCCESS) {
+		res = commit_res;
+	}
+	if (res != TEE_SUCCESS) {
+		goto exit;
+	}
+
+	for (i = 0; i < header.count; i++) {
+		uint8_t *end = gk_verify_response_encode(response,
+				response_left, &rsp[i]);
+		if (!end) {
+			EMSG("Wrong response buffer size");
+			res = TEE_ERROR_SHORT_BUFFER;
+			goto exit;
+		}
+		response_left -= get_size(response, end);
+		response = end;
+	}
+
+	res = TA_SerializeResponse(params, response);
 exit:
-	DMSG("Verify returns 0x%08X, error = %d", res, error);
+	memset(batchTokens, 0, sizeof(batchTokens));
+	DMSG("Verify batch returns 0x%08X", res);
 	return res;
 }
 
+static TEE_Result TA_WarmUp(TEE_Param params[TEE_NUM_PARAMS])
+{
+	TEE_Result res;
+
+	/* Request is empty, response is GK_WARMUP_RESPONSE */
+	gk_warmup_response_t rsp;
+
+	ta_mac_t op;
+	uint8_t signature[HMAC_SHA256_KEY_SIZE_BYTE];
+	const uint8_t message[] = {0};
+
+	if (GK_WARMUP_RESPONSE_SIZE > params[1].memref.size) {
+		EMSG("Wrong response buffer size");
+		return TEE_ERROR_BAD_PARAMETERS;
+	}
+
+	rsp.error = ERROR_NONE;
+	rsp.retry_timeout = 0;
+	rsp.kdf_iterations = 0;
+	rsp.kdf_cost_us = 0;
+
+	/*
+	 * Pull master key object, HMAC operation and keymaster TA in now, so
+	 * first enroll or verify after boot does not pay for them
+	 */
+	res = TA_GetMasterOperation(&op);
+	if (res == TEE_SUCCESS) {
+		res = TA_ComputeSignature(signature, sizeof(signature), op,
+				message, sizeof(message));
+	}
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to warm up master key, error=%X", res);
+		rsp.error = ERROR_UNKNOWN;
+	}
+
+	res = TA_GetAuthTokenOperation(&op);
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to warm up keymaster, error=%X", res);
+		rsp.error = ERROR_UNKNOWN;
+	}
+
+	/* First boot calibrates the KDF here rather than in first enroll */
+	res = TA_LoadKdf();
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to warm up KDF, error=%X", res);
+		rsp.error = ERROR_UNKNOWN;
+	}
+	rsp.kdf_iterations = kdf.iterations;
+	rsp.kdf_cost_us = kdf.cost_us;
+
+	res = TA_SerializeResponse(params, gk_warmup_response_encode(
+				params[1].memref.buffer, params[1].memref.size,
+				&rsp));
+
+	DMSG("Warm-up returns error = %d", rsp.error);
+	return res;
+}
+
+static TEE_Result TA_DeleteUser(TEE_Param params[TEE_NUM_PARAMS])
+{
+	TEE_Result res = TEE_SUCCESS;
+
+	/* Layouts are defined by GK_DELETE_USER_REQUEST/RESPONSE */
+	gk_delete_user_request_t req;
+	gk_delete_user_response_t rsp;
+
+	rsp.error = ERROR_NONE;
+	rsp.retry_timeout = 0;
+
+	if (!gk_delete_user_request_decode(&req, params[0].memref.buffer,
+				params[0].memref.size)) {
+		EMSG("Wrong request buffer size");
+		res = TEE_ERROR_BAD_PARAMETERS;
+		goto exit;
+	}
+
+	if (GK_DELETE_USER_RESPONSE_SIZE > params[1].memref.size) {
+		EMSG("Wrong response buffer size");
+		res = TEE_ERROR_BAD_PARAMETERS;
+		goto exit;
+	}
+
+	DeleteUserFailureRecords(req.uid);
+	res = CommitFailureRecords();
+	if (res != TEE_SUCCESS) {
+		goto exit;
+	}
+
+	res = TA_SerializeResponse(params, gk_delete_user_response_encode(
+				params[1].memref.buffer, params[1].memref.size,
+				&rsp));
+exit:
+	DMSG("Delete user returns 0x%08X", res);
+	return res;
+}
+
+static TEE_Result TA_DeleteAllUsers(TEE_Param params[TEE_NUM_PARAMS])
+{
+	TEE_Result res = TEE_SUCCESS;
+
+	/* Request is empty, response is GK_DELETE_ALL_USERS_RESPONSE */
+	gk_delete_all_users_response_t rsp;
+
+	rsp.error = ERROR_NONE;
+	rsp.retry_timeout = 0;
+
+	if (GK_DELETE_ALL_USERS_RESPONSE_SIZE > params[1].memref.size) {
+		EMSG("Wrong response buffer size");
+		res = TEE_ERROR_BAD_PARAMETERS;
+		goto exit;
+	}
+
+	DeleteAllFailureRecords();
+	res = CommitFailureRecords();
+	if (res != TEE_SUCCESS) {
+		goto exit;
+	}
+
+	res = TA_SerializeResponse(params,
+			gk_delete_all_users_response_encode(
+				params[1].memref.buffer, params[1].memref.size,
+				&rsp));
+exit:
+	DMSG("Delete all users returns 0x%08X", res);
+	return res;
+}
+
+static TEE_Result TA_GetStats(TEE_Param params[TEE_NUM_PARAMS])
+{
+	/* Request is empty, response is GK_GET_STATS_RESPONSE */
+	gk_get_stats_response_t rsp;
+
+	if (GK_GET_STATS_RESPONSE_SIZE > params[1].memref.size) {
+		EMSG("Wrong response buffer size");
+		return TEE_ERROR_BAD_PARAMETERS;
+	}
+
+	rsp.error = ERROR_NONE;
+	rsp.retry_timeout = 0;
+	rsp.master_key_count = ta_stats.count[STAGE_MASTER_KEY];
+	rsp.master_key_ms = ta_stats.time_ms[STAGE_MASTER_KEY];
+	rsp.password_mac_count = ta_stats.count[STAGE_PASSWORD_MAC];
+	rsp.password_mac_ms = ta_stats.time_ms[STAGE_PASSWORD_MAC];
+	rsp.keymaster_count = ta_stats.count[STAGE_KEYMASTER];
+	rsp.keymaster_ms = ta_stats.time_ms[STAGE_KEYMASTER];
+	rsp.mint_count = ta_stats.count[STAGE_MINT];
+	rsp.mint_ms = ta_stats.time_ms[STAGE_MINT];
+	rsp.record_read_count = ta_stats.count[STAGE_RECORD_READ];
+	rsp.record_read_ms = ta_stats.time_ms[STAGE_RECORD_READ];
+	rsp.record_write_count = ta_stats.count[STAGE_RECORD_WRITE];
+	rsp.record_write_ms = ta_stats.time_ms[STAGE_RECORD_WRITE];
+	rsp.throttled = ta_stats.throttled;
+	rsp.lockouts = ta_stats.lockouts;
+	rsp.records = CountFailureRecords();
+	rsp.record_capacity = MAX_FAILURE_RECORDS;
+
+	return TA_SerializeResponse(params, gk_get_stats_response_encode(
+				params[1].memref.buffer, params[1].memref.size,
+				&rsp));
+}
+
 TEE_Result TA_InvokeCommandEntryPoint(void *sess_ctx, uint32_t cmd_id,
 			uint32_t param_types, TEE_Param params[TEE_NUM_PARAMS])
 {
@@ -725,11 +1394,32 @@ TEE_Result TA_InvokeCommandEntryPoint(void *sess_ctx, uint32_t cmd_id,
 
 	DMSG("Gatekeeper TA invoke command cmd_id %u", cmd_id);
 
+	/*
+	 * Loaded once, retried here if session open could not load it.
+	 * Stats must come through even if secure storage is broken.
+	 */
+	if (cmd_id != GK_WARMUP && cmd_id != GK_GET_STATS) {
+		TEE_Result res = LoadFailureRecords();
+		if (res != TEE_SUCCESS) {
+			return res;
+		}
+	}
+
 	switch (cmd_id) {
 	case GK_ENROLL:
 		return TA_Enroll(params);
 	case GK_VERIFY:
 		return TA_Verify(params);
+	case GK_WARMUP:
+		return TA_WarmUp(params);
+	case GK_VERIFY_BATCH:
+		return TA_VerifyBatch(params);
+	case GK_DELETE_USER:
+		return TA_DeleteUser(params);
+	case GK_DELETE_ALL_USERS:
+		return TA_DeleteAllUsers(params);
+	case GK_GET_STATS:
+		return TA_GetStats(params);
 	default:
 		return TEE_ERROR_BAD_PARAMETERS;
 	}
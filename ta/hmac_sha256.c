@@ -0,0 +1,416 @@
+/*
+ *
+ * Copyright (C) 2017 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include "hmac_sha256.h"
+
+/*
+ * Compression function is picked at build time for the TA: ARMv8 SHA-256
+ * instructions if the compiler targets them, portable C otherwise. Host
+ * builds on x86 switch to SHA extensions at load time if the CPU has them.
+ */
+#if defined(__aarch64__) && \
+	(defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO))
+#define SHA256_ARMV8_CE
+#include <arm_neon.h>
+#elif (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define SHA256_X86_SHA
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+static const uint32_t sha256_iv[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static uint32_t LoadBe32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+		(uint32_t)p[2] << 8 | p[3];
+}
+
+static void StoreBe32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define CH(x, y, z) (((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x, y, z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define BSIG0(x) (ROTR(x, 2) ^ ROTR(x, 13) ^ ROTR(x, 22))
+#define BSIG1(x) (ROTR(x, 6) ^ ROTR(x, 11) ^ ROTR(x, 25))
+#define SSIG0(x) (ROTR(x, 7) ^ ROTR(x, 18) ^ ((x) >> 3))
+#define SSIG1(x) (ROTR(x, 17) ^ ROTR(x, 19) ^ ((x) >> 10))
+
+static void Sha256BlocksPortable(uint32_t state[8], const uint8_t *data,
+		size_t blocks)
+{
+	uint32_t w[64];
+	uint32_t s[8];
+	uint32_t t1;
+	uint32_t t2;
+	int i;
+
+	while (blocks--) {
+		for (i = 0; i < 16; i++) {
+			w[i] = LoadBe32(data + 4 * i);
+		}
+		for (i = 16; i < 64; i++) {
+			w[i] = SSIG1(w[i - 2]) + w[i - 7] +
+				SSIG0(w[i - 15]) + w[i - 16];
+		}
+
+		memcpy(s, state, sizeof(s));
+		for (i = 0; i < 64; i++) {
+			t1 = s[7] + BSIG1(s[4]) + CH(s[4], s[5], s[6]) +
+				sha256_k[i] + w[i];
+			t2 = BSIG0(s[0]) + MAJ(s[0], s[1], s[2]);
+			s[7] = s[6];
+			s[6] = s[5];
+			s[5] = s[4];
+			s[4] = s[3] + t1;
+			s[3] = s[2];
+			s[2] = s[1];
+			s[1] = s[0];
+			s[0] = t1 + t2;
+		}
+		for (i = 0; i < 8; i++) {
+			state[i] += s[i];
+		}
+
+		data += SHA256_BLOCK_SIZE;
+	}
+
+	memset(w, 0, sizeof(w));
+	memset(s, 0, sizeof(s));
+}
+
+#ifdef SHA256_ARMV8_CE
+/*
+ * Four rounds per step, message schedule runs three steps ahead
+ */
+static void Sha256BlocksArmv8(uint32_t state[8], const uint8_t *data,
+		size_t blocks)
+{
+	uint32x4_t abcd = vld1q_u32(&state[0]);
+	uint32x4_t efgh = vld1q_u32(&state[4]);
+	uint32x4_t abcd_save;
+	uint32x4_t efgh_save;
+	uint32x4_t msg[4];
+	uint32x4_t wk;
+	uint32x4_t prev;
+	int i;
+
+	while (blocks--) {
+		abcd_save = abcd;
+		efgh_save = efgh;
+
+		for (i = 0; i < 4; i++) {
+			msg[i] = vreinterpretq_u32_u8(
+					vrev32q_u8(vld1q_u8(data + 16 * i)));
+		}
+
+#pragma GCC unroll 16
+		for (i = 0; i < 16; i++) {
+			wk = vaddq_u32(msg[i & 3], vld1q_u32(&sha256_k[4 * i]));
+			if (i < 12) {
+				msg[i & 3] = vsha256su1q_u32(
+						vsha256su0q_u32(msg[i & 3],
+							msg[(i + 1) & 3]),
+						msg[(i + 2) & 3],
+						msg[(i + 3) & 3]);
+			}
+			prev = abcd;
+			abcd = vsha256hq_u32(abcd, efgh, wk);
+			efgh = vsha256h2q_u32(efgh, prev, wk);
+		}
+
+		abcd = vaddq_u32(abcd, abcd_save);
+		efgh = vaddq_u32(efgh, efgh_save);
+		data += SHA256_BLOCK_SIZE;
+	}
+
+	vst1q_u32(&state[0], abcd);
+	vst1q_u32(&state[4], efgh);
+}
+
+static void (*const Sha256Blocks)(uint32_t *, const uint8_t *, size_t) =
+	Sha256BlocksArmv8;
+static const char *const sha256_engine = "armv8-ce";
+#endif /* SHA256_ARMV8_CE */
+
+#ifdef SHA256_X86_SHA
+/*
+ * Four rounds per step, state is kept as ABEF and CDGH as the SHA
+ * instructions want it
+ */
+__attribute__((target("sha,sse4.1")))
+static void Sha256BlocksX86(uint32_t state[8], const uint8_t *data,
+		size_t blocks)
+{
+	const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+			0x0405060700010203ULL);
+	__m128i abef;
+	__m128i cdgh;
+	__m128i abef_save;
+	__m128i cdgh_save;
+	__m128i msg[4];
+	__m128i wk;
+	__m128i tmp;
+	int i;
+
+	tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]),
+			0xB1);
+	cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]),
+			0x1B);
+	abef = _mm_alignr_epi8(tmp, cdgh, 8);
+	cdgh = _mm_blend_epi16(cdgh, tmp, 0xF0);
+
+	while (blocks--) {
+		abef_save = abef;
+		cdgh_save = cdgh;
+
+		for (i = 0; i < 4; i++) {
+			msg[i] = _mm_shuffle_epi8(_mm_loadu_si128(
+					(const __m128i *)(data + 16 * i)), bswap);
+		}
+
+#pragma GCC unroll 16
+		for (i = 0; i < 16; i++) {
+			wk = _mm_add_epi32(msg[i & 3], _mm_loadu_si128(
+					(const __m128i *)&sha256_k[4 * i]));
+			cdgh = _mm_sha256rnds2_epu32(cdgh, abef, wk);
+			if (i >= 3 && i < 15) {
+				tmp = _mm_alignr_epi8(msg[i & 3],
+						msg[(i - 1) & 3], 4);
+				msg[(i + 1) & 3] = _mm_sha256msg2_epu32(
+						_mm_add_epi32(msg[(i + 1) & 3],
+							tmp), msg[i & 3]);
+			}
+			wk = _mm_shuffle_epi32(wk, 0x0E);
+			abef = _mm_sha256rnds2_epu32(abef, cdgh, wk);
+			if (i >= 1 && i < 13) {
+				msg[(i - 1) & 3] = _mm_sha256msg1_epu32(
+						msg[(i - 1) & 3], msg[i & 3]);
+			}
+		}
+
+		abef = _mm_add_epi32(abef, abef_save);
+		cdgh = _mm_add_epi32(cdgh, cdgh_save);
+		data += SHA256_BLOCK_SIZE;
+	}
+
+	tmp = _mm_shuffle_epi32(abef, 0x1B);
+	cdgh = _mm_shuffle_epi32(cdgh, 0xB1);
+	_mm_storeu_si128((__m128i *)&state[0],
+			_mm_blend_epi16(tmp, cdgh, 0xF0));
+	_mm_storeu_si128((__m128i *)&state[4],
+			_mm_alignr_epi8(cdgh, tmp, 8));
+}
+
+static void (*Sha256Blocks)(uint32_t *, const uint8_t *, size_t) =
+	Sha256BlocksPortable;
+static const char *sha256_engine = "portable";
+
+__attribute__((constructor))
+static void Sha256SelectEngine(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1)) {
+		return;
+	}
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) ||
+			!(ebx & bit_SHA)) {
+		return;
+	}
+
+	Sha256Blocks = Sha256BlocksX86;
+	sha256_engine = "x86-sha";
+}
+#endif /* SHA256_X86_SHA */
+
+#if !defined(SHA256_ARMV8_CE) && !defined(SHA256_X86_SHA)
+static void (*const Sha256Blocks)(uint32_t *, const uint8_t *, size_t) =
+	Sha256BlocksPortable;
+static const char *const sha256_engine = "portable";
+#endif
+
+/*
+ * Plain SHA-256 on top of hmac_sha256_ctx_t, started from @state after
+ * @length bytes already compressed into it
+ */
+static void Sha256Start(hmac_sha256_ctx_t *ctx, const uint32_t *state,
+		uint64_t length)
+{
+	memcpy(ctx->state, state, sizeof(ctx->state));
+	ctx->used = 0;
+	ctx->length = length;
+}
+
+static void Sha256Feed(hmac_sha256_ctx_t *ctx, const uint8_t *data,
+		size_t length)
+{
+	size_t blocks;
+	size_t n;
+
+	ctx->length += length;
+
+	if (ctx->used) {
+		n = SHA256_BLOCK_SIZE - ctx->used;
+		if (n > length) {
+			n = length;
+		}
+		memcpy(ctx->buffer + ctx->used, data, n);
+		ctx->used += n;
+		data += n;
+		length -= n;
+		if (ctx->used < SHA256_BLOCK_SIZE) {
+			return;
+		}
+		Sha256Blocks(ctx->state, ctx->buffer, 1);
+		ctx->used = 0;
+	}
+
+	// whole blocks are compressed straight from @data
+	blocks = length / SHA256_BLOCK_SIZE;
+	if (blocks) {
+		Sha256Blocks(ctx->state, data, blocks);
+		data += blocks * SHA256_BLOCK_SIZE;
+		length -= blocks * SHA256_BLOCK_SIZE;
+	}
+
+	memcpy(ctx->buffer, data, length);
+	ctx->used = length;
+}
+
+static void Sha256Finish(hmac_sha256_ctx_t *ctx, uint8_t *digest)
+{
+	const uint64_t bits = ctx->length * 8;
+	int i;
+
+	ctx->buffer[ctx->used++] = 0x80;
+	if (ctx->used > SHA256_BLOCK_SIZE - 8) {
+		memset(ctx->buffer + ctx->used, 0,
+				SHA256_BLOCK_SIZE - ctx->used);
+		Sha256Blocks(ctx->state, ctx->buffer, 1);
+		ctx->used = 0;
+	}
+	memset(ctx->buffer + ctx->used, 0, SHA256_BLOCK_SIZE - 8 - ctx->used);
+	StoreBe32(ctx->buffer + SHA256_BLOCK_SIZE - 8, bits >> 32);
+	StoreBe32(ctx->buffer + SHA256_BLOCK_SIZE - 4, bits);
+	Sha256Blocks(ctx->state, ctx->buffer, 1);
+
+	for (i = 0; i < 8; i++) {
+		StoreBe32(digest + 4 * i, ctx->state[i]);
+	}
+}
+
+void HmacSha256SetKey(hmac_sha256_key_t *key, const uint8_t *key_data,
+		size_t key_length)
+{
+	uint8_t block[SHA256_BLOCK_SIZE];
+	hmac_sha256_ctx_t ctx;
+	int i;
+
+	memset(block, 0, sizeof(block));
+	if (key_length > SHA256_BLOCK_SIZE) {
+		Sha256Start(&ctx, sha256_iv, 0);
+		Sha256Feed(&ctx, key_data, key_length);
+		Sha256Finish(&ctx, block);
+	} else {
+		memcpy(block, key_data, key_length);
+	}
+
+	for (i = 0; i < SHA256_BLOCK_SIZE; i++) {
+		block[i] ^= 0x36;
+	}
+	memcpy(key->inner, sha256_iv, sizeof(key->inner));
+	Sha256Blocks(key->inner, block, 1);
+
+	for (i = 0; i < SHA256_BLOCK_SIZE; i++) {
+		block[i] ^= 0x36 ^ 0x5c;
+	}
+	memcpy(key->outer, sha256_iv, sizeof(key->outer));
+	Sha256Blocks(key->outer, block, 1);
+
+	memset(block, 0, sizeof(block));
+	memset(&ctx, 0, sizeof(ctx));
+}
+
+void HmacSha256Init(hmac_sha256_ctx_t *ctx, const hmac_sha256_key_t *key)
+{
+	ctx->key = key;
+	Sha256Start(ctx, key->inner, SHA256_BLOCK_SIZE);
+}
+
+void HmacSha256Update(hmac_sha256_ctx_t *ctx, const void *data,
+		size_t length)
+{
+	Sha256Feed(ctx, data, length);
+}
+
+void HmacSha256Final(hmac_sha256_ctx_t *ctx, uint8_t *mac)
+{
+	uint8_t digest[SHA256_DIGEST_SIZE];
+
+	Sha256Finish(ctx, digest);
+	Sha256Start(ctx, ctx->key->outer, SHA256_BLOCK_SIZE);
+	Sha256Feed(ctx, digest, sizeof(digest));
+	Sha256Finish(ctx, mac);
+
+	memset(digest, 0, sizeof(digest));
+	memset(ctx, 0, sizeof(*ctx));
+}
+
+void HmacSha256(const hmac_sha256_key_t *key, const void *message,
+		size_t length, uint8_t *mac)
+{
+	hmac_sha256_ctx_t ctx;
+
+	HmacSha256Init(&ctx, key);
+	HmacSha256Update(&ctx, message, length);
+	HmacSha256Final(&ctx, mac);
+}
+
+const char *HmacSha256Engine(void)
+{
+	return sha256_engine;
+}
@@ -0,0 +1,73 @@
+/*
+ *
+ * Copyright (C) 2017 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HMAC_SHA256_H
+#define HMAC_SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_BLOCK_SIZE 64
+#define SHA256_DIGEST_SIZE 32
+
+/*
+ * HMAC-SHA256 key as SHA-256 states after the ipad and opad blocks, so
+ * every MAC starts two compressions in. A MAC of up to 55 bytes costs
+ * two compressions in total.
+ */
+typedef struct {
+	uint32_t inner[8];
+	uint32_t outer[8];
+} hmac_sha256_key_t;
+
+/*
+ * MAC in progress of a message fed piecewise
+ */
+typedef struct {
+	const hmac_sha256_key_t *key;
+	uint32_t state[8];
+	uint8_t buffer[SHA256_BLOCK_SIZE];
+	uint32_t used;
+	uint64_t length;
+} hmac_sha256_ctx_t;
+
+/*
+ * Derive midstates of @key_length bytes of @key_data into @key
+ */
+void HmacSha256SetKey(hmac_sha256_key_t *key, const uint8_t *key_data,
+		size_t key_length);
+
+void HmacSha256Init(hmac_sha256_ctx_t *ctx, const hmac_sha256_key_t *key);
+void HmacSha256Update(hmac_sha256_ctx_t *ctx, const void *data,
+		size_t length);
+/*
+ * Writes SHA256_DIGEST_SIZE bytes of MAC into @mac and wipes @ctx
+ */
+void HmacSha256Final(hmac_sha256_ctx_t *ctx, uint8_t *mac);
+
+/*
+ * One-shot MAC of @length bytes of @message
+ */
+void HmacSha256(const hmac_sha256_key_t *key, const void *message,
+		size_t length, uint8_t *mac);
+
+/*
+ * @return name of the compression function in use
+ */
+const char *HmacSha256Engine(void);
+
+#endif /* HMAC_SHA256_H */
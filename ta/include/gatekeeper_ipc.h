@@ -18,6 +18,7 @@
 #ifndef GATEKEEPER_IPC_H
 #define GATEKEEPER_IPC_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
 
@@ -34,6 +35,11 @@
 typedef enum {
 	GK_ENROLL,
 	GK_VERIFY,
+	GK_WARMUP,
+	GK_VERIFY_BATCH,
+	GK_DELETE_USER,
+	GK_DELETE_ALL_USERS,
+	GK_GET_STATS,
 } gatekeeper_command_t;
 
 /*
@@ -51,6 +57,26 @@ typedef enum {
  */
 #define RECV_BUF_SIZE 8192
 
+/*
+ * Longest password accepted by the TA. Android passes derived credentials
+ * of a few dozen bytes, the limit only bounds what a caller can make the
+ * TA hash.
+ */
+#define GK_MAX_PASSWORD_LENGTH 1024
+
+/*
+ * Sizes of packed password_handle_t and hw_auth_token_t structures,
+ * see ta_gatekeeper.h
+ */
+#define GK_PASSWORD_HANDLE_SIZE 58
+#define GK_AUTH_TOKEN_SIZE 69
+
+/*
+ * Offset of the secure user id in a password handle, which HAL uses to
+ * track lockouts reported by the TA
+ */
+#define GK_PASSWORD_HANDLE_USER_ID_OFFSET 1
+
 /*
  * General message functions
  */
@@ -176,4 +202,339 @@ static inline void deserialize_int64(const uint8_t **buffer, uint64_t *data)
 	memcpy(data, *buffer, sizeof(*data));
 	*buffer += sizeof(*data);
 }
+
+/*
+ * Wire schema of TA commands
+ *
+ * Every message is described once as a list of X(kind, name, max) fields,
+ * and C structures, sizes, encoders and decoders for both HAL and TA are
+ * generated from it below. Field kinds are:
+ *  INT   - 4 bytes integer;
+ *  INT64 - 8 bytes integer;
+ *  BLOB  - 4 bytes length followed by data, at most @max bytes long.
+ *
+ * Each response starts with 4 bytes error code. ERROR_RETRY is followed by
+ * 4 bytes retry timeout, ERROR_NONE is followed by response fields of the
+ * command, other errors carry nothing.
+ */
+
+#define GK_ENROLL_REQUEST(X) \
+	X(INT, uid, 0) \
+	X(BLOB, desired_password, GK_MAX_PASSWORD_LENGTH) \
+	X(BLOB, current_password, GK_MAX_PASSWORD_LENGTH) \
+	X(BLOB, current_password_handle, GK_PASSWORD_HANDLE_SIZE)
+
+#define GK_ENROLL_RESPONSE(X) \
+	X(BLOB, password_handle, GK_PASSWORD_HANDLE_SIZE)
+
+#define GK_VERIFY_REQUEST(X) \
+	X(INT, uid, 0) \
+	X(INT64, challenge, 0) \
+	X(BLOB, enrolled_password_handle, GK_PASSWORD_HANDLE_SIZE) \
+	X(BLOB, provided_password, GK_MAX_PASSWORD_LENGTH)
+
+#define GK_VERIFY_RESPONSE(X) \
+	X(BLOB, auth_token, GK_AUTH_TOKEN_SIZE) \
+	X(INT, request_reenroll, 0)
+
+/*
+ * Warm-up request is empty, response reports password KDF calibration:
+ * iterations given to new handles and their estimated cost
+ */
+#define GK_WARMUP_RESPONSE(X) \
+	X(INT, kdf_iterations, 0) \
+	X(INT, kdf_cost_us, 0)
+
+/*
+ * Batched verify request is GK_VERIFY_BATCH_REQUEST header followed by
+ * @count GK_VERIFY_REQUEST messages, response is @count GK_VERIFY_RESPONSE
+ * messages in the same order. Every message is sized by its own fields,
+ * so the batch needs no offsets.
+ */
+#define GK_VERIFY_BATCH_MAX 8
+
+#define GK_VERIFY_BATCH_REQUEST(X) \
+	X(INT, count, 0)
+
+/*
+ * Delete requests drop failure records of Android user @uid or, for
+ * GK_DELETE_ALL_USERS with an empty request, of every user. Responses are
+ * the error code only.
+ */
+#define GK_DELETE_USER_REQUEST(X) \
+	X(INT, uid, 0)
+
+#define GK_DELETE_USER_RESPONSE(X)
+
+#define GK_DELETE_ALL_USERS_RESPONSE(X)
+
+/*
+ * Stats request is empty, response holds TA counters since the TA was
+ * loaded: calls and total milliseconds of each stage, requests refused
+ * by throttling, failed attempts that started a lockout, and users in
+ * the failure record table out of its capacity.
+ */
+#define GK_STATS_STAGE(X, stage) \
+	X(INT, stage##_count, 0) \
+	X(INT64, stage##_ms, 0)
+
+#define GK_GET_STATS_RESPONSE(X) \
+	GK_STATS_STAGE(X, master_key) \
+	GK_STATS_STAGE(X, password_mac) \
+	GK_STATS_STAGE(X, keymaster) \
+	GK_STATS_STAGE(X, mint) \
+	GK_STATS_STAGE(X, record_read) \
+	GK_STATS_STAGE(X, record_write) \
+	X(INT, throttled, 0) \
+	X(INT, lockouts, 0) \
+	X(INT, records, 0) \
+	X(INT, record_capacity, 0)
+
+/*
+ * Field primitives. Decoders are only called after fixed part of the
+ * message is known to fit, so integers need no checks and every blob
+ * needs one: its length against @max and bytes @left in the buffer.
+ * Rejected blob is returned empty and the buffer is not advanced, so
+ * decoding goes on without branches and the result is checked once.
+ */
+
+typedef struct {
+	const uint8_t *data;
+	uint32_t length;
+} gk_blob_t;
+
+#define GK_WIRE_SIZE_INT	4
+#define GK_WIRE_SIZE_INT64	8
+#define GK_WIRE_SIZE_BLOB	4
+
+#define GK_C_TYPE_INT		uint32_t
+#define GK_C_TYPE_INT64		uint64_t
+#define GK_C_TYPE_BLOB		gk_blob_t
+
+#define GK_MAX(a, b)		((a) > (b) ? (a) : (b))
+
+static inline uint64_t gk_payload_INT(uint32_t value)
+{
+	(void)value;
+	return 0;
+}
+
+static inline uint64_t gk_payload_INT64(uint64_t value)
+{
+	(void)value;
+	return 0;
+}
+
+static inline uint64_t gk_payload_BLOB(gk_blob_t value)
+{
+	return value.length;
+}
+
+static inline void gk_put_INT(uint8_t **buffer, uint32_t value)
+{
+	serialize_int(buffer, value);
+}
+
+static inline void gk_put_INT64(uint8_t **buffer, uint64_t value)
+{
+	serialize_int64(buffer, value);
+}
+
+static inline void gk_put_BLOB(uint8_t **buffer, gk_blob_t value)
+{
+	serialize_blob(buffer, value.data, value.length);
+}
+
+static inline bool gk_get_INT(const uint8_t **buffer, uint32_t *value,
+		uint32_t max, uint32_t *left)
+{
+	(void)max;
+	(void)left;
+	deserialize_int(buffer, value);
+	return true;
+}
+
+static inline bool gk_get_INT64(const uint8_t **buffer, uint64_t *value,
+		uint32_t max, uint32_t *left)
+{
+	(void)max;
+	(void)left;
+	deserialize_int64(buffer, value);
+	return true;
+}
+
+static inline bool gk_get_BLOB(const uint8_t **buffer, gk_blob_t *value,
+		uint32_t max, uint32_t *left)
+{
+	uint32_t length;
+	bool fits;
+
+	deserialize_int(buffer, &length);
+	fits = length <= (max < *left ? max : *left);
+	length = fits ? length : 0;
+
+	value->data = *buffer;
+	value->length = length;
+	*buffer += length;
+	*left -= length;
+	return fits;
+}
+
+#define GK_FIELD_MEMBER(kind, name, max)	GK_C_TYPE_##kind name;
+#define GK_FIELD_FIXED_SIZE(kind, name, max)	+ GK_WIRE_SIZE_##kind
+#define GK_FIELD_MAX_SIZE(kind, name, max)	+ GK_WIRE_SIZE_##kind + (max)
+#define GK_FIELD_PAYLOAD(kind, name, max)	+ gk_payload_##kind(msg->name)
+#define GK_FIELD_PUT(kind, name, max)		gk_put_##kind(&iter, msg->name);
+#define GK_FIELD_GET(kind, name, max) \
+	ok &= gk_get_##kind(&iter, &msg->name, (max), &left);
+
+static inline uint32_t gk_clamp_size(uint64_t size)
+{
+	return size > UINT32_MAX ? UINT32_MAX : (uint32_t)size;
+}
+
+static inline bool gk_fits(uint32_t size, uint32_t fixed_size, uint32_t *left)
+{
+	if (size < fixed_size)
+		return false;
+	*left = size - fixed_size;
+	return true;
+}
+
+/*
+ * Request @type_t with @FIELDS, @FIELDS_FIXED_SIZE is its size without
+ * blob data.
+ *
+ * @type_size returns number of bytes @msg takes on the wire.
+ * @type_encode writes @msg to @buffer of @size bytes, returns end of
+ * written data or NULL if @msg does not fit.
+ * @type_decode parses @size bytes of @buffer to @msg, blobs point into
+ * @buffer. Returns false if @buffer is truncated or a blob is too long.
+ */
+#define GK_DEFINE_REQUEST(type, FIELDS) \
+typedef struct { \
+	FIELDS(GK_FIELD_MEMBER) \
+} type##_t; \
+\
+enum { FIELDS##_FIXED_SIZE = 0 FIELDS(GK_FIELD_FIXED_SIZE) }; \
+\
+static inline uint32_t type##_size(const type##_t *msg) \
+{ \
+	(void)msg; \
+	return gk_clamp_size((uint64_t)FIELDS##_FIXED_SIZE \
+			FIELDS(GK_FIELD_PAYLOAD)); \
+} \
+\
+static inline uint8_t *type##_encode(uint8_t *buffer, uint32_t size, \
+		const type##_t *msg) \
+{ \
+	uint8_t *iter = buffer; \
+\
+	if (type##_size(msg) > size) \
+		return NULL; \
+	FIELDS(GK_FIELD_PUT) \
+	return iter; \
+} \
+\
+static inline bool type##_decode(type##_t *msg, const uint8_t *buffer, \
+		uint32_t size) \
+{ \
+	const uint8_t *iter = buffer; \
+	uint32_t left; \
+	bool ok = true; \
+\
+	if (!gk_fits(size, FIELDS##_FIXED_SIZE, &left)) \
+		return false; \
+	FIELDS(GK_FIELD_GET) \
+	(void)iter; \
+	(void)left; \
+	return ok; \
+}
+
+/*
+ * Response @type_t with @FIELDS sent on ERROR_NONE. @FIELDS_SIZE is the
+ * largest size of the response, functions are the same as for requests.
+ */
+#define GK_DEFINE_RESPONSE(type, FIELDS) \
+typedef struct { \
+	uint32_t error; \
+	uint32_t retry_timeout; \
+	FIELDS(GK_FIELD_MEMBER) \
+} type##_t; \
+\
+enum { \
+	FIELDS##_FIXED_SIZE = 0 FIELDS(GK_FIELD_FIXED_SIZE), \
+	FIELDS##_SIZE = GK_WIRE_SIZE_INT + GK_MAX(GK_WIRE_SIZE_INT, \
+			0 FIELDS(GK_FIELD_MAX_SIZE)), \
+}; \
+\
+static inline uint32_t type##_size(const type##_t *msg) \
+{ \
+	switch (msg->error) { \
+	case ERROR_RETRY: \
+		return GK_WIRE_SIZE_INT + GK_WIRE_SIZE_INT; \
+	case ERROR_NONE: \
+		return gk_clamp_size((uint64_t)GK_WIRE_SIZE_INT + \
+				FIELDS##_FIXED_SIZE FIELDS(GK_FIELD_PAYLOAD)); \
+	default: \
+		return GK_WIRE_SIZE_INT; \
+	} \
+} \
+\
+static inline uint8_t *type##_encode(uint8_t *buffer, uint32_t size, \
+		const type##_t *msg) \
+{ \
+	uint8_t *iter = buffer; \
+\
+	if (type##_size(msg) > size) \
+		return NULL; \
+	serialize_int(&iter, msg->error); \
+	if (msg->error == ERROR_RETRY) { \
+		serialize_int(&iter, msg->retry_timeout); \
+	} else if (msg->error == ERROR_NONE) { \
+		FIELDS(GK_FIELD_PUT) \
+	} \
+	return iter; \
+} \
+\
+static inline bool type##_decode(type##_t *msg, const uint8_t *buffer, \
+		uint32_t size) \
+{ \
+	const uint8_t *iter = buffer; \
+	uint32_t left; \
+	bool ok = true; \
+\
+	if (size < GK_WIRE_SIZE_INT) \
+		return false; \
+	deserialize_int(&iter, &msg->error); \
+	size -= GK_WIRE_SIZE_INT; \
+	msg->retry_timeout = 0; \
+\
+	if (msg->error == ERROR_RETRY) { \
+		if (size < GK_WIRE_SIZE_INT) \
+			return false; \
+		deserialize_int(&iter, &msg->retry_timeout); \
+	} else if (msg->error == ERROR_NONE) { \
+		if (!gk_fits(size, FIELDS##_FIXED_SIZE, &left)) \
+			return false; \
+		FIELDS(GK_FIELD_GET) \
+	} \
+	(void)left; \
+	return ok; \
+}
+
+GK_DEFINE_REQUEST(gk_enroll_request, GK_ENROLL_REQUEST)
+GK_DEFINE_RESPONSE(gk_enroll_response, GK_ENROLL_RESPONSE)
+GK_DEFINE_REQUEST(gk_verify_request, GK_VERIFY_REQUEST)
+GK_DEFINE_RESPONSE(gk_verify_response, GK_VERIFY_RESPONSE)
+GK_DEFINE_RESPONSE(gk_warmup_response, GK_WARMUP_RESPONSE)
+GK_DEFINE_REQUEST(gk_verify_batch_request, GK_VERIFY_BATCH_REQUEST)
+GK_DEFINE_REQUEST(gk_delete_user_request, GK_DELETE_USER_REQUEST)
+GK_DEFINE_RESPONSE(gk_delete_user_response, GK_DELETE_USER_RESPONSE)
+GK_DEFINE_RESPONSE(gk_delete_all_users_response, GK_DELETE_ALL_USERS_RESPONSE)
+GK_DEFINE_RESPONSE(gk_get_stats_response, GK_GET_STATS_RESPONSE)
+
+#define GK_VERIFY_BATCH_RESPONSE_SIZE \
+	(GK_VERIFY_BATCH_MAX * GK_VERIFY_RESPONSE_SIZE)
+
 #endif /* GATEKEEPER_IPC_H */
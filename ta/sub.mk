@@ -15,3 +15,10 @@
 
 global-incdirs-y += include
 srcs-y += gatekeeper_ta.c failure_record.c
+
+ifeq ($(CFG_GATEKEEPER_HMAC_SHA256),y)
+srcs-y += hmac_sha256.c
+ifeq ($(CFG_ARM64_ta_arm64)-$(CFG_GATEKEEPER_HMAC_SHA256_CE),y-y)
+cflags-hmac_sha256.c-y += -march=armv8-a+crypto
+endif
+endif
@@ -26,10 +26,17 @@
  * which defined in system/gatekeeper/include/gatekeeper/password_handle.h
  */
 
-#define HANDLE_VERSION 2
+#define HANDLE_VERSION 3
 #define HANDLE_VERSION_THROTTLE 2
+#define HANDLE_VERSION_KDF 3
 #define HANDLE_FLAG_THROTTLE_SECURE 1
 
+/*
+ * Handles since HANDLE_VERSION_KDF keep iteration count of the password
+ * KDF in upper half of flags, so the handle layout stays the same
+ */
+#define HANDLE_FLAG_KDF_ITERATIONS_SHIFT 32
+
 typedef uint64_t secure_id_t;
 typedef uint64_t salt_t;
 
@@ -44,6 +51,13 @@ typedef struct __packed {
 	bool hardware_backed;
 } password_handle_t;
 
+/*
+ * Signed metadata of a password handle: version, user_id and flags, the
+ * leading fields of password_handle_t
+ */
+#define HANDLE_METADATA_LENGTH \
+	(sizeof(uint8_t) + sizeof(secure_id_t) + sizeof(uint64_t))
+
 
 /*
  * Please keep hw_auth_token_t structure consistent with its counterpart
@@ -94,4 +108,40 @@ typedef struct __packed {
  */
 #define KM_GET_AUTHTOKEN_KEY 65536
 
+/*
+ * Password KDF is calibrated once per device to take about this long,
+ * 0 keeps it at a single HMAC
+ */
+#ifndef CFG_GATEKEEPER_KDF_TARGET_MS
+#define CFG_GATEKEEPER_KDF_TARGET_MS 50
+#endif
+
+/*
+ * Calibration never picks more KDF iterations than this, and handles
+ * asking for more are rejected, so a forged handle cannot stall the TA.
+ * The bound does not follow calibration, which may shrink, so handles
+ * made under an earlier calibration keep verifying.
+ */
+#define KDF_MAX_ITERATIONS (1 << 20)
+
+/*
+ * Calibration doubles KDF iterations until one run takes this long
+ */
+#define KDF_CALIBRATION_MIN_MS 10
+
+/*
+ * KDF checks every this many iterations if the HAL cancelled the call
+ */
+#define KDF_CANCEL_CHECK_ITERATIONS 256
+
+/*
+ * Keymaster calls give up after this time instead of blocking forever
+ */
+#define KEYMASTER_TIMEOUT_MS 1000
+
+/*
+ * Cached auth token key is fetched from keymaster again after this time
+ */
+#define AUTH_TOKEN_KEY_REFRESH_MS 60000
+
 #endif /* TA_GATEKEEPER_H */
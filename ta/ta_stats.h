@@ -0,0 +1,67 @@
+/*
+ *
+ * Copyright (C) 2017 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TA_STATS_H
+#define TA_STATS_H
+
+#include <stdint.h>
+#include "failure_record.h"
+
+/*
+ * TA stages timed for GK_GET_STATS
+ */
+typedef enum {
+	STAGE_MASTER_KEY,	/* master key load from secure storage */
+	STAGE_PASSWORD_MAC,	/* password KDF of enroll or verify */
+	STAGE_KEYMASTER,	/* auth token key fetch from keymaster TA */
+	STAGE_MINT,		/* auth token HMAC */
+	STAGE_RECORD_READ,	/* failure record journal load */
+	STAGE_RECORD_WRITE,	/* failure record journal commit */
+	STAGE_COUNT,
+} ta_stage_t;
+
+/*
+ * Counters since the TA instance was loaded. Time comes from the
+ * millisecond system clock: a shorter stage adds 0 or 1, which averages
+ * out to its real time over many calls.
+ */
+typedef struct {
+	uint32_t count[STAGE_COUNT];
+	uint64_t time_ms[STAGE_COUNT];
+	/* Requests refused with ERROR_RETRY */
+	uint32_t throttled;
+	/* Failed attempts that started a lockout */
+	uint32_t lockouts;
+} ta_stats_t;
+
+extern ta_stats_t ta_stats;
+
+/*
+ * @return start time of a stage to be passed to StageEnd()
+ */
+static inline uint64_t StageStart(void)
+{
+	return GetTimestamp();
+}
+
+static inline void StageEnd(ta_stage_t stage, uint64_t start)
+{
+	ta_stats.count[stage]++;
+	ta_stats.time_ms[stage] += GetTimestamp() - start;
+}
+
+#endif /* TA_STATS_H */
@@ -23,12 +23,21 @@
 #define USER_TA_HEADER_DEFINES_H
 
 #include <gatekeeper_ipc.h> /* To get the TA UUID define */
+#include "failure_record.h" /* To size the heap for failure records */
 
 #define TA_UUID TA_GATEKEEPER_UUID
 
-#define TA_FLAGS                    (TA_FLAG_MULTI_SESSION | TA_FLAG_EXEC_DDR)
+/*
+ * One instance serves every session and stays loaded without sessions,
+ * so failure records and key caches are shared by all HAL sessions and
+ * survive a HAL restart. OP-TEE runs its commands one at a time.
+ */
+#define TA_FLAGS                    (TA_FLAG_SINGLE_INSTANCE | \
+                                     TA_FLAG_MULTI_SESSION | \
+                                     TA_FLAG_INSTANCE_KEEP_ALIVE | \
+                                     TA_FLAG_EXEC_DDR)
 #define TA_STACK_SIZE               (2 * 1024)
-#define TA_DATA_SIZE                (32 * 1024)
+#define TA_DATA_SIZE                (32 * 1024 + FAILURE_RECORD_TABLE_SIZE)
 
 #define TA_CURRENT_TA_EXT_PROPERTIES \
     { "gp.ta.description", USER_TA_PROP_TYPE_STRING, \